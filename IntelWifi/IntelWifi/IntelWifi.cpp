@@ -11,6 +11,8 @@ extern "C" {
 #include "IwlDvmOpMode.hpp"
 
 #include <sys/errno.h>
+#include <pexpert/pexpert.h>
+#include <kern/thread.h>
 
 #define super IOEthernetController
 OSDefineMetaClassAndStructors(IntelWifi, IOEthernetController)
@@ -123,6 +125,84 @@ bool IntelWifi::start(IOService *provider) {
         return 0;
     }
     
+    fRxPollSource = IOInterruptEventSource::interruptEventSource(this,
+                                                                 (IOInterruptEventAction) &IntelWifi::rxPollOccured);
+    if (!fRxPollSource) {
+        TraceLog("RX poll source init failed!");
+        releaseAll();
+        return 0;
+    }
+    
+    if (fWorkLoop->addEventSource(fRxPollSource) != kIOReturnSuccess) {
+        TraceLog("EventSource registration failed");
+        releaseAll();
+        return 0;
+    }
+    fRxPollSource->enable();
+    
+    fTxWakeSource = IOInterruptEventSource::interruptEventSource(this,
+                                                                 (IOInterruptEventAction) &IntelWifi::txWakeOccured);
+    if (!fTxWakeSource) {
+        TraceLog("TX wake source init failed!");
+        releaseAll();
+        return 0;
+    }
+    
+    if (fWorkLoop->addEventSource(fTxWakeSource) != kIOReturnSuccess) {
+        TraceLog("EventSource registration failed");
+        releaseAll();
+        return 0;
+    }
+    fTxWakeSource->enable();
+    
+    /* one timer drives the stuck queue watchdog of all TX queues */
+    fTxWatchdog = IOTimerEventSource::timerEventSource(this,
+                                                       (IOTimerEventSource::Action) &IntelWifi::txWatchdogOccured);
+    if (!fTxWatchdog) {
+        TraceLog("TX watchdog init failed!");
+        releaseAll();
+        return 0;
+    }
+    
+    if (fWorkLoop->addEventSource(fTxWatchdog) != kIOReturnSuccess) {
+        TraceLog("EventSource registration failed");
+        releaseAll();
+        return 0;
+    }
+    
+    for (int ac = 0; ac < IEEE80211_NUM_ACS; ac++) {
+        fTxAcQueue[ac] = IOPacketQueue::withCapacity(IWL_TX_AC_QUEUE_LEN);
+        if (!fTxAcQueue[ac]) {
+            TraceLog("TX AC queue init failed!");
+            releaseAll();
+            return false;
+        }
+    }
+    
+    /* The RX allocator has a work loop of its own, so allocating pages
+     * never holds up interrupt handling */
+    fRxAllocWorkLoop = IOWorkLoop::workLoop();
+    if (!fRxAllocWorkLoop) {
+        TraceLog("RX allocator work loop init failed!");
+        releaseAll();
+        return 0;
+    }
+    
+    fRxAllocSource = IOInterruptEventSource::interruptEventSource(this,
+                                                                  (IOInterruptEventAction) &IntelWifi::rxAllocOccured);
+    if (!fRxAllocSource) {
+        TraceLog("RX allocator source init failed!");
+        releaseAll();
+        return 0;
+    }
+    
+    if (fRxAllocWorkLoop->addEventSource(fRxAllocSource) != kIOReturnSuccess) {
+        TraceLog("EventSource registration failed");
+        releaseAll();
+        return 0;
+    }
+    fRxAllocSource->enable();
+    
     gate = IOCommandGate::commandGate(this, (IOCommandGate::Action)&IntelWifi::gateAction);
     
     if (fWorkLoop->addEventSource(gate) != kIOReturnSuccess) {
@@ -136,6 +216,10 @@ bool IntelWifi::start(IOService *provider) {
 //    fWorkLoop->enableAllInterrupts();
 //    fWorkLoop->enableAllEventSources();
     
+    /* module parameters are passed as boot-args */
+    PE_parse_boot_argn("iwl_amsdu_size", &iwlwifi_mod_params.amsdu_size,
+                       sizeof(iwlwifi_mod_params.amsdu_size));
+    
     fTrans = iwl_trans_pcie_alloc(fConfiguration);
     if (!fTrans) {
         TraceLog("iwl_trans_pcie_alloc failed");
@@ -144,6 +228,42 @@ bool IntelWifi::start(IOService *provider) {
     }
     fTrans->dev = this;
     fTrans->gate = gate;
+    IWL_TRANS_GET_PCIE_TRANS(fTrans)->rba.alloc_wq = fRxAllocWorkLoop;
+    IWL_TRANS_GET_PCIE_TRANS(fTrans)->rba.rx_alloc = fRxAllocSource;
+    IWL_TRANS_GET_PCIE_TRANS(fTrans)->tx_wake = fTxWakeSource;
+    IWL_TRANS_GET_PCIE_TRANS(fTrans)->txq_wd.timer = fTxWatchdog;
+    
+    /* RBs handled per RX pass before the work loop is rescheduled */
+    UInt32 budget;
+    if (PE_parse_boot_argn("iwl_rx_budget", &budget, sizeof(budget)))
+        IWL_TRANS_GET_PCIE_TRANS(fTrans)->rx_budget = max_t(UInt32, RX_BUDGET_MIN, min_t(UInt32, budget, RX_BUDGET_MAX));
+    
+    /* payloads up to this size are copied into the TX bounce slots */
+    UInt32 copybreak;
+    if (PE_parse_boot_argn("iwl_tx_copybreak", &copybreak, sizeof(copybreak)))
+        IWL_TRANS_GET_PCIE_TRANS(fTrans)->tx_copybreak = min_t(UInt32, copybreak, IWL_TX_COPYBREAK_MAX);
+    
+    /* TBs carry a 12 bit length; see IWL_PCIE_MAX_DATA_SEGS for the count */
+    fTxMbufCursor = IOMbufNaturalMemoryCursor::withSpecification(IWL_TX_MAX_TB_SIZE,
+                                                                 IWL_PCIE_MAX_DATA_SEGS(IWL_TRANS_GET_PCIE_TRANS(fTrans)));
+    if (!fTxMbufCursor) {
+        TraceLog("TX mbuf cursor init failed!");
+        releaseAll();
+        return false;
+    }
+    
+    if (!createRxQueueSources()) {
+        TraceLog("RX queue sources init failed!");
+        releaseAll();
+        return false;
+    }
+    
+    if (IWL_TRANS_GET_PCIE_TRANS(fTrans)->msix_enabled &&
+        iwl_pcie_init_msix_handler(IWL_TRANS_GET_PCIE_TRANS(fTrans))) {
+        TraceLog("MSI-X sources init failed!");
+        releaseAll();
+        return false;
+    }
     
     
 #ifdef CONFIG_IWLMVM
@@ -241,16 +361,44 @@ bool IntelWifi::start(IOService *provider) {
 
 void IntelWifi::stop(IOService *provider) {
     
+    stopBusyPoll();
+    
     if (fWorkLoop) {
         if (fInterruptSource) {
             fInterruptSource->disable();
             fWorkLoop->removeEventSource(fInterruptSource);
         }
+        if (fRxPollSource) {
+            fRxPollSource->disable();
+            fWorkLoop->removeEventSource(fRxPollSource);
+        }
+        if (fTxWakeSource) {
+            fTxWakeSource->disable();
+            fWorkLoop->removeEventSource(fTxWakeSource);
+        }
+    }
+    IWL_TRANS_GET_PCIE_TRANS(fTrans)->tx_wake = NULL;
+    
+    IOSimpleLockLock(IWL_TRANS_GET_PCIE_TRANS(fTrans)->txq_wd.lock);
+    IWL_TRANS_GET_PCIE_TRANS(fTrans)->txq_wd.timer = NULL;
+    IOSimpleLockUnlock(IWL_TRANS_GET_PCIE_TRANS(fTrans)->txq_wd.lock);
+    if (fTxWatchdog) {
+        fTxWatchdog->cancelTimeout();
+        if (fWorkLoop)
+            fWorkLoop->removeEventSource(fTxWatchdog);
     }
     
     struct iwl_priv *priv = (struct iwl_priv *)hw->priv;
 
     opmode->stop(priv);
+    
+    /* waits for running vectors, RSS queues and allocator */
+    releaseMsixSources();
+    releaseRxQueueSources();
+    if (fRxAllocWorkLoop && fRxAllocSource)
+        fRxAllocWorkLoop->removeEventSource(fRxAllocSource);
+    IWL_TRANS_GET_PCIE_TRANS(fTrans)->rba.rx_alloc = NULL;
+    
     iwl_drv_stop(fTrans->drv);
     iwl_trans_pcie_free(fTrans);
     fTrans = NULL;
@@ -300,6 +448,8 @@ IOReturn IntelWifi::enable(IONetworkInterface *netif) {
     setLinkStatus(kIONetworkLinkActive | kIONetworkLinkValid, medium);
     fTrans->intf = netif;
     
+    if (getOutputQueue())
+        getOutputQueue()->start();
     
     return kIOReturnSuccess;
 }
@@ -310,9 +460,91 @@ IOReturn IntelWifi::disable(IONetworkInterface *netif) {
     TraceLog("disable");
     fTrans->intf = NULL;
 //    netif->flushInputQueue();
+    
+    if (getOutputQueue()) {
+        getOutputQueue()->stop();
+        getOutputQueue()->flush();
+    }
+    for (int ac = 0; ac < IEEE80211_NUM_ACS; ac++)
+        fTxAcQueue[ac]->flush();
     return kIOReturnSuccess;
 }
 
+/*
+ * Output runs on the work loop, serialised with the wake source and the
+ * interrupt handlers, so the AC queues need no locking of their own.
+ */
+IOOutputQueue* IntelWifi::createOutputQueue() {
+    return IOGatedOutputQueue::withTarget(this, getWorkLoop());
+}
+
+/* cfg80211_classify8021d, with the traffic class the stack already set */
+static u8 iwl_mbuf_to_ac(mbuf_t m) {
+    switch (mbuf_get_traffic_class(m)) {
+        case MBUF_TC_VO:
+            return IEEE80211_AC_VO;
+        case MBUF_TC_VI:
+            return IEEE80211_AC_VI;
+        case MBUF_TC_BK:
+            return IEEE80211_AC_BK;
+        default:
+            return IEEE80211_AC_BE;
+    }
+}
+
+UInt32 IntelWifi::outputPacket(mbuf_t m, void *param) {
+    u8 ac = iwl_mbuf_to_ac(m);
+    
+    if (!hw) {
+        freePacket(m);
+        return kIOReturnOutputDropped;
+    }
+    
+    /*
+     * Each AC backs up on its own, so a stopped best effort queue doesn't
+     * hold up voice. The stack only stalls once an AC is full.
+     */
+    if (fTxAcQueue[ac]->getSize() >= fTxAcQueue[ac]->getCapacity())
+        return kIOReturnOutputStall;
+    
+    fTxAcQueue[ac]->enqueue(m);
+    txAcService();
+    return kIOReturnOutputSuccess;
+}
+
+/*
+ * Hands queued frames to the op mode, highest priority AC first. The op
+ * mode queues them per station while the hardware queue is stopped; once
+ * those queues are full the rest waits here for the next wake.
+ */
+void IntelWifi::txAcService() {
+    struct iwl_priv *priv = (struct iwl_priv *)hw->priv;
+    mbuf_t m;
+    u32 drops;
+    int ret;
+    
+    for (int ac = IEEE80211_AC_VO; ac <= IEEE80211_AC_BK; ac++) {
+        while ((m = fTxAcQueue[ac]->dequeue())) {
+            /* the op mode rings the doorbell once the AC queue is drained */
+            ret = opmode->tx(priv, m, ac, fTxAcQueue[ac]->getSize() > 0);
+            if (ret == -ENOSPC) {
+                fTxAcQueue[ac]->prepend(m);
+                break;
+            }
+            if (ret) {
+                freePacket(m);
+                if (fNetworkStats)
+                    fNetworkStats->outputErrors++;
+            }
+        }
+    }
+    
+    /* and the frames the op mode lost once it had taken them */
+    drops = opmode->tx_drops(priv);
+    if (fNetworkStats)
+        fNetworkStats->outputErrors += drops;
+}
+
 
 
 IOReturn IntelWifi::getHardwareAddress(IOEthernetAddress *addrP) {
@@ -380,6 +612,7 @@ bool IntelWifi::interruptFilter(OSObject* owner, IOFilterInterruptEventSource *
      * If we *don't* have something, we'll re-enable before leaving here.
      */
     iwl_write32(me->fTrans, CSR_INT_MASK, 0x00000000);
+    IWL_TRANS_GET_PCIE_TRANS(me->fTrans)->busy_poll.irq_stamp = iwl_pcie_perf_ns();
     
     return true;
 }
@@ -391,7 +624,399 @@ void IntelWifi::interruptOccured(OSObject* owner, IOInterruptEventSource* sender
         return;
     }
     
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(me->fTrans);
+    
+    trans_pcie->busy_poll.irq_lat_ns += iwl_pcie_perf_ns() - trans_pcie->busy_poll.irq_stamp;
+    trans_pcie->busy_poll.irq_lat_cnt++;
+    
     me->iwl_pcie_irq_handler(0, me->fTrans);
+    iwl_pcie_irq_mod_sample(me->fTrans);
+    
+    if (trans_pcie->busy_poll.enabled)
+        me->busyPollStart();
+}
+
+void IntelWifi::rxPollOccured(OSObject* owner, IOInterruptEventSource* sender, int count) {
+    IntelWifi* me = (IntelWifi*)owner;
+    
+    if (me == 0 || !me->fTrans) {
+        return;
+    }
+    
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(me->fTrans);
+    
+    if (!trans_pcie->rxq) {
+        return;
+    }
+    
+    for (int i = 0; i < me->fTrans->num_rx_queues; i++) {
+        /* RSS queues are polled from their own sources */
+        if (!trans_pcie->rxq[i].poll_pending || me->fRxQueueSource[i])
+            continue;
+        trans_pcie->rxq[i].poll_pending = false;
+        me->iwl_pcie_rx_handle(me->fTrans, i);
+    }
+}
+
+/*
+ * Busy-poll RX mode. The poll thread takes the work loop gate for every
+ * pass, so it is serialised with the interrupt and RX poll sources just
+ * like they are with each other.
+ */
+IOReturn IntelWifi::setBusyPoll(bool enable) {
+    if (!fTrans) {
+        return kIOReturnNotReady;
+    }
+    
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(fTrans);
+    struct iwl_pcie_busy_poll *bp = &trans_pcie->busy_poll;
+    
+    /* only the MSI causes in CSR_INT are polled */
+    if (trans_pcie->msix_enabled) {
+        return kIOReturnUnsupported;
+    }
+    
+    /* the thread ends its session and exits */
+    if (!enable) {
+        stopBusyPoll();
+        IWL_DEBUG_INFO(fTrans, "busy poll off\n");
+        return kIOReturnSuccess;
+    }
+    
+    IOLockLock(bp->lock);
+    if (!bp->thread) {
+        thread_t thread;
+        
+        if (kernel_thread_start((thread_continue_t) &IntelWifi::busyPollThread, this, &thread) != KERN_SUCCESS) {
+            IOLockUnlock(bp->lock);
+            return kIOReturnNoResources;
+        }
+        bp->stop = false;
+        bp->thread = thread;
+        thread_deallocate(thread);
+    }
+    bp->enabled = true;
+    IOLockUnlock(bp->lock);
+    
+    IWL_DEBUG_INFO(fTrans, "busy poll on\n");
+    return kIOReturnSuccess;
+}
+
+/*
+ * Host command latency histograms of the most sent commands. The counters
+ * are updated without a lock, a report can be off by a command or two.
+ */
+IOReturn IntelWifi::getHcmdLatency(UInt64 slowUs, struct iwl_hcmd_lat_report *report) {
+    if (!fTrans) {
+        return kIOReturnNotReady;
+    }
+    
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(fTrans);
+    
+    BUILD_BUG_ON(IWL_PCIE_HCMD_LAT_BUCKETS != IWL_HCMD_LAT_BUCKETS);
+    
+    if (slowUs != IWL_HCMD_LAT_KEEP) {
+        trans_pcie->hcmd_slow_us = (u32) min_t(UInt64, slowUs, UINT32_MAX);
+    }
+    
+    memset(report, 0, sizeof(*report));
+    report->slow_us = trans_pcie->hcmd_slow_us;
+    
+    for (u32 id = 0; id < ARRAY_SIZE(trans_pcie->hcmd_lat); id++) {
+        struct iwl_pcie_hcmd_lat *hist = &trans_pcie->hcmd_lat[id];
+        u32 slot = report->n_cmds;
+        
+        if (!hist->count) {
+            continue;
+        }
+        
+        /* when full, push out the least sent one */
+        if (slot == IWL_HCMD_LAT_MAX_CMDS) {
+            u32 least = 0;
+            
+            for (u32 i = 1; i < IWL_HCMD_LAT_MAX_CMDS; i++) {
+                if (report->cmds[i].hist.count < report->cmds[least].hist.count) {
+                    least = i;
+                }
+            }
+            if (report->cmds[least].hist.count >= hist->count) {
+                continue;
+            }
+            slot = least;
+        } else {
+            report->n_cmds++;
+        }
+        
+        report->cmds[slot].id = iwl_cmd_id(id, 0, 0);
+        report->cmds[slot].hist.total_ns = hist->total_ns;
+        report->cmds[slot].hist.max_ns = hist->max_ns;
+        report->cmds[slot].hist.count = hist->count;
+        memcpy(report->cmds[slot].hist.buckets, hist->buckets, sizeof(hist->buckets));
+    }
+    
+    return kIOReturnSuccess;
+}
+
+/* current interrupt moderation setting and the rates it was chosen from */
+IOReturn IntelWifi::getIrqMod(struct iwl_irq_mod_report *report) {
+    if (!fTrans) {
+        return kIOReturnNotReady;
+    }
+    
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(fTrans);
+    struct iwl_pcie_irq_mod *mod = &trans_pcie->irq_mod;
+    
+    memset(report, 0, sizeof(*report));
+    report->mode = mod->mode == IWL_IRQ_MOD_BULK ? IWL_IRQ_MOD_REPORT_BULK : IWL_IRQ_MOD_REPORT_LATENCY;
+    /* CSR_INT_COALESCING counts 32 usec units */
+    report->coalescing_us = mod->timeout * 32;
+    report->irq_rate = mod->irq_rate;
+    report->pkt_rate = mod->pkt_rate;
+    report->switches = mod->switches;
+    report->isr_rx = trans_pcie->isr_stats.rx;
+    report->isr_tx = trans_pcie->isr_stats.tx;
+    report->isr_unhandled = trans_pcie->isr_stats.unhandled;
+    
+    return kIOReturnSuccess;
+}
+
+void IntelWifi::stopBusyPoll() {
+    if (!fTrans) {
+        return;
+    }
+    
+    struct iwl_pcie_busy_poll *bp = &IWL_TRANS_GET_PCIE_TRANS(fTrans)->busy_poll;
+    
+    IOLockLock(bp->lock);
+    bp->enabled = false;
+    if (bp->thread) {
+        bp->stop = true;
+        IOLockWakeup(bp->lock, &bp->polling, false);
+        while (bp->thread)
+            IOLockSleep(bp->lock, &bp->thread, THREAD_UNINT);
+    }
+    IOLockUnlock(bp->lock);
+}
+
+/* called from the work loop, right after an interrupt was handled */
+void IntelWifi::busyPollStart() {
+    struct iwl_pcie_busy_poll *bp = &IWL_TRANS_GET_PCIE_TRANS(fTrans)->busy_poll;
+    
+    if (!test_bit(STATUS_INT_ENABLED, &fTrans->status))
+        return;
+    
+    IOLockLock(bp->lock);
+    if (bp->thread && !bp->polling && !bp->stop) {
+        _iwl_disable_interrupts(fTrans);
+        bp->polling = true;
+        bp->sessions++;
+        IOLockWakeup(bp->lock, &bp->polling, true);
+    }
+    IOLockUnlock(bp->lock);
+}
+
+/* called with the work loop gate closed */
+void IntelWifi::busyPollEnd() {
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(fTrans);
+    struct iwl_pcie_busy_poll *bp = &trans_pcie->busy_poll;
+    
+    IOLockLock(bp->lock);
+    if (bp->polling) {
+        bp->polling = false;
+        /* unless the device went down meanwhile */
+        if (!trans_pcie->is_down && test_bit(STATUS_DEVICE_ENABLED, &fTrans->status) &&
+            !test_bit(STATUS_INT_ENABLED, &fTrans->status))
+            _iwl_enable_interrupts(fTrans);
+    }
+    IOLockUnlock(bp->lock);
+}
+
+void IntelWifi::busyPollThread(void *arg, wait_result_t wr) {
+    IntelWifi *me = (IntelWifi *)arg;
+    
+    me->busyPollLoop();
+    thread_terminate(current_thread());
+}
+
+void IntelWifi::busyPollLoop() {
+    struct iwl_pcie_busy_poll *bp = &IWL_TRANS_GET_PCIE_TRANS(fTrans)->busy_poll;
+    u64 last_work = 0;
+    int ret;
+    
+    IOLockLock(bp->lock);
+    while (!bp->stop) {
+        if (!bp->polling) {
+            IOLockSleep(bp->lock, &bp->polling, THREAD_UNINT);
+            last_work = iwl_pcie_perf_ns();
+            continue;
+        }
+        IOLockUnlock(bp->lock);
+        
+        fWorkLoop->closeGate();
+        ret = iwl_pcie_busy_poll(fTrans);
+        bp->polls++;
+        if (ret > 0) {
+            bp->hits++;
+            last_work = iwl_pcie_perf_ns();
+        } else if (ret < 0 || !bp->enabled ||
+                   iwl_pcie_perf_ns() - last_work > IWL_BUSY_POLL_IDLE_NS) {
+            busyPollEnd();
+        }
+        fWorkLoop->openGate();
+        
+        IODelay(IWL_BUSY_POLL_DELAY_US);
+        IOLockLock(bp->lock);
+    }
+    IOLockUnlock(bp->lock);
+    
+    /* hand the device back to interrupts before going away */
+    fWorkLoop->closeGate();
+    busyPollEnd();
+    fWorkLoop->openGate();
+    
+    IOLockLock(bp->lock);
+    bp->thread = NULL;
+    IOLockWakeup(bp->lock, &bp->thread, false);
+    IOLockUnlock(bp->lock);
+}
+
+/*
+ * RSS queues are served from a work loop each, so the transport side of
+ * them (rxb handling, refill) runs in parallel with the default queue and
+ * with each other. Their notifications still reach the op mode one at a
+ * time, under fWorkLoop's gate.
+ */
+bool IntelWifi::createRxQueueSources() {
+    for (int i = 1; i < fTrans->num_rx_queues; i++) {
+        fRxQueueWorkLoop[i] = IOWorkLoop::workLoop();
+        if (!fRxQueueWorkLoop[i])
+            return false;
+        
+        fRxQueueSource[i] = IOInterruptEventSource::interruptEventSource(this,
+                                                                         (IOInterruptEventAction) &IntelWifi::rxQueueOccured);
+        if (!fRxQueueSource[i])
+            return false;
+        
+        if (fRxQueueWorkLoop[i]->addEventSource(fRxQueueSource[i]) != kIOReturnSuccess)
+            return false;
+        fRxQueueSource[i]->enable();
+    }
+    return true;
+}
+
+void IntelWifi::releaseRxQueueSources() {
+    for (int i = 0; i < IWL_MAX_RX_HW_QUEUES; i++) {
+        if (fRxQueueWorkLoop[i] && fRxQueueSource[i])
+            fRxQueueWorkLoop[i]->removeEventSource(fRxQueueSource[i]);
+        RELEASE(fRxQueueSource[i]);
+        RELEASE(fRxQueueWorkLoop[i]);
+    }
+}
+
+/*
+ * With MSI-X each vector's source is removed from whichever work loop
+ * iwl_pcie_init_msix_handler put it on.
+ */
+void IntelWifi::releaseMsixSources() {
+    for (int i = 0; i < IWL_MAX_RX_HW_QUEUES; i++) {
+        if (fMsixSource[i]) {
+            fMsixSource[i]->disable();
+            if (fMsixSource[i]->getWorkLoop())
+                fMsixSource[i]->getWorkLoop()->removeEventSource(fMsixSource[i]);
+        }
+        RELEASE(fMsixSource[i]);
+    }
+}
+
+bool IntelWifi::msixFilter(OSObject* owner, IOFilterInterruptEventSource * src) {
+    /* The device masks the vector itself (CSR_MSIX_AUTOMASK_ST_AD) until
+     * the handler clears it, so there is nothing to do here */
+    return owner != 0;
+}
+
+void IntelWifi::msixOccured(OSObject* owner, IOInterruptEventSource* sender, int count) {
+    IntelWifi* me = (IntelWifi*)owner;
+    
+    if (me == 0 || !me->fTrans) {
+        return;
+    }
+    
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(me->fTrans);
+    
+    for (int i = 0; i < trans_pcie->alloc_vecs; i++) {
+        if (me->fMsixSource[i] != sender)
+            continue;
+        if (i == trans_pcie->def_irq)
+            me->iwl_pcie_irq_msix_handler(i);
+        else if (i == trans_pcie->fh_irq)
+            me->iwl_pcie_irq_fh_msix_handler(i);
+        else
+            me->iwl_pcie_irq_rx_msix_handler(i);
+        break;
+    }
+    iwl_pcie_irq_mod_sample(me->fTrans);
+}
+
+void IntelWifi::rxQueueOccured(OSObject* owner, IOInterruptEventSource* sender, int count) {
+    IntelWifi* me = (IntelWifi*)owner;
+    
+    if (me == 0 || !me->fTrans) {
+        return;
+    }
+    
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(me->fTrans);
+    
+    if (!trans_pcie->rxq) {
+        return;
+    }
+    
+    for (int i = 1; i < me->fTrans->num_rx_queues; i++) {
+        if (me->fRxQueueSource[i] != sender)
+            continue;
+        trans_pcie->rxq[i].poll_pending = false;
+        me->iwl_pcie_rx_handle(me->fTrans, i);
+        break;
+    }
+}
+
+void IntelWifi::rxAllocOccured(OSObject* owner, IOInterruptEventSource* sender, int count) {
+    IntelWifi* me = (IntelWifi*)owner;
+    
+    if (me == 0 || !me->fTrans) {
+        return;
+    }
+    
+    iwl_pcie_rx_allocator_work(me->fTrans);
+}
+
+void IntelWifi::txWakeOccured(OSObject* owner, IOInterruptEventSource* sender, int count) {
+    IntelWifi* me = (IntelWifi*)owner;
+    
+    if (me == 0 || !me->fTrans || !me->hw) {
+        return;
+    }
+    
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(me->fTrans);
+    struct iwl_priv *priv = (struct iwl_priv *)me->hw->priv;
+    
+    for (int i = 0; i < IWL_MAX_TVQM_QUEUES; i++)
+        if (test_and_clear_bit(i, trans_pcie->queue_wake))
+            me->opmode->queue_not_full(priv, i);
+    
+    me->txAcService();
+    
+    if (me->getOutputQueue())
+        me->getOutputQueue()->service(IOBasicOutputQueue::kServiceAsync);
+}
+
+void IntelWifi::txWatchdogOccured(OSObject* owner, IOTimerEventSource* sender) {
+    IntelWifi* me = (IntelWifi*)owner;
+    
+    if (me == 0 || !me->fTrans) {
+        return;
+    }
+    
+    iwl_pcie_txq_wd_tick(me->fTrans);
 }
 
 //IOReturn IntelWifi::outputStart(IONetworkInterface *interface, IOOptionBits options) {
@@ -32,13 +32,17 @@ extern "C" {
 #include <IOKit/network/IOEthernetController.h>
 #include <IOKit/network/IOEthernetInterface.h>
 #include <IOKit/network/IOPacketQueue.h>
+#include <IOKit/network/IOGatedOutputQueue.h>
 #include <IOKit/IOMemoryCursor.h>
+#include <IOKit/network/IOMbufMemoryCursor.h>
 
 
 
 #include "IwlTransOps.h"
 #include "IwlOpModeOps.h"
 
+#include "kext_user_shared.h"
+
 
 
 
@@ -48,6 +52,9 @@ extern "C" {
 
 #define    RELEASE(x)    if(x){(x)->release();(x)=NULL;}
 
+/* frames held per access category while its hardware queue is stopped */
+#define IWL_TX_AC_QUEUE_LEN 128
+
 
 enum {
     kOffPowerState,
@@ -75,6 +82,11 @@ public:
     virtual void configure(struct iwl_trans *trans, const struct iwl_trans_config *trans_cfg) override;
     virtual void stop_device(struct iwl_trans *trans, bool low_power) override;
     virtual int start_fw(struct iwl_trans *trans, const struct fw_img *fw, bool run_in_rfkill) override;
+    virtual int tx(struct iwl_trans *trans, mbuf_t skb, struct iwl_device_cmd *dev_cmd, int queue, bool more) override;
+    virtual void tx_push(struct iwl_trans *trans, int queue) override;
+    virtual void reclaim(struct iwl_trans *trans, int queue, int ssn, mbuf_t *skbs) override;
+    
+    void iwl_trans_fw_error(struct iwl_trans *trans);
     
     virtual bool init(OSDictionary *properties) override;
     virtual void free() override;
@@ -89,6 +101,9 @@ public:
     virtual IOReturn enable(IONetworkInterface* netif) override;
     virtual IOReturn disable(IONetworkInterface* netif) override;
     virtual IOReturn getHardwareAddress(IOEthernetAddress* addrP) override;
+    
+    virtual IOOutputQueue* createOutputQueue() override;
+    virtual UInt32 outputPacket(mbuf_t m, void *param) override;
     virtual IOReturn setHardwareAddress(const IOEthernetAddress* addrP) override;
     
     virtual IOReturn setPromiscuousMode(bool active) override
@@ -115,6 +130,17 @@ protected:
     IONetworkStats *fNetworkStats;
     IOEthernetStats *fEthernetStats;
     IOFilterInterruptEventSource* fInterruptSource;
+    IOInterruptEventSource* fRxPollSource;
+    IOWorkLoop *fRxAllocWorkLoop;
+    IOInterruptEventSource* fRxAllocSource;
+    IOWorkLoop *fRxQueueWorkLoop[IWL_MAX_RX_HW_QUEUES];
+    IOInterruptEventSource* fRxQueueSource[IWL_MAX_RX_HW_QUEUES];
+    int fMsixIndex[IWL_MAX_RX_HW_QUEUES];
+    IOFilterInterruptEventSource* fMsixSource[IWL_MAX_RX_HW_QUEUES];
+    IOMbufNaturalMemoryCursor *fTxMbufCursor;
+    IOInterruptEventSource* fTxWakeSource;
+    IOTimerEventSource* fTxWatchdog;
+    IOPacketQueue *fTxAcQueue[IEEE80211_NUM_ACS];
     
     IOMemoryMap *fMemoryMap;
     
@@ -125,24 +151,57 @@ protected:
     
 private:
     inline void releaseAll() {
+        /* the RX allocator must be gone before the transport is freed */
+        stopBusyPoll();
+        releaseMsixSources();
+        releaseRxQueueSources();
+        if (fRxAllocWorkLoop && fRxAllocSource)
+            fRxAllocWorkLoop->removeEventSource(fRxAllocSource);
+        if (fTrans) {
+            IWL_TRANS_GET_PCIE_TRANS(fTrans)->rba.rx_alloc = NULL;
+            iwl_trans_pcie_free(fTrans);
+            fTrans = NULL;
+        }
+        
+        RELEASE(fTxMbufCursor);
+        for (int ac = 0; ac < IEEE80211_NUM_ACS; ac++)
+            RELEASE(fTxAcQueue[ac]);
+        RELEASE(fTxWakeSource);
+        RELEASE(fTxWatchdog);
         RELEASE(fInterruptSource);
+        RELEASE(fRxPollSource);
+        RELEASE(fRxAllocSource);
+        RELEASE(fRxAllocWorkLoop);
         RELEASE(fWorkLoop);
         RELEASE(mediumDict);
         
         RELEASE(fMemoryMap);
-        if (fTrans) {
-            iwl_trans_pcie_free(fTrans);
-            fTrans = NULL;
-        }
         
         RELEASE(pciDevice);
     }
     
     static void interruptOccured(OSObject* owner, IOInterruptEventSource* sender, int count);
+    static void rxPollOccured(OSObject* owner, IOInterruptEventSource* sender, int count);
+    static void rxAllocOccured(OSObject* owner, IOInterruptEventSource* sender, int count);
+    static void txWakeOccured(OSObject* owner, IOInterruptEventSource* sender, int count);
+    static void txWatchdogOccured(OSObject* owner, IOTimerEventSource* sender);
+    static void rxQueueOccured(OSObject* owner, IOInterruptEventSource* sender, int count);
     static bool interruptFilter(OSObject* owner, IOFilterInterruptEventSource * src);
+    static void msixOccured(OSObject* owner, IOInterruptEventSource* sender, int count);
+    static bool msixFilter(OSObject* owner, IOFilterInterruptEventSource * src);
     static IOReturn gateAction(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
     
     int findMSIInterruptTypeIndex();
+    bool createRxQueueSources();
+    void releaseRxQueueSources();
+    void releaseMsixSources();
+    
+    static void busyPollThread(void *arg, wait_result_t wr);
+    void busyPollLoop();
+    void busyPollStart();
+    void busyPollEnd();
+    void stopBusyPoll();
+    void txAcService();
     
     // trans.c
     void iwl_pcie_set_pwr(struct iwl_trans *trans, bool vaux); // line 186
@@ -160,6 +219,7 @@ private:
     void iwl_trans_pcie_handle_stop_rfkill(struct iwl_trans *trans, bool was_in_rfkill); // line 1318
     void iwl_trans_pcie_stop_device(struct iwl_trans *trans, bool low_power); // line 1347
     void iwl_pcie_set_interrupt_capa(struct iwl_trans *trans); // line 1489
+    int iwl_pcie_init_msix_handler(struct iwl_trans_pcie *trans_pcie); // line 1575
     int _iwl_trans_pcie_start_hw(struct iwl_trans *trans, bool low_power); // line 1636
     int iwl_trans_pcie_start_hw(struct iwl_trans *trans, bool low_power); // line 1675
     void iwl_trans_pcie_op_mode_leave(struct iwl_trans *trans); // line 1687
@@ -183,6 +243,10 @@ private:
     
     // rx.c
     void iwl_pcie_irq_handler(int irq, void *dev_id);
+    void iwl_pcie_irq_msix_handler(int vector);
+    void iwl_pcie_irq_fh_msix_handler(int vector);
+    void iwl_pcie_irq_rx_msix_handler(int vector);
+    int iwl_pcie_busy_poll(struct iwl_trans *trans);
     
     void iwl_pcie_handle_rfkill_irq(struct iwl_trans *trans);
     void iwl_pcie_irq_handle_error(struct iwl_trans *trans);
@@ -194,17 +258,24 @@ private:
                                           bool emergency);
     
     // tx.c
-    int iwl_pcie_txq_alloc(struct iwl_trans *trans, struct iwl_txq *txq, int slots_num, bool cmd_queue); // line 487
     int iwl_pcie_txq_init(struct iwl_trans *trans, struct iwl_txq *txq, int slots_num, bool cmd_queue); // line 551
     int iwl_pcie_tx_alloc(struct iwl_trans *trans); // line 907
     int iwl_pcie_tx_init(struct iwl_trans *trans); // line 973
     void iwl_pcie_txq_progress(struct iwl_txq *txq); // line 1034
+    void iwl_trans_pcie_reclaim(struct iwl_trans *trans, int txq_id, int ssn, mbuf_t *skbs); // line 1094
     void iwl_pcie_cmdq_reclaim(struct iwl_trans *trans, int txq_id, int idx); // line 1211
 
     void iwl_pcie_hcmd_complete(struct iwl_trans *trans,
                                            struct iwl_rx_cmd_buffer *rxb); // line 1723
-    int iwl_trans_pcie_tx(struct iwl_trans *trans, struct sk_buff *skb,
-                          struct iwl_device_cmd *dev_cmd, int txq_id); // line 2256
+    void iwl_stop_queue(struct iwl_trans *trans, struct iwl_txq *txq); // internal.h line 836
+    void iwl_pcie_txq_resume(struct iwl_trans *trans, struct iwl_txq *txq); // line 1170
+    int iwl_fill_data_tbs(struct iwl_trans *trans, mbuf_t skb, struct iwl_txq *txq, u8 hdr_len,
+                          struct iwl_cmd_meta *out_meta); // line 1987
+    int iwl_pcie_txq_tx(struct iwl_trans *trans, mbuf_t skb,
+                        struct iwl_device_cmd *dev_cmd, int txq_id, bool more, bool resume);
+    int iwl_trans_pcie_tx(struct iwl_trans *trans, mbuf_t skb,
+                          struct iwl_device_cmd *dev_cmd, int txq_id, bool more); // line 2256
+    void iwl_trans_pcie_tx_push(struct iwl_trans *trans, int txq_id);
     
     // other   
     
@@ -214,6 +285,9 @@ private:
     UInt16 fSubsystemId;
     
 public:IwlOpModeOps *opmode;
+    IOReturn setBusyPoll(bool enable);
+    IOReturn getHcmdLatency(UInt64 slowUs, struct iwl_hcmd_lat_report *report);
+    IOReturn getIrqMod(struct iwl_irq_mod_report *report);
 private:
     struct ieee80211_hw *hw;
     IOCommandGate *gate;
@@ -20,6 +20,30 @@ const IOExternalMethodDispatch IntelWifiUserClient::sMethods[kNumberOfMethods] =
         0,
         0,
         0
+    },
+    {
+        // kIwlClientBusyPoll
+        (IOExternalMethodAction) &IntelWifiUserClient::busyPoll,
+        1,
+        0,
+        0,
+        0
+    },
+    {
+        // kIwlClientHcmdLatency
+        (IOExternalMethodAction) &IntelWifiUserClient::hcmdLatency,
+        1,
+        0,
+        0,
+        sizeof(struct iwl_hcmd_lat_report)
+    },
+    {
+        // kIwlClientIrqMod
+        (IOExternalMethodAction) &IntelWifiUserClient::irqMod,
+        0,
+        0,
+        0,
+        sizeof(struct iwl_irq_mod_report)
     }
 };
 
@@ -66,6 +90,30 @@ IOReturn IntelWifiUserClient::scanImpl() {
     return kIOReturnSuccess;
 }
 
+IOReturn IntelWifiUserClient::busyPoll(IntelWifiUserClient *target, void *reference, IOExternalMethodArguments *arguments) {
+    return target->busyPollImpl(arguments->scalarInput[0] != 0);
+}
+
+IOReturn IntelWifiUserClient::busyPollImpl(bool enable) {
+    return this->fProvider->setBusyPoll(enable);
+}
+
+IOReturn IntelWifiUserClient::hcmdLatency(IntelWifiUserClient *target, void *reference, IOExternalMethodArguments *arguments) {
+    return target->hcmdLatencyImpl(arguments->scalarInput[0], (struct iwl_hcmd_lat_report *) arguments->structureOutput);
+}
+
+IOReturn IntelWifiUserClient::hcmdLatencyImpl(uint64_t slowUs, struct iwl_hcmd_lat_report *report) {
+    return this->fProvider->getHcmdLatency(slowUs, report);
+}
+
+IOReturn IntelWifiUserClient::irqMod(IntelWifiUserClient *target, void *reference, IOExternalMethodArguments *arguments) {
+    return target->irqModImpl((struct iwl_irq_mod_report *) arguments->structureOutput);
+}
+
+IOReturn IntelWifiUserClient::irqModImpl(struct iwl_irq_mod_report *report) {
+    return this->fProvider->getIrqMod(report);
+}
+
 
 
 
@@ -35,6 +35,15 @@ protected:
     
     static IOReturn scan(IntelWifiUserClient *target, void *reference, IOExternalMethodArguments *arguments);
     IOReturn scanImpl();
+    
+    static IOReturn busyPoll(IntelWifiUserClient *target, void *reference, IOExternalMethodArguments *arguments);
+    IOReturn busyPollImpl(bool enable);
+    
+    static IOReturn hcmdLatency(IntelWifiUserClient *target, void *reference, IOExternalMethodArguments *arguments);
+    IOReturn hcmdLatencyImpl(uint64_t slowUs, struct iwl_hcmd_lat_report *report);
+    
+    static IOReturn irqMod(IntelWifiUserClient *target, void *reference, IOExternalMethodArguments *arguments);
+    IOReturn irqModImpl(struct iwl_irq_mod_report *report);
 };
 
 
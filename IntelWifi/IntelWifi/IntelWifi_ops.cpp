@@ -35,3 +35,32 @@ void IntelWifi::stop_device(struct iwl_trans *trans, bool low_power) {
     iwl_trans_pcie_stop_device(trans, low_power);
     trans->state = IWL_TRANS_NO_FW;
 }
+
+int IntelWifi::tx(struct iwl_trans *trans, mbuf_t skb, struct iwl_device_cmd *dev_cmd, int queue, bool more) {
+    if (unlikely(test_bit(STATUS_FW_ERROR, &trans->status)))
+        return -EIO;
+    
+    return iwl_trans_pcie_tx(trans, skb, dev_cmd, queue, more);
+}
+
+void IntelWifi::tx_push(struct iwl_trans *trans, int queue) {
+    iwl_trans_pcie_tx_push(trans, queue);
+}
+
+void IntelWifi::reclaim(struct iwl_trans *trans, int queue, int ssn, mbuf_t *skbs) {
+    iwl_trans_pcie_reclaim(trans, queue, ssn, skbs);
+}
+
+/*
+ * The op mode is not reachable through trans->op_mode here, so this takes
+ * the place of the iwl-trans.h inline of the same name.
+ */
+void IntelWifi::iwl_trans_fw_error(struct iwl_trans *trans) {
+    /* prevent double restarts due to the same erroneous FW */
+    if (test_and_set_bit(STATUS_FW_ERROR, &trans->status))
+        return;
+    
+    /* the op mode is not up yet while its first firmware loads */
+    if (hw)
+        opmode->nic_error((struct iwl_priv *)hw->priv);
+}
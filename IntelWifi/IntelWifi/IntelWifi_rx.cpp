@@ -216,6 +216,7 @@ static void iwl_pcie_rxq_inc_wr_ptr(struct iwl_trans *trans, struct iwl_rxq *rxq
     }
     
     rxq->write_actual = round_down(rxq->write, 8);
+    rxq->stats.doorbells++;
     
     if (trans->cfg->mq_rx_supported)
         iwl_write32(trans, RFH_Q_FRBDCB_WIDX_TRG(rxq->id), rxq->write_actual);
@@ -358,13 +359,286 @@ static void iwl_pcie_rxq_restock(struct iwl_trans *trans, struct iwl_rxq *rxq)
         iwl_pcie_rxsq_restock(trans, rxq);
 }
 
+/*
+ * iwl_pcie_rx_pool_grow - carve a new chunk into RBs
+ *
+ * The chunk is physically contiguous, so the DMA address of every RB is
+ * computed here once and stays valid for the lifetime of the pool.
+ */
+static int iwl_pcie_rx_pool_grow(struct iwl_trans *trans, u32 rb_size)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_rx_page_pool *pool = trans_pcie->rx_page_pool;
+    struct iwl_rx_page_chunk *chunk;
+    IOBufferMemoryDescriptor *desc;
+    IOByteCount len = 0;
+    dma_addr_t phys;
+    u8 *addr;
+    u32 i;
+    
+    chunk = (struct iwl_rx_page_chunk *)iwh_zalloc(sizeof(*chunk));
+    if (!chunk)
+        return -ENOMEM;
+    
+    chunk->size = max_t(u32, RX_PAGE_CHUNK_SIZE, rb_size);
+    chunk->n_pages = chunk->size / rb_size;
+    chunk->pages = (struct iwl_rx_page *)iwh_zalloc(sizeof(*chunk->pages) * chunk->n_pages);
+    if (!chunk->pages)
+        goto err_free_chunk;
+    
+    desc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIOMemoryPhysicallyContiguous,
+                                                            chunk->size, 0x00000000FFFFFFFFULL);
+    if (!desc)
+        goto err_free_pages;
+    desc->prepare();
+    
+    phys = desc->getPhysicalSegment(0, &len);
+    if (!phys || len < chunk->size) {
+        IWL_ERR(trans, "RX page chunk is not contiguous (%llu bytes)\n", (u64)len);
+        desc->complete();
+        desc->release();
+        goto err_free_pages;
+    }
+    chunk->desc = desc;
+    addr = (u8 *)desc->getBytesNoCopy();
+    
+    IOSimpleLockLock(pool->lock);
+    for (i = 0; i < chunk->n_pages; i++) {
+        struct iwl_rx_page *page = &chunk->pages[i];
+        
+        page->addr = addr + i * rb_size;
+        page->dma = phys + i * rb_size;
+        page->pool = pool;
+        TAILQ_INSERT_TAIL(&pool->free, page, list);
+    }
+    TAILQ_INSERT_TAIL(&pool->chunks, chunk, list);
+    pool->n_pages += chunk->n_pages;
+    pool->n_free += chunk->n_pages;
+    IOSimpleLockUnlock(pool->lock);
+    
+    IWL_DEBUG_RX(trans, "RX page pool: new %u byte chunk, %u RBs in total\n",
+                 chunk->size, pool->n_pages);
+    return 0;
+    
+err_free_pages:
+    iwh_free(chunk->pages);
+err_free_chunk:
+    iwh_free(chunk);
+    return -ENOMEM;
+}
+
 /* line 352
  * iwl_pcie_rx_alloc_page - allocates and returns a page.
  *
+ * RBs come from the page pool free list. A new chunk is only allocated once
+ * the free list runs dry, so refills of a warmed up pool cost no kernel
+ * allocations. Atomic callers never grow the pool.
+ */
+static struct iwl_rx_page *iwl_pcie_rx_alloc_page(struct iwl_trans *trans, bool atomic)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_rx_page_pool *pool = trans_pcie->rx_page_pool;
+    u32 rb_size = PAGE_SIZE << trans_pcie->rx_page_order;
+    struct iwl_rx_page *page;
+    bool miss = false;
+    
+    /* The RB size is fixed once the pool holds memory */
+    if (!pool->rb_size)
+        pool->rb_size = rb_size;
+    else if (WARN_ON_ONCE(pool->rb_size != rb_size))
+        return NULL;
+    
+    while (1) {
+        IOSimpleLockLock(pool->lock);
+        page = TAILQ_FIRST(&pool->free);
+        if (page) {
+            TAILQ_REMOVE(&pool->free, page, list);
+            pool->n_free--;
+            if (miss)
+                pool->misses++;
+            else
+                pool->hits++;
+            if (pool->n_pages - pool->n_free > pool->high_water)
+                pool->high_water = pool->n_pages - pool->n_free;
+        }
+        IOSimpleLockUnlock(pool->lock);
+        
+        if (page)
+            break;
+        if (atomic || miss || iwl_pcie_rx_pool_grow(trans, rb_size))
+            return NULL;
+        miss = true;
+    }
+    
+    page->refs = 1;
+    return page;
+}
+
+/*
+ * iwl_pcie_rx_put_page - drop a reference to a page
+ *
+ * The last reference puts the page back to the pool free list, to be reused
+ * by iwl_pcie_rx_alloc_page.
+ */
+static void iwl_pcie_rx_put_page(struct iwl_rx_page *page)
+{
+    struct iwl_rx_page_pool *pool = page->pool;
+    
+    if (OSDecrementAtomic(&page->refs) != 1)
+        return;
+    
+    IOSimpleLockLock(pool->lock);
+    TAILQ_INSERT_HEAD(&pool->free, page, list);
+    pool->n_free++;
+    IOSimpleLockUnlock(pool->lock);
+}
+
+/*
+ * iwl_pcie_rx_pool_refill - keep RX_PAGE_POOL_RESERVE RBs on the free list
+ *
+ * Called by the allocator, so the atomic allocations done from the RX path
+ * in emergency mode find free RBs.
+ */
+static void iwl_pcie_rx_pool_refill(struct iwl_trans *trans)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_rx_page_pool *pool = trans_pcie->rx_page_pool;
+    u32 rb_size = PAGE_SIZE << trans_pcie->rx_page_order;
+    
+    if (pool->rb_size != rb_size)
+        return;
+    
+    while (pool->n_free < RX_PAGE_POOL_RESERVE) {
+        if (iwl_pcie_rx_pool_grow(trans, rb_size))
+            return;
+    }
+}
+
+struct iwl_rx_page_pool *iwl_pcie_rx_pool_alloc(void)
+{
+    struct iwl_rx_page_pool *pool;
+    
+    pool = (struct iwl_rx_page_pool *)iwh_zalloc(sizeof(*pool));
+    if (!pool)
+        return NULL;
+    
+    pool->lock = IOSimpleLockAlloc();
+    if (!pool->lock) {
+        iwh_free(pool);
+        return NULL;
+    }
+    TAILQ_INIT(&pool->free);
+    TAILQ_INIT(&pool->chunks);
+    return pool;
+}
+
+/*
+ * iwl_pcie_rx_pool_free - release the page pool and its chunks
+ *
+ * Must only be called once every RB is back on the free list.
+ */
+static void iwl_pcie_rx_pool_free(struct iwl_rx_page_pool *pool)
+{
+    struct iwl_rx_page_chunk *chunk;
+    
+    while ((chunk = TAILQ_FIRST(&pool->chunks))) {
+        IOBufferMemoryDescriptor *desc = static_cast<IOBufferMemoryDescriptor *>(chunk->desc);
+        
+        TAILQ_REMOVE(&pool->chunks, chunk, list);
+        desc->complete();
+        desc->release();
+        iwh_free(chunk->pages);
+        iwh_free(chunk);
+    }
+    IOSimpleLockFree(pool->lock);
+    iwh_free(pool);
+}
+
+/*
+ * iwl_pcie_rx_pool_release - the transport lets go of its page pool
+ *
+ * RBs still lent to the network stack get a moment to come back. Past
+ * that the pool is detached and freed by the last of them, so their
+ * mbuf free callbacks never touch the transport.
+ */
+static void iwl_pcie_rx_pool_release(struct iwl_trans *trans)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_rx_page_pool *pool = trans_pcie->rx_page_pool;
+    SInt32 lent;
+    int i;
+    
+    if (!pool)
+        return;
+    trans_pcie->rx_page_pool = NULL;
+    
+    for (i = 0; pool->lent && i < 100; i++)
+        IOSleep(10);
+    
+    IOSimpleLockLock(pool->lock);
+    lent = pool->lent;
+    pool->detached = lent != 0;
+    IOSimpleLockUnlock(pool->lock);
+    
+    if (lent)
+        IWL_WARN(trans, "%d RB pages still held by the network stack, the last one frees the RX page pool\n",
+                 lent);
+    else
+        iwl_pcie_rx_pool_free(pool);
+}
+
+/* atomic_xchg(v, 0) */
+static inline int iwl_pcie_atomic_take(int *v)
+{
+    int old;
+    
+    do {
+        old = *v;
+    } while (!OSCompareAndSwap((UInt32)old, 0, (volatile UInt32 *)v));
+    return old;
+}
+
+/* atomic_dec_if_positive(v) */
+static inline int iwl_pcie_atomic_dec_if_positive(int *v)
+{
+    int old;
+    
+    do {
+        old = *v;
+        if (old <= 0)
+            return old - 1;
+    } while (!OSCompareAndSwap((UInt32)old, (UInt32)(old - 1), (volatile UInt32 *)v));
+    return old - 1;
+}
+
+/*
+ * iwl_pcie_rx_allocator_schedule - queue_work(rba->alloc_wq, &rba->rx_alloc)
+ *
+ * The allocator runs iwl_pcie_rx_allocator_work on its own work loop, so
+ * page allocations never block the RX path.
+ */
+static void iwl_pcie_rx_allocator_schedule(struct iwl_rb_allocator *rba)
+{
+    if (rba->rx_alloc)
+        static_cast<IOInterruptEventSource *>(rba->rx_alloc)->interruptOccurred(0, 0, 0);
+}
+
+/*
+ * iwl_pcie_rx_allocator_block - cancel_work_sync(&rba->rx_alloc)
+ *
+ * The allocator runs with its work loop gate closed. Holding the gate waits
+ * for a running allocator and keeps it out until iwl_pcie_rx_allocator_unblock.
  */
-static IOBufferMemoryDescriptor *iwl_pcie_rx_alloc_page(struct iwl_trans *trans)
+static void iwl_pcie_rx_allocator_block(struct iwl_rb_allocator *rba)
+{
+    if (rba->alloc_wq)
+        static_cast<IOWorkLoop *>(rba->alloc_wq)->closeGate();
+}
+
+static void iwl_pcie_rx_allocator_unblock(struct iwl_rb_allocator *rba)
 {
-    return IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, 0, PAGE_SIZE, 0x00000000FFFFFFFFULL);
+    if (rba->alloc_wq)
+        static_cast<IOWorkLoop *>(rba->alloc_wq)->openGate();
 }
 
 /* line 384
@@ -376,11 +650,11 @@ static IOBufferMemoryDescriptor *iwl_pcie_rx_alloc_page(struct iwl_trans *trans)
  * iwl_pcie_rxq_restock. The latter function will update the HW to use the newly
  * allocated buffers.
  */
-static void iwl_pcie_rxq_alloc_rbs(struct iwl_trans *trans, struct iwl_rxq *rxq)
+static void iwl_pcie_rxq_alloc_rbs(struct iwl_trans *trans, struct iwl_rxq *rxq, bool atomic)
 {
-    //struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
     struct iwl_rx_mem_buffer *rxb;
-    IOBufferMemoryDescriptor *page;
+    struct iwl_rx_page *page;
     
     while (1) {
         //IOSimpleLockLock(rxq->lock);
@@ -391,17 +665,22 @@ static void iwl_pcie_rxq_alloc_rbs(struct iwl_trans *trans, struct iwl_rxq *rxq)
         //IOSimpleLockUnlock(rxq->lock);
         
         /* Alloc a new receive buffer */
-        page = iwl_pcie_rx_alloc_page(trans);
-        if (!page)
+        page = iwl_pcie_rx_alloc_page(trans, atomic);
+        if (!page) {
+            /* let the allocator refill the pool */
+            if (atomic)
+                iwl_pcie_rx_allocator_schedule(&trans_pcie->rba);
             return;
+        }
+        if (atomic)
+            rxq->stats.emergency++;
         
         //IOSimpleLockLock(rxq->lock);
         
         if (TAILQ_EMPTY(&rxq->rx_used)) {
             //IOSimpleLockUnlock(rxq->lock);
             //__free_pages(page, trans_pcie->rx_page_order);
-            page->complete();
-            page->release();
+            iwl_pcie_rx_put_page(page);
             page = NULL;
             return;
         }
@@ -413,11 +692,10 @@ static void iwl_pcie_rxq_alloc_rbs(struct iwl_trans *trans, struct iwl_rxq *rxq)
         //BUG_ON(rxb->page);
         rxb->page = page;
         /* Get physical address of the RB */
-        rxb->page_dma = page->getPhysicalSegment(0, 0);
+        rxb->page_dma = page->dma;
         
         if (!rxb->page_dma) {
-            page->complete();
-            page->release();
+            iwl_pcie_rx_put_page(page);
             rxb->page = NULL;
             
             //IOSimpleLockLock(rxq->lock);
@@ -443,9 +721,7 @@ static void iwl_pcie_free_rbs_pool(struct iwl_trans *trans)
         if (!trans_pcie->rx_pool[i].page)
             continue;
         trans_pcie->rx_pool[i].page_dma = NULL;
-        IOBufferMemoryDescriptor *p = static_cast<IOBufferMemoryDescriptor *>(trans_pcie->rx_pool[i].page);
-        p->complete();
-        p->release();
+        iwl_pcie_rx_put_page(trans_pcie->rx_pool[i].page);
         trans_pcie->rx_pool[i].page = NULL;
     }
 }
@@ -460,92 +736,97 @@ static void iwl_pcie_rx_allocator(struct iwl_trans *trans)
 {
     struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
     struct iwl_rb_allocator *rba = &trans_pcie->rba;
-    TAILQ_HEAD(, iwl_rx_mem_buffer) local_empty;
-    
-    // initial code: int pending = atomic_xchg(&rba->req_pending, 0);
-    int pending = OSAddAtomic(-rba->req_pending, &rba->req_pending);
+    TAILQ_HEAD(, iwl_rx_mem_buffer) local_empty = TAILQ_HEAD_INITIALIZER(local_empty);
+    int pending = iwl_pcie_atomic_take(&rba->req_pending);
     
     IWL_DEBUG_RX(trans, "Pending allocation requests = %d\n", pending);
     
-    /* If we were scheduled - there is at least one request */
-    //IOSimpleLockLock(rba->lock);
+    /* Only scheduled to refill the pool, or the requests were already
+     * handled by a previous run */
+    if (!pending) {
+        iwl_pcie_rx_pool_refill(trans);
+        return;
+    }
+    trans_pcie->perf_stats.rx_alloc_runs++;
+    
+    IOSimpleLockLock(rba->lock);
     /* swap out the rba->rbd_empty to a local list */
-    TAILQ_SWAP(&rba->rbd_empty, &local_empty, iwl_rx_mem_buffer, list);
-    TAILQ_INIT(&rba->rbd_empty);
-    //IOSimpleLockUnlock(rba->lock);
+    TAILQ_CONCAT(&local_empty, &rba->rbd_empty, list);
+    IOSimpleLockUnlock(rba->lock);
     
     while (pending) {
         int i;
         TAILQ_HEAD(, iwl_rx_mem_buffer) local_allocated = TAILQ_HEAD_INITIALIZER(local_allocated);
         
-        /* Do not post a warning if there are only a few requests */
-//        if (pending < RX_PENDING_WATERMARK)
-//            gfp_mask |= __GFP_NOWARN;
-        
         for (i = 0; i < RX_CLAIM_REQ_ALLOC;) {
             struct iwl_rx_mem_buffer *rxb;
             //struct page *page;
-            IOBufferMemoryDescriptor *page;
+            struct iwl_rx_page *page;
             
             /* List should never be empty - each reused RBD is
              * returned to the list, and initial pool covers any
              * possible gap between the time the page is allocated
              * to the time the RBD is added.
              */
-            //BUG_ON(list_empty(&local_empty));
             /* Get the first rxb from the rbd list */
             rxb = TAILQ_FIRST(&local_empty);
-            //BUG_ON(rxb->page);
+            if (WARN_ON(!rxb))
+                break;
             
             /* Alloc a new receive buffer */
-            page = iwl_pcie_rx_alloc_page(trans);
+            page = iwl_pcie_rx_alloc_page(trans, false);
             if (!page)
-                continue;
+                break;
             rxb->page = page;
             
             /* Get physical address of the RB */
-            rxb->page_dma = page->getPhysicalSegment(0, 0);
-            if (!rxb->page_dma) {
-                page->complete();
-                page->release();
-                rxb->page = NULL;
-                continue;
-            }
+            rxb->page_dma = page->dma;
             
             /* move the allocated entry to the out list */
-            TAILQ_INSERT_HEAD(&local_allocated, rxb, list);
             TAILQ_REMOVE(&local_empty, rxb, list);
+            TAILQ_INSERT_TAIL(&local_allocated, rxb, list);
             i++;
         }
         
+        if (i < RX_CLAIM_REQ_ALLOC) {
+            struct iwl_rx_mem_buffer *rxb;
+            
+            /* Give the RBDs back and leave the request pending, the
+             * queue posts another one or falls back to emergency mode */
+            IWL_ERR(trans, "Failed to allocate RBs for %d requests\n", pending);
+            while ((rxb = TAILQ_FIRST(&local_allocated))) {
+                TAILQ_REMOVE(&local_allocated, rxb, list);
+                iwl_pcie_rx_put_page(rxb->page);
+                rxb->page = NULL;
+                TAILQ_INSERT_TAIL(&local_empty, rxb, list);
+            }
+            OSAddAtomic(pending, &rba->req_pending);
+            break;
+        }
+        
         pending--;
         if (!pending) {
-            // initial code: pending = atomic_xchg(&rba->req_pending, 0);
-            pending = OSAddAtomic(-rba->req_pending, &rba->req_pending);
+            pending = iwl_pcie_atomic_take(&rba->req_pending);
             IWL_DEBUG_RX(trans, "Pending allocation requests = %d\n", pending);
         }
         
-        //IOSimpleLockLock(rba->lock);
+        IOSimpleLockLock(rba->lock);
         /* add the allocated rbds to the allocator allocated list */
-        if (!TAILQ_EMPTY(&local_allocated))
-            TAILQ_CONCAT(&local_allocated, &rba->rbd_allocated, list);
-        
+        TAILQ_CONCAT(&rba->rbd_allocated, &local_allocated, list);
         /* get more empty RBDs for current pending requests */
-        if (!TAILQ_EMPTY(&rba->rbd_empty)) {
-            TAILQ_CONCAT(&rba->rbd_empty, &local_empty, list);
-            TAILQ_INIT(&rba->rbd_empty);
-        }
-
-        //IOSimpleLockUnlock(rba->lock);
+        TAILQ_CONCAT(&local_empty, &rba->rbd_empty, list);
+        IOSimpleLockUnlock(rba->lock);
         
         OSIncrementAtomic(&rba->req_ready);
+        trans_pcie->perf_stats.rx_alloc_reqs++;
     }
     
-    //IOSimpleLockLock(rba->lock);
+    IOSimpleLockLock(rba->lock);
     /* return unused rbds to the allocator empty list */
-    if (!TAILQ_EMPTY(&local_empty))
-        TAILQ_CONCAT(&local_empty, &rba->rbd_empty, list);
-    //IOSimpleLockUnlock(rba->lock);
+    TAILQ_CONCAT(&rba->rbd_empty, &local_empty, list);
+    IOSimpleLockUnlock(rba->lock);
+    
+    iwl_pcie_rx_pool_refill(trans);
 }
 
 /* line 557
@@ -571,34 +852,27 @@ static void iwl_pcie_rx_allocator_get(struct iwl_trans *trans, struct iwl_rxq *r
      * req_ready > 0, i.e. - there are ready requests and the function
      * hands one request to the caller.
      */
-    if (OSDecrementAtomic(&rba->req_ready) < 0) {
-        rba->req_ready = 0;
+    if (iwl_pcie_atomic_dec_if_positive(&rba->req_ready) < 0)
         return;
-    }
     
-    //IOSimpleLockLock(rba->lock);
+    IOSimpleLockLock(rba->lock);
     for (i = 0; i < RX_CLAIM_REQ_ALLOC; i++) {
         /* Get next free Rx buffer, remove it from free list */
         struct iwl_rx_mem_buffer *rxb = TAILQ_FIRST(&rba->rbd_allocated);
-        TAILQ_INSERT_HEAD(&rxq->rx_free, rxb, list);
         TAILQ_REMOVE(&rba->rbd_allocated, rxb, list);
+        TAILQ_INSERT_HEAD(&rxq->rx_free, rxb, list);
     }
-    //IOSimpleLockUnlock(rba->lock);
+    IOSimpleLockUnlock(rba->lock);
     
     rxq->used_count -= RX_CLAIM_REQ_ALLOC;
     rxq->free_count += RX_CLAIM_REQ_ALLOC;
 }
 
 // line 600
-//void iwl_pcie_rx_allocator_work(struct work_struct *data)
-//{
-//    struct iwl_rb_allocator *rba_p =
-//            container_of(data, struct iwl_rb_allocator, rx_alloc);
-//    struct iwl_trans_pcie *trans_pcie =
-//            container_of(rba_p, struct iwl_trans_pcie, rba);
-//
-//    iwl_pcie_rx_allocator(trans_pcie->trans);
-//}
+void iwl_pcie_rx_allocator_work(struct iwl_trans *trans)
+{
+    iwl_pcie_rx_allocator(trans);
+}
 
 // line 610
 static int iwl_pcie_rx_alloc(struct iwl_trans *trans)
@@ -746,8 +1020,8 @@ static void iwl_pcie_rx_hw_init(struct iwl_trans *trans, struct iwl_rxq *rxq)
                 (RX_RB_TIMEOUT << FH_RCSR_RX_CONFIG_REG_IRQ_RBTH_POS) |
                 (rfdnlog << FH_RCSR_RX_CONFIG_RBDCB_SIZE_POS));
     
-    /* Set interrupt coalescing timer to default (2048 usecs) */
-    iwl_write8(trans, CSR_INT_COALESCING, IWL_HOST_INT_TIMEOUT_DEF);
+    /* Set interrupt coalescing timer, tuned by the moderation from now on */
+    iwl_pcie_irq_mod_init(trans);
     
     /* W/A for interrupt coalescing bug in 7260 and 3160 */
     if (trans->cfg->host_interrupt_operation_mode)
@@ -858,8 +1132,8 @@ static void iwl_pcie_rx_mq_hw_init(struct iwl_trans *trans)
     
     iwl_trans_release_nic_access(trans, &state);
     
-    /* Set interrupt coalescing timer to default (2048 usecs) */
-    iwl_write8(trans, CSR_INT_COALESCING, IWL_HOST_INT_TIMEOUT_DEF);
+    /* Set interrupt coalescing timer, tuned by the moderation from now on */
+    iwl_pcie_irq_mod_init(trans);
     
     iwl_pcie_enable_rx_wake(trans, true);
 }
@@ -890,13 +1164,15 @@ static int _iwl_pcie_rx_init(struct iwl_trans *trans)
     }
     def_rxq = trans_pcie->rxq;
 
-    //IOSimpleLockLock(rba->lock);
+    iwl_pcie_rx_allocator_block(rba);
+    IOSimpleLockLock(rba->lock);
     rba->req_pending = 0;
     rba->req_ready = 0;
     
     TAILQ_INIT(&rba->rbd_allocated);
     TAILQ_INIT(&rba->rbd_empty);
-    //IOSimpleLockUnlock(rba->lock);
+    IOSimpleLockUnlock(rba->lock);
+    iwl_pcie_rx_allocator_unblock(rba);
     
     /* free all first - we might be reconfigured for a different size */
     iwl_pcie_free_rbs_pool(trans);
@@ -942,7 +1218,7 @@ static int _iwl_pcie_rx_init(struct iwl_trans *trans)
         rxb->invalid = true;
     }
     
-    iwl_pcie_rxq_alloc_rbs(trans, def_rxq);
+    iwl_pcie_rxq_alloc_rbs(trans, def_rxq, false);
     
     return 0;
 }
@@ -984,7 +1260,7 @@ int iwl_pcie_gen2_rx_init(struct iwl_trans *trans)
 void iwl_pcie_rx_free(struct iwl_trans *trans)
 {
     struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
-    //    struct iwl_rb_allocator *rba = &trans_pcie->rba;
+    struct iwl_rb_allocator *rba = &trans_pcie->rba;
     //    int free_size = trans->cfg->mq_rx_supported ? sizeof(__le64) : sizeof(__le32);
     int i;
     
@@ -994,13 +1270,18 @@ void iwl_pcie_rx_free(struct iwl_trans *trans)
      */
     if (!trans_pcie->rxq) {
         IWL_DEBUG_INFO(trans, "Free NULL rx context\n");
+        iwl_pcie_rx_pool_release(trans);
         return;
     }
     
-    //cancel_work_sync(&rba->rx_alloc);
+    /* cancel_work_sync(&rba->rx_alloc) */
+    iwl_pcie_rx_allocator_block(rba);
+    iwl_pcie_rx_allocator_unblock(rba);
     
     iwl_pcie_free_rbs_pool(trans);
     
+    iwl_pcie_rx_pool_release(trans);
+    
     for (i = 0; i < trans->num_rx_queues; i++) {
         struct iwl_rxq *rxq = &trans_pcie->rxq[i];
         
@@ -1062,17 +1343,118 @@ static void iwl_pcie_rx_reuse_rbd(struct iwl_trans *trans, struct iwl_rx_mem_buf
     if ((rxq->used_count % RX_CLAIM_REQ_ALLOC) == RX_POST_REQ_ALLOC) {
         /* Move the 2 RBDs to the allocator ownership.
          Allocator has another 6 from pool for the request completion*/
-        //IOSimpleLockLock(rba->lock);
-        if (!TAILQ_EMPTY(&rxq->rx_used)) {
-            TAILQ_CONCAT(&rxq->rx_used, &rba->rbd_empty, list);
-            TAILQ_INIT(&rxq->rx_used);
-        }
-        //IOSimpleLockUnlock(rba->lock);
+        IOSimpleLockLock(rba->lock);
+        TAILQ_CONCAT(&rba->rbd_empty, &rxq->rx_used, list);
+        IOSimpleLockUnlock(rba->lock);
         
         OSIncrementAtomic(&rba->req_pending);
-        // TODO: Implement
-        //queue_work(rba->alloc_wq, &rba->rx_alloc);
+        iwl_pcie_rx_allocator_schedule(rba);
+    }
+}
+
+/*
+ * iwl_pcie_rx_mbuf_free - called by the network stack when an mbuf that
+ * points into an RB page is freed
+ */
+static void iwl_pcie_rx_mbuf_free(caddr_t buf, u_int size, caddr_t arg)
+{
+    struct iwl_rx_page *page = (struct iwl_rx_page *)arg;
+    struct iwl_rx_page_pool *pool = page->pool;
+    bool last;
+    
+    iwl_pcie_rx_put_page(page);
+    
+    /* under the lock, so iwl_pcie_rx_pool_release sees the count settled */
+    IOSimpleLockLock(pool->lock);
+    last = OSDecrementAtomic(&pool->lent) == 1 && pool->detached;
+    IOSimpleLockUnlock(pool->lock);
+    
+    if (last)
+        iwl_pcie_rx_pool_free(pool);
+}
+
+/*
+ * iwl_trans_pcie_rxb_input - pass a frame to the network stack
+ *
+ * The frame is wrapped in an mbuf with external storage pointing into the
+ * RB page, which takes a reference on the page and marks it stolen. The
+ * page goes back to the page pool once every mbuf pointing into it is freed.
+ * Frames are chained on the RX queue and handed to the stack by
+ * iwl_pcie_rx_input_flush at the end of iwl_pcie_rx_handle.
+ */
+int iwl_trans_pcie_rxb_input(struct iwl_trans *trans, struct iwl_rx_cmd_buffer *rxb,
+                             void *data, unsigned int len)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_rxq *rxq = &trans_pcie->rxq[rxb->_queue];
+    struct iwl_rx_page *page = (struct iwl_rx_page *)rxb->_page_ref;
+    mbuf_t m;
+    
+    if (!trans->intf)
+        return -ENODEV;
+    
+    OSIncrementAtomic(&page->refs);
+    OSIncrementAtomic(&page->pool->lent);
+    
+    if (mbuf_attachcluster(MBUF_DONTWAIT, MBUF_TYPE_DATA, &m, (caddr_t)data,
+                           iwl_pcie_rx_mbuf_free, len, (caddr_t)page)) {
+        OSDecrementAtomic(&page->pool->lent);
+        iwl_pcie_rx_put_page(page);
+        
+        /* Fall back to copying, the page stays with the RX queue */
+        if (mbuf_allocpacket(MBUF_DONTWAIT, len, NULL, &m))
+            return -ENOMEM;
+        if (mbuf_copyback(m, 0, len, data, MBUF_DONTWAIT)) {
+            mbuf_freem(m);
+            return -ENOMEM;
+        }
+        rxq->stats.bytes_copied += len;
+    } else {
+        mbuf_setlen(m, len);
+        mbuf_pkthdr_setlen(m, len);
+        rxb->_page_stolen = true;
     }
+    
+    if (rxq->input_tail)
+        mbuf_setnextpkt((mbuf_t)rxq->input_tail, m);
+    else
+        rxq->input_head = m;
+    rxq->input_tail = m;
+    rxq->input_count++;
+    rxq->stats.frames++;
+    return 0;
+}
+
+/*
+ * iwl_pcie_rx_input_flush - hand the frames of an RX pass to the stack
+ *
+ * The interface input queue is not thread safe, rx_input_lock serialises
+ * the RSS queues, which are handled in parallel. The lock is only taken
+ * once per pass.
+ */
+static void iwl_pcie_rx_input_flush(struct iwl_trans *trans, struct iwl_rxq *rxq)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    IONetworkInterface *netif = static_cast<IONetworkInterface *>(trans->intf);
+    mbuf_t m = (mbuf_t)rxq->input_head;
+    
+    if (!m)
+        return;
+    
+    rxq->input_head = NULL;
+    rxq->input_tail = NULL;
+    rxq->input_count = 0;
+    
+    IOLockLock(trans_pcie->rx_input_lock);
+    while (m) {
+        mbuf_t next = mbuf_nextpkt(m);
+        
+        mbuf_setnextpkt(m, NULL);
+        netif->inputPacket(m, (UInt32)mbuf_pkthdr_len(m), IONetworkInterface::kInputOptionQueuePacket);
+        m = next;
+    }
+    netif->flushInputQueue();
+    IOLockUnlock(trans_pcie->rx_input_lock);
 }
 
 // line 1090
@@ -1080,7 +1462,6 @@ void IntelWifi::iwl_pcie_rx_handle_rb(struct iwl_trans *trans, struct iwl_rxq *r
                                       bool emergency)
 {
     struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
-    struct iwl_txq *txq = trans_pcie->txq[trans_pcie->cmd_queue];
     bool page_stolen = false;
     unsigned int max_len = PAGE_SIZE << trans_pcie->rx_page_order;
     u32 offset = 0;
@@ -1092,15 +1473,16 @@ void IntelWifi::iwl_pcie_rx_handle_rb(struct iwl_trans *trans, struct iwl_rxq *r
     
     while (offset + sizeof(u32) + sizeof(struct iwl_cmd_header) < max_len) {
         struct iwl_rx_packet *pkt;
-        u16 sequence;
         bool reclaim;
-        int index, cmd_index, len;
+        int len;
         struct iwl_rx_cmd_buffer rxcb = {
             ._offset = (int)offset,
             ._rx_page_order = trans_pcie->rx_page_order,
-            ._page = static_cast<IOBufferMemoryDescriptor *>(rxb->page)->getBytesNoCopy(),
+            ._page = rxb->page->addr,
             ._page_stolen = false,
             .truesize = max_len,
+            ._page_ref = rxb->page,
+            ._queue = rxq->id,
         };
         
         pkt = (struct iwl_rx_packet *)rxb_addr(&rxcb);
@@ -1146,22 +1528,15 @@ void IntelWifi::iwl_pcie_rx_handle_rb(struct iwl_trans *trans, struct iwl_rxq *r
             }
         }
         
-        sequence = le16_to_cpu(pkt->hdr.sequence);
-        index = SEQ_TO_INDEX(sequence);
-        cmd_index = iwl_pcie_get_cmd_index(txq, index);
-        
-        if (rxq->id == 0)
+        rxq->stats.pkts++;
+        if (rxq->id == 0) {
             opmode->rx(NULL, NULL, &rxcb);
-        
-        // TODO: Implement
-        //if (rxq->id == 0)
-        //    iwl_op_mode_rx(trans->op_mode, &rxq->napi, &rxcb);
-        //else
-        //    iwl_op_mode_rx_rss(trans->op_mode, &rxq->napi, &rxcb, rxq->id);
-        
-        if (reclaim) {
-            iwh_free((void *)txq->entries[cmd_index].free_buf);
-            txq->entries[cmd_index].free_buf = NULL;
+        } else {
+            /* the op mode is not reentrant, RSS queues take their turn on
+             * the main work loop's gate */
+            fWorkLoop->closeGate();
+            opmode->rx_rss(NULL, NULL, &rxcb, rxq->id);
+            fWorkLoop->openGate();
         }
         
         /*
@@ -1184,12 +1559,9 @@ void IntelWifi::iwl_pcie_rx_handle_rb(struct iwl_trans *trans, struct iwl_rxq *r
         offset += ALIGN(len, FH_RSCSR_FRAME_ALIGN);
     }
     
-    IOBufferMemoryDescriptor *page = static_cast<IOBufferMemoryDescriptor *>(rxb->page);
-    
     /* page was stolen from us -- free our reference */
     if (page_stolen) {
-        page->complete();
-        page->release();
+        iwl_pcie_rx_put_page(rxb->page);
         rxb->page = NULL;
     }
     
@@ -1197,7 +1569,7 @@ void IntelWifi::iwl_pcie_rx_handle_rb(struct iwl_trans *trans, struct iwl_rxq *r
      * SKBs that fail to Rx correctly, add them back into the
      * rx_free list for reuse later. */
     if (rxb->page != NULL) {
-        rxb->page_dma = page->getPhysicalSegment(0, 0);
+        rxb->page_dma = rxb->page->dma;
         if (!rxb->page_dma) {
             /*
              * free the page(s) as well to not break
@@ -1205,6 +1577,7 @@ void IntelWifi::iwl_pcie_rx_handle_rb(struct iwl_trans *trans, struct iwl_rxq *r
              * list have no page(s)
              */
             //__free_pages(rxb->page, trans_pcie->rx_page_order);
+            iwl_pcie_rx_put_page(rxb->page);
             rxb->page = NULL;
             iwl_pcie_rx_reuse_rbd(trans, rxb, rxq, emergency);
         } else {
@@ -1218,13 +1591,20 @@ void IntelWifi::iwl_pcie_rx_handle_rb(struct iwl_trans *trans, struct iwl_rxq *r
 
 /* line 1236
  * iwl_pcie_rx_handle - Main entry function for receiving responses from fw
+ *
+ * Handles at most trans_pcie->rx_budget RBs per pass. Free buffers are given
+ * back to the device every RX_RESTOCK_BATCH RBs, with one write pointer
+ * update per batch. If the budget runs out the queue is polled again from
+ * the work loop, so other event sources get a chance to run in between.
  */
 void IntelWifi::iwl_pcie_rx_handle(struct iwl_trans *trans, int queue)
 {
     struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
     struct iwl_rxq *rxq = &trans_pcie->rxq[queue];
-    u32 r, i, count = 0;
-    bool emergency = false;
+    u32 r, i, count = 0, handled = 0, restocks = 0;
+    u32 doorbells = rxq->stats.doorbells;
+    bool emergency = false, exhausted = false;
+    u64 start = iwl_pcie_perf_ns();
     
 restart:
     //IOSimpleLockLock(rxq->lock);
@@ -1243,6 +1623,11 @@ restart:
     while (i != r) {
         struct iwl_rx_mem_buffer *rxb;
         
+        if (handled >= trans_pcie->rx_budget) {
+            exhausted = true;
+            break;
+        }
+        
         if (rxq->used_count == rxq->queue_size / 2)
             emergency = true;
         
@@ -1272,6 +1657,7 @@ restart:
         
         IWL_DEBUG_RX(trans, "Q %d: HW = %d, SW = %d\n", rxq->id, r, i);
         iwl_pcie_rx_handle_rb(trans, rxq, rxb, emergency);
+        handled++;
         
         i = (i + 1) & (rxq->queue_size - 1);
         
@@ -1289,12 +1675,9 @@ restart:
             struct iwl_rb_allocator *rba = &trans_pcie->rba;
             
             /* Add the remaining empty RBDs for allocator use */
-            //IOSimpleLockLock(rba->lock);
-            if (!TAILQ_EMPTY(&rxq->rx_used)) {
-                TAILQ_CONCAT(&rxq->rx_used, &rba->rbd_empty, list);
-                TAILQ_INIT(&rxq->rx_used);
-            }
-            //IOSimpleLockUnlock(rba->lock);
+            IOSimpleLockLock(rba->lock);
+            TAILQ_CONCAT(&rba->rbd_empty, &rxq->rx_used, list);
+            IOSimpleLockUnlock(rba->lock);
         } else if (emergency) {
             count++;
             if (count == 8) {
@@ -1304,11 +1687,19 @@ restart:
                 
                 rxq->read = i;
                 //IOSimpleLockUnlock(rxq->lock);
-                iwl_pcie_rxq_alloc_rbs(trans, rxq);
+                iwl_pcie_rxq_alloc_rbs(trans, rxq, true);
                 iwl_pcie_rxq_restock(trans, rxq);
+                restocks++;
                 goto restart;
             }
         }
+        
+        /* Give the device back a batch of buffers before it runs dry */
+        if (rxq->free_count >= RX_RESTOCK_BATCH) {
+            rxq->read = i;
+            iwl_pcie_rxq_restock(trans, rxq);
+            restocks++;
+        }
     }
 out:
     /* Backtrack one entry */
@@ -1328,9 +1719,31 @@ out:
      * will be restocked by the next call of iwl_pcie_rxq_restock.
      */
     if (unlikely(emergency && count))
-        iwl_pcie_rxq_alloc_rbs(trans, rxq);
+        iwl_pcie_rxq_alloc_rbs(trans, rxq, true);
     
     iwl_pcie_rxq_restock(trans, rxq);
+    restocks++;
+    
+    iwl_pcie_rx_input_flush(trans, rxq);
+    
+    if (exhausted) {
+        rxq->poll_pending = true;
+        rxq->stats.resched++;
+        if (queue && fRxQueueSource[queue])
+            fRxQueueSource[queue]->interruptOccurred(0, 0, 0);
+        else
+            fRxPollSource->interruptOccurred(0, 0, 0);
+    }
+    
+    IWL_DEBUG_RX(trans, "Q %d: pass handled %u RBs, %u restocks, %u doorbells%s\n",
+                 rxq->id, handled, restocks,
+                 rxq->stats.doorbells - doorbells,
+                 exhausted ? ", rescheduled" : "");
+    
+    rxq->stats.passes++;
+    rxq->stats.rbs += handled;
+    rxq->stats.restocks += restocks;
+    rxq->stats.ns += iwl_pcie_perf_ns() - start;
 }
 
 /* line 1404
@@ -1347,12 +1760,9 @@ void IntelWifi::iwl_pcie_irq_handle_error(struct iwl_trans *trans)
     if (trans->cfg->internal_wimax_coex && !trans->cfg->apmg_not_supported &&
         (!(iwl_read_prph(trans, APMG_CLK_CTRL_REG) & APMS_CLK_VAL_MRB_FUNC_MODE) ||
           (iwl_read_prph(trans, APMG_PS_CTRL_REG) & APMG_PS_CTRL_VAL_RESET_REQ))) {
-             clear_bit(STATUS_SYNC_HCMD_ACTIVE, &trans->status);
              // TODO: Implement
              //iwl_op_mode_wimax_active(trans->op_mode);
-             IOLockLock(trans_pcie->wait_command_queue);
-             IOLockWakeup(trans_pcie->wait_command_queue, &trans->status, true);
-             IOLockUnlock(trans_pcie->wait_command_queue);
+             iwl_pcie_hcmd_wake_all(trans);
              return;
          }
     
@@ -1360,20 +1770,14 @@ void IntelWifi::iwl_pcie_irq_handle_error(struct iwl_trans *trans)
     for (i = 0; i < trans->cfg->base_params->num_of_queues; i++) {
         if (!trans_pcie->txq[i])
             continue;
-        // TODO: Implement
-        //del_timer(&trans_pcie->txq[i]->stuck_timer);
+        iwl_pcie_txq_wd_del(trans_pcie->txq[i]);
     }
     
     /* The STATUS_FW_ERROR bit is set in this function. This must happen
      * before we wake up the command caller, to ensure a proper cleanup. */
-    // TODO: Implement. Inside trans->ops->op is used which is undefined and will cause kernel panic
-    // iwl_trans_fw_error(trans);
+    iwl_trans_fw_error(trans);
     
-    clear_bit(STATUS_SYNC_HCMD_ACTIVE, &trans->status);
-    
-    IOLockLock(trans_pcie->wait_command_queue);
-    IOLockWakeup(trans_pcie->wait_command_queue, &trans->status, true);
-    IOLockUnlock(trans_pcie->wait_command_queue);
+    iwl_pcie_hcmd_wake_all(trans);
 }
 
 // line 1439
@@ -1484,11 +1888,8 @@ void IntelWifi::iwl_pcie_handle_rfkill_irq(struct iwl_trans *trans)
     IOLockUnlock(trans_pcie->mutex);
     
     if (hw_rfkill) {
-        if (test_and_clear_bit(STATUS_SYNC_HCMD_ACTIVE, &trans->status))
+        if (iwl_pcie_hcmd_wake_all(trans))
             IWL_DEBUG_RF_KILL(trans, "Rfkill while SYNC HCMD in flight\n");
-        IOLockLock(trans_pcie->wait_command_queue);
-        IOLockWakeup(trans_pcie->wait_command_queue, &trans->status, true);
-        IOLockUnlock(trans_pcie->wait_command_queue);
     } else {
         clear_bit(STATUS_RFKILL_HW, &trans->status);
         if (trans_pcie->opmode_down)
@@ -1496,6 +1897,89 @@ void IntelWifi::iwl_pcie_handle_rfkill_irq(struct iwl_trans *trans)
     }
 }
 
+static u32 iwl_pcie_irq_mod_pkts(struct iwl_trans *trans)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    u32 pkts = 0;
+    int i;
+    
+    for (i = 0; trans_pcie->rxq && i < trans->num_rx_queues; i++)
+        pkts += trans_pcie->rxq[i].stats.pkts;
+    return pkts;
+}
+
+/*
+ * iwl_pcie_irq_mod_init - start in the low latency setting
+ */
+void iwl_pcie_irq_mod_init(struct iwl_trans *trans)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_pcie_irq_mod *mod = &trans_pcie->irq_mod;
+    
+    mod->mode = IWL_IRQ_MOD_LATENCY;
+    mod->timeout = IWL_IRQ_MOD_LATENCY_TIMEOUT;
+    mod->window_start = iwl_pcie_perf_ns();
+    mod->window_irqs = 0;
+    mod->window_pkts = iwl_pcie_irq_mod_pkts(trans);
+    
+    iwl_write8(trans, CSR_INT_COALESCING, mod->timeout);
+}
+
+/*
+ * iwl_pcie_irq_mod_sample - account an interrupt and retune coalescing
+ *
+ * Called for every interrupt. Once per window the interrupt and packet
+ * rates are computed; a busy link moves to the bulk setting, which trades
+ * some latency for far fewer interrupts, and only drops back once traffic
+ * is well below the bulk thresholds.
+ */
+void iwl_pcie_irq_mod_sample(struct iwl_trans *trans)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_pcie_irq_mod *mod = &trans_pcie->irq_mod;
+    enum iwl_irq_mod_mode mode;
+    u64 now, elapsed;
+    u32 pkts;
+    
+    OSIncrementAtomic(&mod->window_irqs);
+    
+    /* MSI-X vectors run in parallel, only one of them evaluates */
+    if (!OSCompareAndSwap(0, 1, &mod->busy))
+        return;
+    
+    now = iwl_pcie_perf_ns();
+    elapsed = now - mod->window_start;
+    if (elapsed < IWL_IRQ_MOD_WINDOW_NS)
+        goto out;
+    
+    pkts = iwl_pcie_irq_mod_pkts(trans);
+    mod->irq_rate = (u32)(iwl_pcie_atomic_take(&mod->window_irqs) * 1000000000ULL / elapsed);
+    mod->pkt_rate = (u32)((pkts - mod->window_pkts) * 1000000000ULL / elapsed);
+    mod->window_pkts = pkts;
+    mod->window_start = now;
+    
+    mode = mod->mode;
+    if (mode == IWL_IRQ_MOD_LATENCY &&
+        (mod->pkt_rate >= IWL_IRQ_MOD_BULK_PKTS || mod->irq_rate >= IWL_IRQ_MOD_BULK_IRQS))
+        mode = IWL_IRQ_MOD_BULK;
+    else if (mode == IWL_IRQ_MOD_BULK &&
+             mod->pkt_rate < IWL_IRQ_MOD_IDLE_PKTS && mod->irq_rate < IWL_IRQ_MOD_IDLE_IRQS)
+        mode = IWL_IRQ_MOD_LATENCY;
+    
+    if (mode != mod->mode) {
+        mod->mode = mode;
+        mod->timeout = mode == IWL_IRQ_MOD_BULK ? IWL_HOST_INT_TIMEOUT_DEF : IWL_IRQ_MOD_LATENCY_TIMEOUT;
+        mod->switches++;
+        iwl_write8(trans, CSR_INT_COALESCING, mod->timeout);
+        IWL_DEBUG_ISR(trans, "irq moderation: %s, %u irqs/s, %u pkts/s\n",
+                      mode == IWL_IRQ_MOD_BULK ? "bulk" : "latency",
+                      mod->irq_rate, mod->pkt_rate);
+    }
+    
+out:
+    OSCompareAndSwap(1, 0, &mod->busy);
+}
+
 // line 1559
 void IntelWifi::iwl_pcie_irq_handler(int irq, void *dev_id)
 {
@@ -1517,6 +2001,10 @@ void IntelWifi::iwl_pcie_irq_handler(int irq, void *dev_id)
     else
         inta = iwl_pcie_int_cause_non_ict(trans);
     
+    /* causes the busy-poll thread already read */
+    inta |= trans_pcie->busy_poll.inta;
+    trans_pcie->busy_poll.inta = 0;
+    
     if (iwl_have_debug_level(IWL_DL_ISR)) {
         IWL_DEBUG_ISR(trans,
                       "ISR inta 0x%08x, enabled 0x%08x(sw), enabled(hw) 0x%08x, fh 0x%08x\n",
@@ -1681,8 +2169,11 @@ void IntelWifi::iwl_pcie_irq_handler(int irq, void *dev_id)
          * any dangling Rx interrupt.  If it was just the periodic
          * interrupt, there was no dangling Rx activity, and no need
          * to extend the periodic interrupt; one-shot is enough.
+         * Under bulk traffic the next RX interrupt is never far off,
+         * so the periodic one is left disarmed.
          */
-        if (inta & (CSR_INT_BIT_FH_RX | CSR_INT_BIT_SW_RX))
+        if ((inta & (CSR_INT_BIT_FH_RX | CSR_INT_BIT_SW_RX)) &&
+            trans_pcie->irq_mod.mode == IWL_IRQ_MOD_LATENCY)
             iwl_write8(trans, CSR_INT_PERIODIC_REG, CSR_INT_PERIODIC_ENA);
         
         isr_stats->rx++;
@@ -1690,6 +2181,12 @@ void IntelWifi::iwl_pcie_irq_handler(int irq, void *dev_id)
         // local_bh_disable();
         iwl_pcie_rx_handle(trans, 0);
         //        local_bh_enable();
+        
+        /* RSS queues run in parallel on their own work loops */
+        for (int i = 1; i < trans->num_rx_queues; i++) {
+            if (fRxQueueSource[i])
+                fRxQueueSource[i]->interruptOccurred(0, 0, 0);
+        }
     }
     
     /* This "Tx" DMA channel is used only for loading uCode */
@@ -1732,6 +2229,53 @@ out:
     return;
 }
 
+/*
+ * iwl_pcie_busy_poll - one pass of the busy-poll thread
+ *
+ * Causes are read the way the interrupt handler reads them, from the ICT
+ * table when it is in use, so nothing is left behind in it for the next
+ * interrupt. RX is handled right away. Any other cause ends the session:
+ * it is passed to the interrupt handler, which runs here with the gate
+ * held, as reading the ICT table consumed it.
+ * Returns 1 if RBs were handled, 0 if there was nothing to do and -1 if
+ * the session has to end.
+ */
+int IntelWifi::iwl_pcie_busy_poll(struct iwl_trans *trans)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    u32 rx_causes = CSR_INT_BIT_FH_RX | CSR_INT_BIT_SW_RX | CSR_INT_BIT_RX_PERIODIC;
+    struct iwl_rxq *rxq;
+    u32 inta, r;
+    
+    if (!trans_pcie->rxq)
+        return -1;
+    rxq = &trans_pcie->rxq[0];
+    
+    if (trans_pcie->use_ict)
+        inta = iwl_pcie_int_cause_ict(trans);
+    else
+        inta = iwl_pcie_int_cause_non_ict(trans);
+    if (inta == 0xFFFFFFFF)
+        return -1;
+    if (inta & trans_pcie->inta_mask & ~rx_causes) {
+        trans_pcie->busy_poll.inta |= inta;
+        iwl_pcie_irq_handler(0, trans);
+        return -1;
+    }
+    if (inta & rx_causes) {
+        iwl_write32(trans, CSR_INT, inta & rx_causes);
+        iwl_write32(trans, CSR_FH_INT_STATUS, CSR_FH_INT_RX_MASK);
+    }
+    
+    r = le16_to_cpu(rxq->rb_stts->closed_rb_num) & 0x0FFF;
+    r &= (rxq->queue_size - 1);
+    if (r == rxq->read)
+        return 0;
+    
+    iwl_pcie_rx_handle(trans, 0);
+    return 1;
+}
+
 /******************************************************************************
  *
  * ICT functions
@@ -1828,3 +2372,178 @@ void iwl_pcie_disable_ict(struct iwl_trans *trans)
     trans_pcie->use_ict = false;
     //IOSimpleLockUnlock(trans_pcie->irq_lock);
 }
+
+/*
+ * line 1195
+ * Before sending the interrupt the HW disables it to prevent
+ * a nested interrupt. This is done by writing 1 to the corresponding
+ * bit in the mask register. After handling the interrupt, it should be
+ * re-enabled by clearing this bit. This register is defined as
+ * write 1 clear (W1C) register, meaning that it's being clear
+ * by writing 1 to the bit. Every vector is re-armed on its own.
+ */
+static void iwl_pcie_clear_irq(struct iwl_trans *trans, int vector)
+{
+    iwl_write32(trans, CSR_MSIX_AUTOMASK_ST_AD, BIT(vector));
+}
+
+// line 1212
+void IntelWifi::iwl_pcie_irq_rx_msix_handler(int vector)
+{
+    struct iwl_trans *trans = fTrans;
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    int queue = vector;
+    
+    /* with a shared first RSS vector, vector N serves queue N + 1 */
+    if (vector && (trans_pcie->shared_vec_mask & IWL_SHARED_IRQ_FIRST_RSS))
+        queue++;
+    
+    if (queue >= trans->num_rx_queues) {
+        IWL_WARN(trans, "MSI-X vector %d has no RX queue\n", vector);
+        return;
+    }
+    
+    iwl_pcie_rx_handle(trans, queue);
+    
+    iwl_pcie_clear_irq(trans, vector);
+}
+
+/*
+ * The uCode load (FH TX) cause has a vector of its own when the OS gave
+ * us enough of them, so firmware loading completes even while the default
+ * vector is busy.
+ */
+void IntelWifi::iwl_pcie_irq_fh_msix_handler(int vector)
+{
+    struct iwl_trans *trans = fTrans;
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    u32 inta_fh;
+    
+    inta_fh = iwl_read32(trans, CSR_MSIX_FH_INT_CAUSES_AD) & MSIX_FH_INT_CAUSES_D2S_CH0_NUM;
+    /* only ack our own cause, the default vector handles the rest */
+    iwl_write32(trans, CSR_MSIX_FH_INT_CAUSES_AD, inta_fh);
+    
+    if (inta_fh) {
+        IWL_DEBUG_ISR(trans, "uCode load interrupt\n");
+        trans_pcie->isr_stats.tx++;
+        /* Wake up uCode load routine, now that load is complete */
+        IOLockLock(trans_pcie->ucode_write_waitq);
+        trans_pcie->ucode_write_complete = true;
+        IOLockWakeup(trans_pcie->ucode_write_waitq, &trans_pcie->ucode_write_complete, true);
+        IOLockUnlock(trans_pcie->ucode_write_waitq);
+    }
+    
+    iwl_pcie_clear_irq(trans, vector);
+}
+
+// line 1907
+void IntelWifi::iwl_pcie_irq_msix_handler(int vector)
+{
+    struct iwl_trans *trans = fTrans;
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct isr_statistics *isr_stats = &trans_pcie->isr_stats;
+    u32 inta_fh, inta_hw;
+    
+    // lock_map_acquire(&trans->sync_cmd_lockdep_map);
+    
+    inta_fh = iwl_read32(trans, CSR_MSIX_FH_INT_CAUSES_AD);
+    inta_hw = iwl_read32(trans, CSR_MSIX_HW_INT_CAUSES_AD);
+    
+    /* the uCode load cause is acked by its own vector */
+    if (trans_pcie->fh_irq != trans_pcie->def_irq)
+        inta_fh &= ~MSIX_FH_INT_CAUSES_D2S_CH0_NUM;
+    
+    /*
+     * Clear causes registers to avoid being handling the same cause.
+     */
+    iwl_write32(trans, CSR_MSIX_FH_INT_CAUSES_AD, inta_fh);
+    iwl_write32(trans, CSR_MSIX_HW_INT_CAUSES_AD, inta_hw);
+    
+    if (unlikely(!(inta_fh | inta_hw))) {
+        IWL_DEBUG_ISR(trans, "Ignore interrupt, inta == 0\n");
+        iwl_pcie_clear_irq(trans, vector);
+        return;
+    }
+    
+    if (iwl_have_debug_level(IWL_DL_ISR))
+        IWL_DEBUG_ISR(trans, "ISR inta_fh 0x%08x, enabled 0x%08x\n",
+                      inta_fh, iwl_read32(trans, CSR_MSIX_FH_INT_MASK_AD));
+    
+    if ((trans_pcie->shared_vec_mask & IWL_SHARED_IRQ_NON_RX) &&
+        inta_fh & MSIX_FH_INT_CAUSES_Q0) {
+        iwl_pcie_rx_handle(trans, 0);
+    }
+    
+    /* queue 1 is only ever handled on its own work loop */
+    if ((trans_pcie->shared_vec_mask & IWL_SHARED_IRQ_FIRST_RSS) &&
+        inta_fh & MSIX_FH_INT_CAUSES_Q1 && fRxQueueSource[1]) {
+        fRxQueueSource[1]->interruptOccurred(0, 0, 0);
+    }
+    
+    /* This "Tx" DMA channel is used only for loading uCode */
+    if (inta_fh & MSIX_FH_INT_CAUSES_D2S_CH0_NUM) {
+        IWL_DEBUG_ISR(trans, "uCode load interrupt\n");
+        isr_stats->tx++;
+        /*
+         * Wake up uCode load routine,
+         * now that load is complete
+         */
+        IOLockLock(trans_pcie->ucode_write_waitq);
+        trans_pcie->ucode_write_complete = true;
+        IOLockWakeup(trans_pcie->ucode_write_waitq, &trans_pcie->ucode_write_complete, true);
+        IOLockUnlock(trans_pcie->ucode_write_waitq);
+    }
+    
+    /* Error detected by uCode */
+    if ((inta_fh & MSIX_FH_INT_CAUSES_FH_ERR) ||
+        (inta_hw & MSIX_HW_INT_CAUSES_REG_SW_ERR)) {
+        IWL_ERR(trans, "Microcode SW error detected. Restarting 0x%X.\n", inta_fh);
+        isr_stats->sw++;
+        iwl_pcie_irq_handle_error(trans);
+    }
+    
+    /* After checking FH register check HW register */
+    if (iwl_have_debug_level(IWL_DL_ISR))
+        IWL_DEBUG_ISR(trans, "ISR inta_hw 0x%08x, enabled 0x%08x\n",
+                      inta_hw, iwl_read32(trans, CSR_MSIX_HW_INT_MASK_AD));
+    
+    /* Alive notification via Rx interrupt will do the real work */
+    if (inta_hw & MSIX_HW_INT_CAUSES_REG_ALIVE) {
+        IWL_DEBUG_ISR(trans, "Alive interrupt\n");
+        isr_stats->alive++;
+        if (trans->cfg->gen2) {
+            /* We can restock, since firmware configured the RFH */
+            iwl_pcie_rxmq_restock(trans, trans_pcie->rxq);
+        }
+    }
+    
+    /* uCode wakes up after power-down sleep */
+    if (inta_hw & MSIX_HW_INT_CAUSES_REG_WAKEUP) {
+        IWL_DEBUG_ISR(trans, "Wakeup interrupt\n");
+        iwl_pcie_rxq_check_wrptr(trans);
+        iwl_pcie_txq_check_wrptrs(trans);
+        
+        isr_stats->wakeup++;
+    }
+    
+    /* Chip got too hot and stopped itself */
+    if (inta_hw & MSIX_HW_INT_CAUSES_REG_CT_KILL) {
+        IWL_ERR(trans, "Microcode CT kill error detected.\n");
+        isr_stats->ctkill++;
+    }
+    
+    /* HW RF KILL switch toggled */
+    if (inta_hw & MSIX_HW_INT_CAUSES_REG_RF_KILL)
+        iwl_pcie_handle_rfkill_irq(trans);
+    
+    if (inta_hw & MSIX_HW_INT_CAUSES_REG_HW_ERR) {
+        IWL_ERR(trans, "Hardware error detected. Restarting.\n");
+        
+        isr_stats->hw++;
+        iwl_pcie_irq_handle_error(trans);
+    }
+    
+    iwl_pcie_clear_irq(trans, vector);
+    
+    // lock_map_release(&trans->sync_cmd_lockdep_map);
+}
@@ -76,6 +76,7 @@
 #include <IntelWifi.hpp>
 
 #include <kern/task.h>
+#include <sys/sysctl.h>
 
 /* extended range in FW SRAM */
 #define IWL_FW_MEM_EXTENDED_START    0x40000
@@ -924,9 +925,15 @@ static void iwl_pcie_map_non_rx_causes(struct iwl_trans *trans)
      * Access all non RX causes and map them to the default irq.
      * In case we are missing at least one interrupt vector,
      * the first interrupt vector will serve non-RX and FBQ causes.
+     * The uCode load cause gets a vector of its own when one is left,
+     * so firmware loading is never held up by the other causes.
      */
     for (i = 0; i < ARRAY_SIZE(causes_list); i++) {
-        iwl_write8(trans, CSR_MSIX_IVAR(causes_list[i].addr), val);
+        if (causes_list[i].cause_num == MSIX_FH_INT_CAUSES_D2S_CH0_NUM &&
+            trans_pcie->fh_irq != trans_pcie->def_irq)
+            iwl_write8(trans, CSR_MSIX_IVAR(causes_list[i].addr), trans_pcie->fh_irq);
+        else
+            iwl_write8(trans, CSR_MSIX_IVAR(causes_list[i].addr), val);
         iwl_clear_bit(trans, causes_list[i].mask_reg, causes_list[i].cause_num);
     }
 }
@@ -1072,7 +1079,6 @@ void IntelWifi::_iwl_trans_pcie_stop_device(struct iwl_trans *trans, bool low_po
     iwl_disable_interrupts(trans);
     
     /* clear all status bits */
-    clear_bit(STATUS_SYNC_HCMD_ACTIVE, &trans->status);
     clear_bit(STATUS_INT_ENABLED, &trans->status);
     clear_bit(STATUS_TPOWER_PMI, &trans->status);
     
@@ -1210,6 +1216,97 @@ void IntelWifi::iwl_trans_pcie_handle_stop_rfkill(struct iwl_trans *trans, bool
         iwl_trans_pcie_rf_kill(trans, hw_rfkill);
 }
 
+/*
+ * iwl_pcie_dump_perf_stats - report the time spent in the transport hot paths
+ */
+void iwl_pcie_dump_perf_stats(struct iwl_trans *trans)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_pcie_perf_stats *stats = &trans_pcie->perf_stats;
+    int i;
+    
+    IWL_DEBUG_INFO(trans, "irq moderation: %s (timeout %u x 32 usecs), %u irqs/s, %u pkts/s, %u switches\n",
+                   trans_pcie->irq_mod.mode == IWL_IRQ_MOD_BULK ? "bulk" : "latency",
+                   trans_pcie->irq_mod.timeout, trans_pcie->irq_mod.irq_rate,
+                   trans_pcie->irq_mod.pkt_rate, trans_pcie->irq_mod.switches);
+    /* every poll hit saves the interrupt to work loop latency */
+    IWL_DEBUG_INFO(trans, "busy poll: %s, %u sessions, %u polls, %u hits, %llu ns interrupt latency saved per hit\n",
+                   trans_pcie->busy_poll.enabled ? "on" : "off",
+                   trans_pcie->busy_poll.sessions, trans_pcie->busy_poll.polls,
+                   trans_pcie->busy_poll.hits,
+                   trans_pcie->busy_poll.irq_lat_cnt ?
+                   trans_pcie->busy_poll.irq_lat_ns / trans_pcie->busy_poll.irq_lat_cnt : 0);
+    
+    for (i = 0; trans_pcie->rxq && i < trans->num_rx_queues; i++) {
+        struct iwl_rxq_stats *rxs = &trans_pcie->rxq[i].stats;
+        
+        IWL_DEBUG_INFO(trans, "rxq %d: %u passes, %u RBs, %u pkts, %llu ns/RB\n",
+                       i, rxs->passes, rxs->rbs, rxs->pkts,
+                       rxs->rbs ? rxs->ns / rxs->rbs : 0);
+        IWL_DEBUG_INFO(trans, "rxq %d pass: %u RBs, %u restocks, %u doorbells on average, %u rescheduled\n",
+                       i,
+                       rxs->passes ? rxs->rbs / rxs->passes : 0,
+                       rxs->passes ? rxs->restocks / rxs->passes : 0,
+                       rxs->passes ? rxs->doorbells / rxs->passes : 0,
+                       rxs->resched);
+        IWL_DEBUG_INFO(trans, "rxq %d: %u frames to the stack, %llu bytes copied/frame, %u emergency RBs\n",
+                       i, rxs->frames,
+                       rxs->frames ? rxs->bytes_copied / rxs->frames : 0,
+                       rxs->emergency);
+    }
+    IWL_DEBUG_INFO(trans, "rx allocator: %u runs, %u requests\n",
+                   stats->rx_alloc_runs, stats->rx_alloc_reqs);
+    if (trans_pcie->rx_page_pool)
+        IWL_DEBUG_INFO(trans, "rx page pool: %u RBs, %u free, %u hits, %u misses, %u high-water, %d lent\n",
+                       trans_pcie->rx_page_pool->n_pages, trans_pcie->rx_page_pool->n_free,
+                       trans_pcie->rx_page_pool->hits, trans_pcie->rx_page_pool->misses,
+                       trans_pcie->rx_page_pool->high_water, trans_pcie->rx_page_pool->lent);
+    IWL_DEBUG_INFO(trans, "tx rings: %lu DMA bytes resident\n",
+                   (unsigned long)trans_pcie->tx_dma_bytes);
+    for (i = 0; i < IWL_HCMD_BUF_CLASSES; i++) {
+        struct iwl_hcmd_buf_class *cls = &trans_pcie->hcmd_bufs[i];
+        
+        IWL_DEBUG_INFO(trans, "hcmd bufs %u B: %u of %u free, %u allocs, %u full, %u high-water\n",
+                       cls->size, __builtin_popcount(cls->free), cls->count,
+                       cls->allocs, cls->full, cls->high_water);
+    }
+    IWL_DEBUG_INFO(trans, "hcmd bufs: %u oversize\n", trans_pcie->hcmd_buf_oversize);
+    for (i = 0; i < (int)ARRAY_SIZE(trans_pcie->hcmd_lat); i++) {
+        struct iwl_pcie_hcmd_lat *hist = &trans_pcie->hcmd_lat[i];
+        
+        if (!hist->count)
+            continue;
+        
+        IWL_DEBUG_INFO(trans, "hcmd %s: %u sent, %llu ns average, %llu ns max\n",
+                       iwl_get_cmd_string(trans, iwl_cmd_id(i, 0, 0)), hist->count,
+                       hist->total_ns / hist->count, hist->max_ns);
+    }
+    
+    for (i = 0; i < trans->cfg->base_params->num_of_queues; i++) {
+        struct iwl_txq *txq = trans_pcie->txq[i];
+        
+        if (!txq || !txq->stats.frames)
+            continue;
+        
+        /* frames/doorbell above 1 is MMIO saved by batching */
+        IWL_DEBUG_INFO(trans, "txq %d: %u frames, %u doorbells (%u.%02u frames/doorbell), %u sleep checks\n",
+                       i, txq->stats.frames, txq->stats.doorbells,
+                       txq->stats.doorbells ? txq->stats.frames / txq->stats.doorbells : 0,
+                       txq->stats.doorbells ? txq->stats.frames * 100 / txq->stats.doorbells % 100 : 0,
+                       txq->stats.sleep_checks);
+        IWL_DEBUG_INFO(trans, "txq %d bounce: %u of %u frames copied (%u%%), copybreak %u bytes, %u linearized\n",
+                       i, txq->stats.bounced, txq->stats.frames,
+                       txq->stats.bounced * 100 / txq->stats.frames,
+                       trans_pcie->tx_copybreak, txq->stats.linearized);
+        IWL_DEBUG_INFO(trans, "txq %d flow control: %u stops, %u frames overflowed, %d waiting\n",
+                       i, txq->stats.stops, txq->stats.overflowed, txq->overflow_len);
+        IWL_DEBUG_INFO(trans, "txq %d completion: %u frames, avg %llu us, max %llu us\n",
+                       i, txq->stats.completions,
+                       txq->stats.completions ? txq->stats.completion_ns / txq->stats.completions / 1000 : 0,
+                       txq->stats.completion_max_ns / 1000);
+    }
+}
+
 // line 1347
 void IntelWifi::iwl_trans_pcie_stop_device(struct iwl_trans *trans, bool low_power)
 {
@@ -1223,6 +1320,8 @@ void IntelWifi::iwl_trans_pcie_stop_device(struct iwl_trans *trans, bool low_pow
     _iwl_trans_pcie_stop_device(trans, low_power);
     iwl_trans_pcie_handle_stop_rfkill(trans, was_in_rfkill);
     IOLockUnlock(trans_pcie->mutex);
+    
+    iwl_pcie_dump_perf_stats(trans);
 }
 
 
@@ -1248,70 +1347,123 @@ void iwl_trans_pcie_rf_kill(struct iwl_trans *trans, bool state)
 void IntelWifi::iwl_pcie_set_interrupt_capa(/*struct pci_dev *pdev,*/
                                             struct iwl_trans *trans)
 {
-    // I haven't found any way to enable MSI-X in OS X, so this method is basically not needed
-    // MSI is enabled in start method of this class.
+    // MSI-X vectors are published by IOPCIFamily as interrupt indexes of
+    // type kIOInterruptTypePCIMessagedX. If there are not enough of them we
+    // stay on the MSI source set up in the start method of this class.
     
     struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    int max_irqs, num_irqs, index, nr_online_cpus;
+    size_t len = sizeof(nr_online_cpus);
+    bool own_fh_irq;
+    
     trans_pcie->msix_enabled = false;
-    //    int max_irqs, num_irqs, i, ret, nr_online_cpus;
-    //    u16 pci_cmd;
-    //
-    //    if (!trans->cfg->mq_rx_supported)
-    //        goto enable_msi;
-    //
-    //    nr_online_cpus = num_online_cpus();
-    //    max_irqs = min_t(u32, nr_online_cpus + 2, IWL_MAX_RX_HW_QUEUES);
-    //    for (i = 0; i < max_irqs; i++)
-    //        trans_pcie->msix_entries[i].entry = i;
-    //
-    //    num_irqs = pci_enable_msix_range(pdev, trans_pcie->msix_entries,
-    //                                     MSIX_MIN_INTERRUPT_VECTORS,
-    //                                     max_irqs);
-    //    if (num_irqs < 0) {
-    //        IWL_DEBUG_INFO(trans,
-    //                       "Failed to enable msi-x mode (ret %d). Moving to msi mode.\n",
-    //                       num_irqs);
-    //        goto enable_msi;
-    //    }
-    //    trans_pcie->def_irq = (num_irqs == max_irqs) ? num_irqs - 1 : 0;
-    //
-    //    IWL_DEBUG_INFO(trans,
-    //                   "MSI-X enabled. %d interrupt vectors were allocated\n",
-    //                   num_irqs);
-    //
-    //    /*
-    //     * In case the OS provides fewer interrupts than requested, different
-    //     * causes will share the same interrupt vector as follows:
-    //     * One interrupt less: non rx causes shared with FBQ.
-    //     * Two interrupts less: non rx causes shared with FBQ and RSS.
-    //     * More than two interrupts: we will use fewer RSS queues.
-    //     */
-    //    if (num_irqs <= nr_online_cpus) {
-    //        trans_pcie->trans->num_rx_queues = num_irqs + 1;
-    //        trans_pcie->shared_vec_mask = IWL_SHARED_IRQ_NON_RX |
-    //        IWL_SHARED_IRQ_FIRST_RSS;
-    //    } else if (num_irqs == nr_online_cpus + 1) {
-    //        trans_pcie->trans->num_rx_queues = num_irqs;
-    //        trans_pcie->shared_vec_mask = IWL_SHARED_IRQ_NON_RX;
-    //    } else {
-    //        trans_pcie->trans->num_rx_queues = num_irqs - 1;
-    //    }
-    //
-    //    trans_pcie->alloc_vecs = num_irqs;
-    //    trans_pcie->msix_enabled = true;
-    //    return;
-    //
-    //enable_msi:
-    //    ret = pci_enable_msi(pdev);
-    //    if (ret) {
-    //        dev_err(&pdev->dev, "pci_enable_msi failed - %d\n", ret);
-    //        /* enable rfkill interrupt: hw bug w/a */
-    //        pci_read_config_word(pdev, PCI_COMMAND, &pci_cmd);
-    //        if (pci_cmd & PCI_COMMAND_INTX_DISABLE) {
-    //            pci_cmd &= ~PCI_COMMAND_INTX_DISABLE;
-    //            pci_write_config_word(pdev, PCI_COMMAND, pci_cmd);
-    //        }
-    //    }
+    
+    if (!trans->cfg->mq_rx_supported)
+        return;
+    
+    if (sysctlbyname("hw.activecpu", &nr_online_cpus, &len, NULL, 0) || nr_online_cpus < 1)
+        nr_online_cpus = 1;
+    
+    /* one vector more than Linux asks for, for the uCode load cause */
+    max_irqs = min_t(u32, nr_online_cpus + 3, IWL_MAX_RX_HW_QUEUES);
+    
+    num_irqs = 0;
+    for (index = 0; num_irqs < max_irqs; index++) {
+        int interruptType;
+        
+        if (pciDevice->getInterruptType(index, &interruptType) != kIOReturnSuccess)
+            break;
+        if (interruptType & kIOInterruptTypePCIMessagedX)
+            fMsixIndex[num_irqs++] = index;
+    }
+    
+    if (num_irqs < MSIX_MIN_INTERRUPT_VECTORS) {
+        IWL_DEBUG_INFO(trans,
+                       "Failed to enable msi-x mode (%d vectors). Moving to msi mode.\n",
+                       num_irqs);
+        return;
+    }
+    
+    IWL_DEBUG_INFO(trans,
+                   "MSI-X enabled. %d interrupt vectors were allocated\n",
+                   num_irqs);
+    
+    /*
+     * In case the OS provides fewer interrupts than requested, different
+     * causes will share the same interrupt vector as follows:
+     * All of them: the uCode load cause gets the last vector to itself.
+     * One interrupt less: uCode load shares the default vector.
+     * Two interrupts less: non rx causes shared with FBQ.
+     * Three interrupts less: non rx causes shared with FBQ and RSS.
+     * More than three interrupts: we will use fewer RSS queues.
+     */
+    own_fh_irq = num_irqs == max_irqs && num_irqs > 2;
+    trans_pcie->shared_vec_mask = 0;
+    if (own_fh_irq) {
+        trans_pcie->trans->num_rx_queues = num_irqs - 2;
+        trans_pcie->def_irq = num_irqs - 2;
+    } else if (num_irqs <= nr_online_cpus) {
+        trans_pcie->trans->num_rx_queues = num_irqs + 1;
+        trans_pcie->shared_vec_mask = IWL_SHARED_IRQ_NON_RX |
+        IWL_SHARED_IRQ_FIRST_RSS;
+        trans_pcie->def_irq = 0;
+    } else if (num_irqs == nr_online_cpus + 1) {
+        trans_pcie->trans->num_rx_queues = num_irqs;
+        trans_pcie->shared_vec_mask = IWL_SHARED_IRQ_NON_RX;
+        trans_pcie->def_irq = 0;
+    } else {
+        trans_pcie->trans->num_rx_queues = num_irqs - 1;
+        trans_pcie->def_irq = num_irqs - 1;
+    }
+    trans_pcie->fh_irq = own_fh_irq ? num_irqs - 1 : trans_pcie->def_irq;
+    
+    trans_pcie->alloc_vecs = num_irqs;
+    trans_pcie->msix_enabled = true;
+}
+
+// line 1575
+int IntelWifi::iwl_pcie_init_msix_handler(struct iwl_trans_pcie *trans_pcie)
+{
+    struct iwl_trans *trans = trans_pcie->trans;
+    u32 offset = trans_pcie->shared_vec_mask & IWL_SHARED_IRQ_FIRST_RSS ? 1 : 0;
+    int i;
+    
+    /*
+     * Every vector gets an event source of its own. The default, uCode load
+     * and FBQ vectors run on fWorkLoop with the rest of the driver; only the
+     * RSS vectors run on the work loop of their queue.
+     */
+    for (i = 0; i < trans_pcie->alloc_vecs; i++) {
+        IOWorkLoop *workLoop;
+        
+        if (i == 0 || i == trans_pcie->def_irq || i == trans_pcie->fh_irq) {
+            workLoop = fWorkLoop;
+        } else {
+            workLoop = fRxQueueWorkLoop[i + offset];
+        }
+        if (!workLoop) {
+            IWL_ERR(trans, "No work loop for MSI-X vector %d\n", i);
+            return -ENOMEM;
+        }
+        
+        fMsixSource[i] = IOFilterInterruptEventSource::filterInterruptEventSource(this,
+                                                                                  (IOInterruptEventAction) &IntelWifi::msixOccured,
+                                                                                  (IOFilterInterruptAction) &IntelWifi::msixFilter,
+                                                                                  pciDevice, fMsixIndex[i]);
+        if (!fMsixSource[i]) {
+            IWL_ERR(trans, "Error allocating MSI-X vector %d\n", i);
+            return -ENOMEM;
+        }
+        
+        if (workLoop->addEventSource(fMsixSource[i]) != kIOReturnSuccess) {
+            IWL_ERR(trans, "Error registering MSI-X vector %d\n", i);
+            RELEASE(fMsixSource[i]);
+            return -EINVAL;
+        }
+        fMsixSource[i]->enable();
+    }
+    
+    return 0;
 }
 
 // line 1636
@@ -1472,10 +1624,85 @@ void IntelWifi::iwl_trans_pcie_free(struct iwl_trans *trans)
     //    free_percpu(trans_pcie->tso_hdr_page);
     IOSimpleLockFree(trans_pcie->irq_lock);
     IOSimpleLockFree(trans_pcie->reg_lock);
+    IOLockFree(trans_pcie->rx_input_lock);
+    IOLockFree(trans_pcie->busy_poll.lock);
+    IOSimpleLockFree(trans_pcie->txq_wd.lock);
+    IOLockFree(trans_pcie->hcmd_lock);
     IOLockFree(trans_pcie->mutex);
     iwl_trans_free(trans);
 }
 
+void iwl_trans_pcie_log_scd_error(struct iwl_trans *trans, struct iwl_txq *txq)
+{
+    u32 txq_id = txq->id;
+    u32 status;
+    bool active;
+    u8 fifo;
+    
+    if (trans->cfg->use_tfh) {
+        IWL_ERR(trans, "Queue %d is stuck %d %d\n", txq_id, txq->read_ptr, txq->write_ptr);
+        return;
+    }
+    
+    status = iwl_read_prph(trans, SCD_QUEUE_STATUS_BITS(txq_id));
+    fifo = (status >> SCD_QUEUE_STTS_REG_POS_TXF) & 0x7;
+    active = !!(status & BIT(SCD_QUEUE_STTS_REG_POS_ACTIVE));
+    
+    IWL_ERR(trans,
+            "Queue %d is %sactive on fifo %d and stuck for %lu ms. SW [%d, %d] HW [%d, %d] FH TRB=0x0%x\n",
+            txq_id, active ? "" : "in", fifo, txq->wd_timeout,
+            txq->read_ptr, txq->write_ptr,
+            iwl_read_prph(trans, SCD_QUEUE_RDPTR(txq_id)) & (TFD_QUEUE_SIZE_MAX - 1),
+            iwl_read_prph(trans, SCD_QUEUE_WRPTR(txq_id)) & (TFD_QUEUE_SIZE_MAX - 1),
+            iwl_read_direct32(trans, FH_TX_TRB_REG(fifo)));
+}
+
+void iwl_trans_pcie_freeze_txq_timer(struct iwl_trans *trans, unsigned long txqs, bool freeze)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    int queue;
+    
+    for_each_set_bit(queue, &txqs, BITS_PER_LONG) {
+        struct iwl_txq *txq = trans_pcie->txq[queue];
+        
+        IOSimpleLockLock(txq->lock);
+        
+        if (txq->frozen == freeze)
+            goto next_queue;
+        
+        IWL_DEBUG_TX_QUEUES(trans, "%s TXQ %d\n", freeze ? "Freezing" : "Waking", queue);
+        
+        txq->frozen = freeze;
+        
+        if (txq->read_ptr == txq->write_ptr)
+            goto next_queue;
+        
+        if (freeze) {
+            /* remember how long until the timer fires */
+            txq->frozen_expiry_remainder = iwl_pcie_txq_wd_remaining(txq);
+            if (unlikely(!txq->frozen_expiry_remainder)) {
+                /*
+                 * The timer should have fired, maybe it is
+                 * spinning right now on the lock.
+                 */
+                goto next_queue;
+            }
+            iwl_pcie_txq_wd_del(txq);
+            goto next_queue;
+        }
+        
+        /*
+         * Wake a non-empty queue -> arm timer with the
+         * remainder before it froze
+         */
+        if (txq->frozen_expiry_remainder)
+            iwl_pcie_txq_wd_mod(txq, txq->frozen_expiry_remainder);
+        
+    next_queue:
+        IOSimpleLockUnlock(txq->lock);
+    }
+}
+
 
 
 
@@ -1501,6 +1728,20 @@ struct iwl_trans* IntelWifi::iwl_trans_pcie_alloc(const struct iwl_cfg *cfg) {
     trans_pcie->irq_lock = IOSimpleLockAlloc();
     trans_pcie->reg_lock = IOSimpleLockAlloc();
     trans_pcie->mutex = IOLockAlloc();
+    trans_pcie->rx_page_pool = iwl_pcie_rx_pool_alloc();
+    if (!trans_pcie->rx_page_pool) {
+        iwl_trans_free(trans);
+        return NULL;
+    }
+    trans_pcie->rx_input_lock = IOLockAlloc();
+    trans_pcie->rx_budget = RX_BUDGET_DEF;
+    trans_pcie->tx_copybreak = IWL_TX_COPYBREAK_DEF;
+    trans_pcie->busy_poll.lock = IOLockAlloc();
+    trans_pcie->txq_wd.lock = IOSimpleLockAlloc();
+    for (int level = 0; level < IWL_TXQ_WD_WHEEL_LEVELS; level++)
+        for (int slot = 0; slot < IWL_TXQ_WD_WHEEL_SIZE; slot++)
+            LIST_INIT(&trans_pcie->txq_wd.slots[level][slot]);
+    trans_pcie->hcmd_lock = IOLockAlloc();
     
     trans_pcie->ucode_write_waitq = IOLockAlloc();
     // TODO: Implement
@@ -1661,10 +1902,8 @@ struct iwl_trans* IntelWifi::iwl_trans_pcie_alloc(const struct iwl_cfg *cfg) {
     int ret;
     
     if (trans_pcie->msix_enabled) {
-        // ret = iwl_pcie_init_msix_handler(pdev, trans_pcie);
-        // if (ret)
-        //     goto out_no_pci;
-        
+        /* the vector sources are attached by iwl_pcie_init_msix_handler
+         * once the RSS queue work loops exist */
     } else {
         ret = iwl_pcie_alloc_ict(trans);
         if (ret) {
@@ -1682,10 +1921,9 @@ struct iwl_trans* IntelWifi::iwl_trans_pcie_alloc(const struct iwl_cfg *cfg) {
         //            goto out_free_ict;
         //        }
         trans_pcie->inta_mask = CSR_INI_SET_MASK;
+        fInterruptSource->enable();
     }
     
-    fInterruptSource->enable();
-    
     
     
     //    trans_pcie->rba.alloc_wq = alloc_workqueue("rb_allocator",
@@ -146,7 +146,182 @@ void iwl_pcie_free_dma_ptr(struct iwl_trans *trans, struct iwl_dma_ptr *ptr)
     //memset(ptr, 0, sizeof(*ptr));
 }
 
+static const struct {
+    u32 size;
+    u32 count;
+} iwl_pcie_hcmd_buf_classes[IWL_HCMD_BUF_CLASSES] = {
+    { 128, 32 },
+    { 512, 16 },
+    { 2048, 4 },
+};
 
+/*
+ * iwl_pcie_hcmd_bufs_alloc - carve the host command buffer classes
+ *
+ * Every class is a single DMA allocation split into equal buffers, so
+ * sending a command doesn't have to create an IODMACommand each time.
+ */
+int iwl_pcie_hcmd_bufs_alloc(struct iwl_trans *trans)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    int c;
+    u32 i;
+    
+    BUILD_BUG_ON(ARRAY_SIZE(iwl_pcie_hcmd_buf_classes) != IWL_HCMD_BUF_CLASSES);
+    
+    for (c = 0; c < IWL_HCMD_BUF_CLASSES; c++) {
+        struct iwl_hcmd_buf_class *cls = &trans_pcie->hcmd_bufs[c];
+        
+        memset(cls, 0, sizeof(*cls));
+        cls->size = iwl_pcie_hcmd_buf_classes[c].size;
+        cls->count = iwl_pcie_hcmd_buf_classes[c].count;
+        
+        cls->mem = allocate_dma_buf(cls->size * cls->count, DMA_BIT_MASK(trans_pcie->addr_size));
+        if (!cls->mem)
+            goto error;
+        
+        cls->bufs = (struct iwl_dma_ptr *)iwh_zalloc(sizeof(struct iwl_dma_ptr) * cls->count);
+        if (!cls->bufs)
+            goto error;
+        
+        /* bmd and cmd stay NULL, these never go to free_dma_buf */
+        for (i = 0; i < cls->count; i++) {
+            cls->bufs[i].addr = (u8 *)cls->mem->addr + i * cls->size;
+            cls->bufs[i].dma = cls->mem->dma + i * cls->size;
+            cls->bufs[i].size = cls->size;
+        }
+        cls->free = (UInt32)((1ULL << cls->count) - 1);
+    }
+    trans_pcie->hcmd_buf_oversize = 0;
+    
+    return 0;
+    
+error:
+    IWL_ERR(trans, "Host command buffer allocation failed\n");
+    iwl_pcie_hcmd_bufs_free(trans);
+    return -ENOMEM;
+}
+
+void iwl_pcie_hcmd_bufs_free(struct iwl_trans *trans)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    int c;
+    
+    for (c = 0; c < IWL_HCMD_BUF_CLASSES; c++) {
+        struct iwl_hcmd_buf_class *cls = &trans_pcie->hcmd_bufs[c];
+        
+        iwh_free(cls->bufs);
+        cls->bufs = NULL;
+        if (cls->mem)
+            free_dma_buf(cls->mem);
+        cls->mem = NULL;
+        cls->free = 0;
+    }
+}
+
+/*
+ * iwl_pcie_hcmd_buf_get - take a buffer for @len bytes of a host command
+ *
+ * Called with hcmd_lock held, so there is a single taker and the bitmap
+ * only has to be protected against iwl_pcie_hcmd_buf_put(), which runs
+ * from the reclaim path. A full class falls through to the next bigger
+ * one; what fits no class is allocated on its own as before.
+ */
+static struct iwl_dma_ptr *iwl_pcie_hcmd_buf_get(struct iwl_trans *trans, u32 len)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    int c;
+    
+    for (c = 0; c < IWL_HCMD_BUF_CLASSES; c++) {
+        struct iwl_hcmd_buf_class *cls = &trans_pcie->hcmd_bufs[c];
+        UInt32 free;
+        u32 bit, used;
+        
+        if (!cls->bufs || len > cls->size)
+            continue;
+        
+        do {
+            free = cls->free;
+            if (!free)
+                break;
+            bit = __builtin_ctz(free);
+        } while (!OSCompareAndSwap(free, free & ~BIT(bit), &cls->free));
+        
+        if (!free) {
+            cls->full++;
+            continue;
+        }
+        
+        cls->allocs++;
+        used = cls->count - __builtin_popcount(free) + 1;
+        if (used > cls->high_water)
+            cls->high_water = used;
+        return &cls->bufs[bit];
+    }
+    
+    trans_pcie->hcmd_buf_oversize++;
+    return allocate_dma_buf(len, DMA_BIT_MASK(trans_pcie->addr_size));
+}
+
+static void iwl_pcie_hcmd_buf_put(struct iwl_trans_pcie *trans_pcie, struct iwl_dma_ptr *dma)
+{
+    int c;
+    
+    for (c = 0; c < IWL_HCMD_BUF_CLASSES; c++) {
+        struct iwl_hcmd_buf_class *cls = &trans_pcie->hcmd_bufs[c];
+        
+        if (cls->bufs && dma >= cls->bufs && dma < cls->bufs + cls->count) {
+            OSBitOrAtomic(BIT(dma - cls->bufs), &cls->free);
+            return;
+        }
+    }
+    
+    free_dma_buf(dma);
+}
+
+
+
+/* line 170
+ * iwl_pcie_txq_update_byte_cnt_tbl - Set up entry in Tx byte-count array
+ */
+static void iwl_pcie_txq_update_byte_cnt_tbl(struct iwl_trans *trans, struct iwl_txq *txq, u16 byte_cnt, int num_tbs)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwlagn_scd_bc_tbl *scd_bc_tbl = (struct iwlagn_scd_bc_tbl *)trans_pcie->scd_bc_tbls->addr;
+    int write_ptr = txq->write_ptr;
+    int txq_id = txq->id;
+    u8 sec_ctl = 0;
+    u16 len = byte_cnt + IWL_TX_CRC_SIZE + IWL_TX_DELIMITER_SIZE;
+    __le16 bc_ent;
+    struct iwl_tx_cmd *tx_cmd = (struct iwl_tx_cmd *)txq->entries[write_ptr].cmd->payload;
+    u8 sta_id = tx_cmd->sta_id;
+    
+    sec_ctl = tx_cmd->sec_ctl;
+    
+    switch (sec_ctl & TX_CMD_SEC_MSK) {
+        case TX_CMD_SEC_CCM:
+            len += IEEE80211_CCMP_MIC_LEN;
+            break;
+        case TX_CMD_SEC_TKIP:
+            len += IEEE80211_TKIP_ICV_LEN;
+            break;
+        case TX_CMD_SEC_WEP:
+            len += IEEE80211_WEP_IV_LEN + IEEE80211_WEP_ICV_LEN;
+            break;
+    }
+    if (trans_pcie->bc_table_dword)
+        len = DIV_ROUND_UP(len, 4);
+    
+    if (WARN_ON(len > 0xFFF || write_ptr >= TFD_QUEUE_SIZE_MAX))
+        return;
+    
+    bc_ent = cpu_to_le16(len | (sta_id << 12));
+    
+    scd_bc_tbl[txq_id].tfd_offset[write_ptr] = bc_ent;
+    
+    if (write_ptr < TFD_QUEUE_SIZE_BC_DUP)
+        scd_bc_tbl[txq_id].tfd_offset[TFD_QUEUE_SIZE_MAX + write_ptr] = bc_ent;
+}
 
 // line 217
 static void iwl_pcie_txq_inval_byte_cnt_tbl(struct iwl_trans *trans, struct iwl_txq *txq)
@@ -202,6 +377,7 @@ static void iwl_pcie_txq_inc_wr_ptr(struct iwl_trans *trans, struct iwl_txq *txq
          * time we'll skip this part.
          */
         reg = iwl_read32(trans, CSR_UCODE_DRV_GP1);
+        txq->stats.sleep_checks++;
         
         if (reg & CSR_UCODE_DRV_GP1_BIT_MAC_SLEEP) {
             IWL_DEBUG_INFO(trans, "Tx queue %d requesting wakeup, GP1 = 0x%x\n", txq_id, reg);
@@ -216,8 +392,10 @@ static void iwl_pcie_txq_inc_wr_ptr(struct iwl_trans *trans, struct iwl_txq *txq
      * trying to tx (during RFKILL, we're not trying to tx).
      */
     IWL_DEBUG_TX(trans, "Q:%d WR: 0x%x\n", txq_id, txq->write_ptr);
-    if (!txq->block)
+    if (!txq->block) {
         iwl_write32(trans, HBUS_TARG_WRPTR, txq->write_ptr | (txq_id << 8));
+        txq->stats.doorbells++;
+    }
 }
 
 // line 292
@@ -322,7 +500,7 @@ static void iwl_pcie_tfd_unmap(struct iwl_trans *trans, struct iwl_cmd_meta *met
     // that were previously allocated
     for (i = 0; i < ARRAY_SIZE(meta->dma); ++i) {
         if (meta->dma[i]) {
-            free_dma_buf(meta->dma[i]);
+            iwl_pcie_hcmd_buf_put(trans_pcie, meta->dma[i]);
         }
         meta->dma[i] = NULL;
     }
@@ -379,7 +557,7 @@ void iwl_pcie_txq_free_tfd(struct iwl_trans *trans, struct iwl_txq *txq)
     
     /* free SKB */
     if (txq->entries) {
-        struct sk_buff *skb;
+        mbuf_t skb;
         
         skb = txq->entries[idx].skb;
         
@@ -388,9 +566,11 @@ void iwl_pcie_txq_free_tfd(struct iwl_trans *trans, struct iwl_txq *txq)
          * freed and that the queue is not empty - free the skb
          */
         if (skb) {
-            // TODO: Implement
-            // iwl_op_mode_free_skb(trans->op_mode, skb);
+            /* iwl_op_mode_free_skb(): the mbuf and its TX command go together */
+            mbuf_freem(skb);
             txq->entries[idx].skb = NULL;
+            iwl_trans_free_tx_cmd(trans, txq->entries[idx].cmd);
+            txq->entries[idx].cmd = NULL;
         }
     }
 }
@@ -425,7 +605,7 @@ static int iwl_pcie_txq_build_tfd(struct iwl_trans *trans, struct iwl_txq *txq,
 
 
 // line 487
-int IntelWifi::iwl_pcie_txq_alloc(struct iwl_trans *trans, struct iwl_txq *txq, int slots_num, bool cmd_queue)
+int iwl_pcie_txq_alloc(struct iwl_trans *trans, struct iwl_txq *txq, int slots_num, bool cmd_queue)
 {
     struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
     size_t tfd_sz = trans_pcie->tfd_size * TFD_QUEUE_SIZE_MAX;
@@ -434,14 +614,11 @@ int IntelWifi::iwl_pcie_txq_alloc(struct iwl_trans *trans, struct iwl_txq *txq,
     int ret;
     struct iwl_dma_ptr *tfds_dma = NULL;
     struct iwl_dma_ptr *first_tb_bufs_dma = NULL;
+    struct iwl_dma_ptr *bounce_dma = NULL;
 
     if (WARN_ON(txq->entries || txq->tfds))
         return -EINVAL;
 
-    // TODO: Implement
-//    setup_timer(&txq->stuck_timer, iwl_pcie_txq_stuck_timer, (unsigned long)txq);
-    txq->trans_pcie = trans_pcie;
-    
     txq->n_window = slots_num;
     
     txq->entries = (struct iwl_pcie_txq_entry *) iwh_zalloc(sizeof(struct iwl_pcie_txq_entry) * slots_num);
@@ -478,9 +655,30 @@ int IntelWifi::iwl_pcie_txq_alloc(struct iwl_trans *trans, struct iwl_txq *txq,
     txq->first_tb_bufs = (struct iwl_pcie_first_tb_buf *)first_tb_bufs_dma->addr;
     txq->first_tb_dma = first_tb_bufs_dma->dma;
     
+    /* TB1 and small frames of data queues are copied, never mapped */
+    if (!cmd_queue) {
+        ret = iwl_pcie_alloc_dma_ptr(trans, &bounce_dma, sizeof(*txq->bounce_bufs) * slots_num);
+        if (ret) {
+            goto err_free_first_tb;
+        }
+        
+        txq->bounce_dma_ptr = bounce_dma;
+        txq->bounce_bufs = (struct iwl_pcie_bounce_buf *)bounce_dma->addr;
+        txq->bounce_dma = bounce_dma->dma;
+        trans_pcie->tx_dma_bytes += bounce_dma->size;
+    }
+    
+    trans_pcie->tx_dma_bytes += tfds_dma->size + first_tb_bufs_dma->size;
+    
     return 0;
+err_free_first_tb:
+    free_dma_buf(txq->first_tb_dma_ptr);
+    txq->first_tb_dma_ptr = NULL;
+    txq->first_tb_bufs = NULL;
 err_free_tfds:
     free_dma_buf(txq->tfds_dma_ptr);
+    txq->tfds_dma_ptr = NULL;
+    txq->tfds = NULL;
 error:
     if (txq->entries && cmd_queue)
         for (i = 0; i < slots_num; i++)
@@ -517,8 +715,9 @@ int IntelWifi::iwl_pcie_txq_init(struct iwl_trans *trans, struct iwl_txq *txq, i
 //        lockdep_set_class(&txq->lock, &iwl_pcie_cmd_queue_lock_class);
     }
     
-    // TODO: Implement
-    //__skb_queue_head_init(&txq->overflow_q);
+    txq->overflow_head = 0;
+    txq->overflow_len = 0;
+    txq->overflow_tx = false;
     
     return 0;
 }
@@ -559,7 +758,7 @@ static void iwl_pcie_txq_unmap(struct iwl_trans *trans, int txq_id)
         IWL_DEBUG_TX_REPLY(trans, "Q %d Free %d\n", txq_id, txq->read_ptr);
         
         if (txq_id != trans_pcie->cmd_queue) {
-            struct sk_buff *skb = txq->entries[txq->read_ptr].skb;
+            mbuf_t skb = txq->entries[txq->read_ptr].skb;
             
             if (WARN_ON_ONCE(!skb))
                 continue;
@@ -584,21 +783,278 @@ static void iwl_pcie_txq_unmap(struct iwl_trans *trans, int txq_id)
         }
     }
 
-    // TODO: Implement
-//    while (!skb_queue_empty(&txq->overflow_q)) {
-//        struct sk_buff *skb = __skb_dequeue(&txq->overflow_q);
-//
-//        iwl_op_mode_free_skb(trans->op_mode, skb);
-//    }
+    while (txq->overflow_len) {
+        struct iwl_txq_overflow *ov = &txq->overflow_q[txq->overflow_head];
+        
+        mbuf_freem(ov->skb);
+        iwl_trans_free_tx_cmd(trans, ov->dev_cmd);
+        ov->skb = NULL;
+        ov->dev_cmd = NULL;
+        txq->overflow_head = (txq->overflow_head + 1) % IWL_TXQ_OVERFLOW_MAX;
+        txq->overflow_len--;
+    }
     
     //spin_unlock_bh(&txq->lock);
     
+    iwl_pcie_txq_wd_del(txq);
+    
     /* just in case - this queue may have been stopped */
-    // TODO: Implement
-    // iwl_wake_queue(trans, txq);
+    iwl_wake_queue(trans, txq);
+}
+
+/* internal.h line 851
+ * iwl_wake_queue - let the op mode feed a queue that has room again
+ *
+ * Like ieee80211_wake_queue, the op mode hears about it from the work loop,
+ * so this is safe to call with the queue lock held.
+ */
+void iwl_wake_queue(struct iwl_trans *trans, struct iwl_txq *txq)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    
+    if (test_and_clear_bit(txq->id, trans_pcie->queue_stopped)) {
+        IWL_DEBUG_TX_QUEUES(trans, "Wake hwq %d\n", txq->id);
+        set_bit(txq->id, trans_pcie->queue_wake);
+        if (trans_pcie->tx_wake)
+            static_cast<IOInterruptEventSource *>(trans_pcie->tx_wake)->interruptOccurred(0, 0, 0);
+    }
+}
+
+/* internal.h line 836
+ * iwl_stop_queue - the queue is over its high watermark, the op mode must
+ * stop sending to it
+ */
+void IntelWifi::iwl_stop_queue(struct iwl_trans *trans, struct iwl_txq *txq)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    
+    if (!test_and_set_bit(txq->id, trans_pcie->queue_stopped)) {
+        if (hw)
+            opmode->queue_full((struct iwl_priv *)hw->priv, txq->id);
+        txq->stats.stops++;
+        IWL_DEBUG_TX_QUEUES(trans, "Stop hwq %d\n", txq->id);
+    } else {
+        IWL_DEBUG_TX_QUEUES(trans, "hwq %d already stopped\n", txq->id);
+    }
+}
+
+/* line 1170, tail of iwl_trans_pcie_reclaim
+ * iwl_pcie_txq_resume - the ring has room again after a reclaim
+ *
+ * Puts the overflow frames on the ring and wakes the queue once it is back
+ * under its low watermark. Called with the queue lock held, the lock is
+ * dropped around each frame. While it is, @overflow_tx keeps a second
+ * resume out and sends frames from other callers to the back of the
+ * overflow ring, so they don't pass the ones being moved. The doorbell
+ * is rung once at the end.
+ */
+void IntelWifi::iwl_pcie_txq_resume(struct iwl_trans *trans, struct iwl_txq *txq)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    
+    if (txq->overflow_tx || iwl_queue_space(txq) <= txq->low_mark ||
+        !test_bit(txq->id, trans_pcie->queue_stopped))
+        return;
+    
+    txq->overflow_tx = true;
+    
+    /* only the resume adds to the ring now, so the room checked here stays */
+    while (txq->overflow_len && iwl_queue_space(txq) >= 3) {
+        struct iwl_txq_overflow ov = txq->overflow_q[txq->overflow_head];
+        
+        txq->overflow_q[txq->overflow_head].skb = NULL;
+        txq->overflow_q[txq->overflow_head].dev_cmd = NULL;
+        txq->overflow_head = (txq->overflow_head + 1) % IWL_TXQ_OVERFLOW_MAX;
+        txq->overflow_len--;
+        
+        IOSimpleLockUnlock(txq->lock);
+        if (iwl_pcie_txq_tx(trans, ov.skb, ov.dev_cmd, txq->id, true, true)) {
+            mbuf_freem(ov.skb);
+            iwl_trans_free_tx_cmd(trans, ov.dev_cmd);
+        }
+        IOSimpleLockLock(txq->lock);
+    }
+    
+    txq->overflow_tx = false;
+    iwl_pcie_txq_inc_wr_ptr(trans, txq);
+    
+    if (iwl_queue_space(txq) > txq->low_mark)
+        iwl_wake_queue(trans, txq);
+}
+
+
+static u64 iwl_pcie_txq_wd_ticks(void)
+{
+    return iwl_pcie_perf_ns() / (IWL_TXQ_WD_TICK_MS * NSEC_PER_MSEC);
+}
+
+/* called with the wheel lock held, expiries already due go in the next tick */
+static void iwl_pcie_txq_wd_file(struct iwl_txq_wd_wheel *wd, struct iwl_txq *txq)
+{
+    u64 delta = txq->wd_expires > wd->now ? txq->wd_expires - wd->now : 1;
+    u64 expires;
+    
+    if (delta <= IWL_TXQ_WD_WHEEL_SIZE) {
+        LIST_INSERT_HEAD(&wd->slots[0][(wd->now + delta) & IWL_TXQ_WD_WHEEL_MASK], txq, wd_list);
+        return;
+    }
+    
+    /* out of the wheel's reach, it is refiled from the last level 1 slot */
+    expires = wd->now + min_t(u64, delta, (IWL_TXQ_WD_WHEEL_SIZE - 1) * IWL_TXQ_WD_WHEEL_SIZE);
+    LIST_INSERT_HEAD(&wd->slots[1][(expires >> IWL_TXQ_WD_WHEEL_BITS) & IWL_TXQ_WD_WHEEL_MASK],
+                     txq, wd_list);
 }
 
+/*
+ * iwl_pcie_txq_wd_mod - (re)arm the stuck queue watchdog, mod_timer on Linux
+ * @timeout: ms from now
+ *
+ * A queue already on the wheel only gets its expiry moved.
+ */
+void iwl_pcie_txq_wd_mod(struct iwl_txq *txq, unsigned long timeout)
+{
+    struct iwl_txq_wd_wheel *wd = &txq->trans_pcie->txq_wd;
+    u64 now = iwl_pcie_txq_wd_ticks();
+    
+    IOSimpleLockLock(wd->lock);
+    
+    txq->wd_expires = now + DIV_ROUND_UP(timeout, IWL_TXQ_WD_TICK_MS);
+    
+    if (!txq->wd_filed) {
+        /* an idle wheel has no queues to keep in place, catch up with the clock */
+        if (!wd->armed++) {
+            wd->now = now;
+            if (wd->timer)
+                static_cast<IOTimerEventSource *>(wd->timer)->setTimeoutMS(IWL_TXQ_WD_TICK_MS);
+        }
+        iwl_pcie_txq_wd_file(wd, txq);
+        txq->wd_filed = true;
+    }
+    
+    IOSimpleLockUnlock(wd->lock);
+}
+
+/*
+ * iwl_pcie_txq_wd_del - disarm the stuck queue watchdog, del_timer on Linux
+ */
+void iwl_pcie_txq_wd_del(struct iwl_txq *txq)
+{
+    struct iwl_txq_wd_wheel *wd;
+    
+    if (!txq->trans_pcie)
+        return;
+    
+    wd = &txq->trans_pcie->txq_wd;
+    
+    IOSimpleLockLock(wd->lock);
+    txq->wd_expires = 0;
+    if (txq->wd_filed) {
+        LIST_REMOVE(txq, wd_list);
+        txq->wd_filed = false;
+        wd->armed--;
+    }
+    IOSimpleLockUnlock(wd->lock);
+}
+
+/* ms until the watchdog of the queue fires, 0 if it is not armed or due */
+unsigned long iwl_pcie_txq_wd_remaining(struct iwl_txq *txq)
+{
+    struct iwl_txq_wd_wheel *wd = &txq->trans_pcie->txq_wd;
+    u64 now = iwl_pcie_txq_wd_ticks();
+    unsigned long remaining = 0;
+    
+    IOSimpleLockLock(wd->lock);
+    if (txq->wd_filed && txq->wd_expires > now)
+        remaining = (unsigned long)(txq->wd_expires - now) * IWL_TXQ_WD_TICK_MS;
+    IOSimpleLockUnlock(wd->lock);
+    
+    return remaining;
+}
+
+/* line 469
+ * iwl_pcie_txq_stuck_timer - the queue made no progress for wd_timeout
+ */
+static void iwl_pcie_txq_stuck_timer(struct iwl_trans *trans, struct iwl_txq *txq)
+{
+    IOSimpleLockLock(txq->lock);
+    /* check if triggered erroneously */
+    if (txq->read_ptr == txq->write_ptr) {
+        IOSimpleLockUnlock(txq->lock);
+        return;
+    }
+    IOSimpleLockUnlock(txq->lock);
+    
+    iwl_trans_pcie_log_scd_error(trans, txq);
+    
+    /* the firmware dumps its state and raises the SW error interrupt */
+    iwl_force_nmi(trans);
+}
 
+/*
+ * iwl_pcie_txq_wd_tick - advance the watchdog wheel to the current tick
+ *
+ * Runs from the watchdog timer on the work loop. Expired queues are only
+ * handled once the wheel lock is dropped.
+ */
+void iwl_pcie_txq_wd_tick(struct iwl_trans *trans)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_txq_wd_wheel *wd = &trans_pcie->txq_wd;
+    unsigned long stuck[BITS_TO_LONGS(IWL_MAX_TVQM_QUEUES)] = {};
+    u64 target = iwl_pcie_txq_wd_ticks();
+    struct iwl_txq *txq, *tmp;
+    bool rearm;
+    int i;
+    
+    IOSimpleLockLock(wd->lock);
+    
+    /* after a long stall a full turn of both levels visits every queue */
+    if (target - wd->now > IWL_TXQ_WD_WHEEL_SIZE * IWL_TXQ_WD_WHEEL_SIZE)
+        wd->now = target - IWL_TXQ_WD_WHEEL_SIZE * IWL_TXQ_WD_WHEEL_SIZE;
+    
+    while (wd->armed && wd->now < target) {
+        u64 tick = wd->now + 1;
+        
+        /* level 0 wraps, bring the next level 1 slot down */
+        if (!(tick & IWL_TXQ_WD_WHEEL_MASK)) {
+            LIST_FOREACH_SAFE(txq, &wd->slots[1][(tick >> IWL_TXQ_WD_WHEEL_BITS) & IWL_TXQ_WD_WHEEL_MASK],
+                              wd_list, tmp) {
+                LIST_REMOVE(txq, wd_list);
+                iwl_pcie_txq_wd_file(wd, txq);
+            }
+        }
+        
+        wd->now = tick;
+        
+        LIST_FOREACH_SAFE(txq, &wd->slots[0][tick & IWL_TXQ_WD_WHEEL_MASK], wd_list, tmp) {
+            LIST_REMOVE(txq, wd_list);
+            
+            /* made progress since it was filed */
+            if (txq->wd_expires > tick) {
+                iwl_pcie_txq_wd_file(wd, txq);
+                continue;
+            }
+            
+            txq->wd_filed = false;
+            txq->wd_expires = 0;
+            wd->armed--;
+            set_bit(txq->id, stuck);
+        }
+    }
+    
+    if (!wd->armed)
+        wd->now = target;
+    rearm = wd->armed > 0;
+    
+    IOSimpleLockUnlock(wd->lock);
+    
+    if (rearm && wd->timer)
+        static_cast<IOTimerEventSource *>(wd->timer)->setTimeoutMS(IWL_TXQ_WD_TICK_MS);
+    
+    for_each_set_bit(i, stuck, IWL_MAX_TVQM_QUEUES)
+        if (trans_pcie->txq[i])
+            iwl_pcie_txq_stuck_timer(trans, trans_pcie->txq[i]);
+}
 
 /* line 666
  * iwl_pcie_txq_free - Deallocate DMA queue.
@@ -622,10 +1078,8 @@ static void iwl_pcie_txq_free(struct iwl_trans *trans, int txq_id)
     
     /* De-alloc array of command/tx buffers */
     if (txq_id == trans_pcie->cmd_queue)
-        for (i = 0; i < txq->n_window; i++) {
+        for (i = 0; i < txq->n_window; i++)
             iwh_free(txq->entries[i].cmd);
-            iwh_free((void *)txq->entries[i].free_buf);
-        }
     
     /* De-alloc circular buffer of TFDs */
     if (txq->tfds) {
@@ -634,17 +1088,66 @@ static void iwl_pcie_txq_free(struct iwl_trans *trans, int txq_id)
         txq->tfds = NULL;
         
         free_dma_buf(txq->first_tb_dma_ptr);
+        
+        if (txq->bounce_dma_ptr)
+            free_dma_buf(txq->bounce_dma_ptr);
     }
     
     iwh_free(txq->entries);
     txq->entries = NULL;
     
-    //del_timer_sync(&txq->stuck_timer);
+    iwl_pcie_txq_wd_del(txq);
     
     /* 0-fill queue descriptor structure */
     bzero(txq, sizeof(*txq));
 }
 
+/*
+ * iwl_pcie_txq_release - give a disabled data queue's rings back
+ *
+ * The next iwl_trans_pcie_txq_enable allocates them again. They are
+ * detached under the queue lock, so a racing TX finds no ring, and freed
+ * once it is dropped. The lock, the indexes and the stats stay.
+ */
+static void iwl_pcie_txq_release(struct iwl_trans *trans, struct iwl_txq *txq)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_dma_ptr *tfds_dma, *first_tb_dma, *bounce_dma;
+    struct iwl_pcie_txq_entry *entries;
+    
+    IOSimpleLockLock(txq->lock);
+    tfds_dma = txq->tfds_dma_ptr;
+    first_tb_dma = txq->first_tb_dma_ptr;
+    bounce_dma = txq->bounce_dma_ptr;
+    entries = txq->entries;
+    
+    txq->tfds_dma_ptr = NULL;
+    txq->tfds = NULL;
+    txq->dma_addr = 0;
+    txq->first_tb_dma_ptr = NULL;
+    txq->first_tb_bufs = NULL;
+    txq->first_tb_dma = 0;
+    txq->bounce_dma_ptr = NULL;
+    txq->bounce_bufs = NULL;
+    txq->bounce_dma = 0;
+    txq->entries = NULL;
+    IOSimpleLockUnlock(txq->lock);
+    
+    if (!tfds_dma)
+        return;
+    
+    trans_pcie->tx_dma_bytes -= tfds_dma->size + first_tb_dma->size;
+    free_dma_buf(tfds_dma);
+    free_dma_buf(first_tb_dma);
+    
+    if (bounce_dma) {
+        trans_pcie->tx_dma_bytes -= bounce_dma->size;
+        free_dma_buf(bounce_dma);
+    }
+    
+    iwh_free(entries);
+}
+
 
 
 // line 715
@@ -782,8 +1285,12 @@ void iwl_pcie_tx_free(struct iwl_trans *trans)
             iwl_pcie_txq_free(trans, txq_id);
             trans_pcie->txq[txq_id] = NULL;
         }
+        trans_pcie->tx_dma_bytes = 0;
     }
     
+    /* after the command queue, its unmap gives the buffers back */
+    iwl_pcie_hcmd_bufs_free(trans);
+    
     iwh_free(trans_pcie->txq_memory);
     trans_pcie->txq_memory = NULL;
     
@@ -799,7 +1306,7 @@ void iwl_pcie_tx_free(struct iwl_trans *trans)
 int IntelWifi::iwl_pcie_tx_alloc(struct iwl_trans *trans)
 {
     int ret;
-    int txq_id, slots_num;
+    int txq_id;
     struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
     
     u16 scd_bc_tbls_size = trans->cfg->base_params->num_of_queues * sizeof(struct iwlagn_scd_bc_tbl);
@@ -832,20 +1339,27 @@ int IntelWifi::iwl_pcie_tx_alloc(struct iwl_trans *trans)
         goto error;
     }
     
-    /* Alloc and init all Tx queues, including the command queue (#4/#9) */
+    /*
+     * Only the command queue (#4/#9) gets its rings here, the data queues
+     * get theirs when the op mode enables them.
+     */
     for (txq_id = 0; txq_id < trans->cfg->base_params->num_of_queues; txq_id++) {
-        bool cmd_queue = (txq_id == trans_pcie->cmd_queue);
-        
-        slots_num = cmd_queue ? TFD_CMD_SLOTS : TFD_TX_CMD_SLOTS;
         trans_pcie->txq[txq_id] = &trans_pcie->txq_memory[txq_id];
-        ret = iwl_pcie_txq_alloc(trans, trans_pcie->txq[txq_id], slots_num, cmd_queue);
-        if (ret) {
-            IWL_ERR(trans, "Tx %d queue alloc failed\n", txq_id);
-            goto error;
-        }
         trans_pcie->txq[txq_id]->id = txq_id;
+        /* the watchdog finds its wheel through trans_pcie */
+        trans_pcie->txq[txq_id]->trans_pcie = trans_pcie;
+    }
+    
+    ret = iwl_pcie_txq_alloc(trans, trans_pcie->txq[trans_pcie->cmd_queue], TFD_CMD_SLOTS, true);
+    if (ret) {
+        IWL_ERR(trans, "Tx %d queue alloc failed\n", trans_pcie->cmd_queue);
+        goto error;
     }
     
+    ret = iwl_pcie_hcmd_bufs_alloc(trans);
+    if (ret)
+        goto error;
+    
     return 0;
     
 error:
@@ -896,7 +1410,8 @@ int IntelWifi::iwl_pcie_tx_init(struct iwl_trans *trans)
          * Tell nic where to find circular buffer of TFDs for a
          * given Tx queue, and enable the DMA channel used for that
          * queue.
-         * Circular buffer (TFD queue in DRAM) physical base address
+         * Circular buffer (TFD queue in DRAM) physical base address.
+         * Data queues without a ring yet get theirs in txq_enable.
          */
         iwl_write_direct32(trans, FH_MEM_CBBC_QUEUE(trans, txq_id),
                            (u32)trans_pcie->txq[txq_id]->dma_addr >> 8);
@@ -933,44 +1448,139 @@ void IntelWifi::iwl_pcie_txq_progress(struct iwl_txq *txq)
      * if empty delete timer, otherwise move timer forward
      * since we're making progress on this queue
      */
-    // TODO: Implement
-//    if (txq->read_ptr == txq->write_ptr)
-//        del_timer(&txq->stuck_timer);
-//    else
-//        mod_timer(&txq->stuck_timer, jiffies + txq->wd_timeout);
+    if (txq->read_ptr == txq->write_ptr)
+        iwl_pcie_txq_wd_del(txq);
+    else
+        iwl_pcie_txq_wd_mod(txq, txq->wd_timeout);
 }
 
 
-
-// line 1168
-static int iwl_pcie_set_cmd_in_flight(struct iwl_trans *trans, const struct iwl_host_cmd *cmd)
+/* line 1094
+ * iwl_trans_pcie_reclaim - free the frames before ssn on a data queue
+ *
+ * The freed mbufs come back in @skbs, chained through their nextpkt
+ * pointers, so the op mode frees a whole TX status or block ack at once.
+ * Their TX commands never leave the transport and are freed here.
+ */
+void IntelWifi::iwl_trans_pcie_reclaim(struct iwl_trans *trans, int txq_id, int ssn, mbuf_t *skbs)
 {
     struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
-    int ret;
+    struct iwl_txq *txq = trans_pcie->txq[txq_id];
+    int tfd_num = ssn & (TFD_QUEUE_SIZE_MAX - 1);
+    int last_to_free;
+    mbuf_t tail = NULL;
+    u64 now;
     
-    //lockdep_assert_held(&trans_pcie->reg_lock);
+    *skbs = NULL;
     
-    if (!(cmd->flags & CMD_SEND_IN_IDLE) && !trans_pcie->ref_cmd_in_flight) {
-        trans_pcie->ref_cmd_in_flight = true;
-        IWL_DEBUG_RPM(trans, "set ref_cmd_in_flight - ref\n");
-        iwl_trans_ref(trans);
+    /* This function is not meant to release cmd queue*/
+    if (WARN_ON(txq_id == trans_pcie->cmd_queue))
+        return;
+    
+    IOSimpleLockLock(txq->lock);
+    
+    if (!test_bit(txq_id, trans_pcie->queue_used)) {
+        IWL_DEBUG_TX_QUEUES(trans, "Q %d inactive - ignoring idx %d\n", txq_id, ssn);
+        goto out;
     }
     
-    /*
-     * wake up the NIC to make sure that the firmware will see the host
-     * command - we will let the NIC sleep once all the host commands
-     * returned. This needs to be done only on NICs that have
-     * apmg_wake_up_wa set.
-     */
-    if (trans->cfg->base_params->apmg_wake_up_wa && !trans_pcie->cmd_hold_nic_awake) {
-        __iwl_trans_pcie_set_bit(trans, CSR_GP_CNTRL,
-                                 CSR_GP_CNTRL_REG_FLAG_MAC_ACCESS_REQ);
-        
-        ret = iwl_poll_bit(trans, CSR_GP_CNTRL,
-                           CSR_GP_CNTRL_REG_VAL_MAC_ACCESS_EN,
-                           (CSR_GP_CNTRL_REG_FLAG_MAC_CLOCK_READY |
-                            CSR_GP_CNTRL_REG_FLAG_GOING_TO_SLEEP),
-                           15000);
+    if (txq->read_ptr == tfd_num)
+        goto out;
+    
+    IWL_DEBUG_TX_REPLY(trans, "[Q %d] %d -> %d (%d)\n", txq_id, txq->read_ptr, tfd_num, ssn);
+    
+    /*Since we free until index _not_ inclusive, the one before index is
+     * the last we will free. This one must be used */
+    last_to_free = iwl_queue_dec_wrap(tfd_num);
+    
+    if (!iwl_queue_used(txq, last_to_free)) {
+        IWL_ERR(trans,
+                "%s: Read index for DMA queue txq id (%d), last_to_free %d is out of range [0-%d] %d %d.\n",
+                __func__, txq_id, last_to_free, TFD_QUEUE_SIZE_MAX,
+                txq->write_ptr, txq->read_ptr);
+        goto out;
+    }
+    
+    now = iwl_pcie_perf_ns();
+    
+    for (; txq->read_ptr != tfd_num; txq->read_ptr = iwl_queue_inc_wrap(txq->read_ptr)) {
+        int idx = iwl_pcie_get_cmd_index(txq, txq->read_ptr);
+        struct iwl_pcie_txq_entry *entry = &txq->entries[idx];
+        mbuf_t skb = entry->skb;
+        u64 latency;
+        
+        if (WARN_ON_ONCE(!skb))
+            continue;
+        
+        mbuf_setnextpkt(skb, NULL);
+        if (tail)
+            mbuf_setnextpkt(tail, skb);
+        else
+            *skbs = skb;
+        tail = skb;
+        
+        /* taken off the entry, so free_tfd only unmaps */
+        entry->skb = NULL;
+        
+        latency = now - entry->tx_ns;
+        txq->stats.completions++;
+        txq->stats.completion_ns += latency;
+        if (latency > txq->stats.completion_max_ns)
+            txq->stats.completion_max_ns = latency;
+        
+        /* reads the station from the TX command, so before it goes */
+        if (!trans->cfg->use_tfh)
+            iwl_pcie_txq_inval_byte_cnt_tbl(trans, txq);
+        
+        iwl_pcie_txq_free_tfd(trans, txq);
+        
+        iwl_trans_free_tx_cmd(trans, entry->cmd);
+        entry->cmd = NULL;
+    }
+    
+    iwl_pcie_txq_progress(txq);
+    
+    /* before the resume, which may put the overflow on the empty ring */
+    if (txq->read_ptr == txq->write_ptr) {
+        IWL_DEBUG_RPM(trans, "Q %d - last tx reclaimed\n", txq->id);
+        iwl_trans_unref(trans);
+    }
+    
+    iwl_pcie_txq_resume(trans, txq);
+    
+out:
+    IOSimpleLockUnlock(txq->lock);
+}
+
+// line 1168
+static int iwl_pcie_set_cmd_in_flight(struct iwl_trans *trans, const struct iwl_host_cmd *cmd)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    int ret;
+    
+    //lockdep_assert_held(&trans_pcie->reg_lock);
+    
+    if (!(cmd->flags & CMD_SEND_IN_IDLE) && !trans_pcie->ref_cmd_in_flight) {
+        trans_pcie->ref_cmd_in_flight = true;
+        IWL_DEBUG_RPM(trans, "set ref_cmd_in_flight - ref\n");
+        iwl_trans_ref(trans);
+    }
+    
+    /*
+     * wake up the NIC to make sure that the firmware will see the host
+     * command - we will let the NIC sleep once all the host commands
+     * returned. This needs to be done only on NICs that have
+     * apmg_wake_up_wa set.
+     */
+    if (trans->cfg->base_params->apmg_wake_up_wa && !trans_pcie->cmd_hold_nic_awake) {
+        __iwl_trans_pcie_set_bit(trans, CSR_GP_CNTRL,
+                                 CSR_GP_CNTRL_REG_FLAG_MAC_ACCESS_REQ);
+        
+        ret = iwl_poll_bit(trans, CSR_GP_CNTRL,
+                           CSR_GP_CNTRL_REG_VAL_MAC_ACCESS_EN,
+                           (CSR_GP_CNTRL_REG_FLAG_MAC_CLOCK_READY |
+                            CSR_GP_CNTRL_REG_FLAG_GOING_TO_SLEEP),
+                           15000);
         if (ret < 0) {
             __iwl_trans_pcie_clear_bit(trans, CSR_GP_CNTRL, CSR_GP_CNTRL_REG_FLAG_MAC_ACCESS_REQ);
             IWL_ERR(trans, "Failed to wake NIC for hcmd\n");
@@ -1064,11 +1674,21 @@ bool iwl_trans_pcie_txq_enable(struct iwl_trans *trans, int txq_id, u16 ssn,
     int fifo = -1;
     bool scd_bug = false;
     
+    /* first use of a data queue, the command queue has its rings from tx_alloc */
+    if (!txq->tfds) {
+        if (iwl_pcie_txq_alloc(trans, txq, TFD_TX_CMD_SLOTS, false)) {
+            IWL_ERR(trans, "Tx %d queue alloc failed\n", txq_id);
+            return false;
+        }
+        iwl_write_direct32(trans, FH_MEM_CBBC_QUEUE(trans, txq_id),
+                           (u32)txq->dma_addr >> 8);
+    }
+    
     if (test_and_set_bit(txq_id, trans_pcie->queue_used)) {
         IWL_DEBUG_TX_QUEUES(trans, "queue %d already used - expect issues", txq_id);
     }
     
-    txq->wd_timeout = msecs_to_jiffies(wdg_timeout);
+    txq->wd_timeout = wdg_timeout;
     
     if (cfg) {
         fifo = cfg->fifo;
@@ -1209,31 +1829,38 @@ void iwl_trans_pcie_txq_disable(struct iwl_trans *trans, int txq_id, bool config
     iwl_pcie_txq_unmap(trans, txq_id);
     trans_pcie->txq[txq_id]->ampdu = false;
     
+    if (txq_id != trans_pcie->cmd_queue)
+        iwl_pcie_txq_release(trans, trans_pcie->txq[txq_id]);
+    
     IWL_DEBUG_TX_QUEUES(trans, "Deactivate queue %d\n", txq_id);
 }
 
 /*************** HOST COMMAND QUEUE FUNCTIONS   *****/
 
 /* line 1440
- * iwl_pcie_enqueue_hcmd - enqueue a uCode command
+ * iwl_pcie_enqueue_hcmd_locked - enqueue a uCode command
  * @priv: device private data point
  * @cmd: a pointer to the ucode command structure
+ * @waiter: the sync sender to wake on completion, NULL for async commands
+ * @kick: update the write pointer, a batch does it once for all commands
  *
+ * Called with hcmd_lock held.
  * The function returns < 0 values to indicate the operation
  * failed. On success, it returns the index (>= 0) of command in the
  * command queue.
  */
-static int iwl_pcie_enqueue_hcmd(struct iwl_trans *trans, struct iwl_host_cmd *cmd)
+static int iwl_pcie_enqueue_hcmd_locked(struct iwl_trans *trans, struct iwl_host_cmd *cmd,
+                                        struct iwl_pcie_hcmd_waiter *waiter, bool kick)
 {
     struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
     struct iwl_txq *txq = trans_pcie->txq[trans_pcie->cmd_queue];
     struct iwl_device_cmd *out_cmd;
     struct iwl_cmd_meta *out_meta;
     IOInterruptState flags;
-    void *dup_buf = NULL;
     int idx;
     u16 copy_size, cmd_size, tb0_size;
     bool had_nocopy = false;
+    bool had_dup = false;
     u8 group_id = iwl_cmd_groupid(cmd->id);
     int i, ret;
     u32 cmd_pos;
@@ -1286,16 +1913,16 @@ static int iwl_pcie_enqueue_hcmd(struct iwl_trans *trans, struct iwl_host_cmd *c
             had_nocopy = true;
             
             /* only allowed once */
-            if (WARN_ON(dup_buf)) {
+            if (WARN_ON(had_dup)) {
                 idx = -EINVAL;
                 goto free_dup_buf;
             }
             
-            dup_buf = iwh_malloc(cmdlen[i]);
-            if (!dup_buf)
-                return -ENOMEM;
-            memcpy(dup_buf, cmddata[i], cmdlen[i]);
-           
+            /*
+             * No private copy needed: the data goes into its own
+             * DMA buffer below, before this function returns.
+             */
+            had_dup = true;
         } else {
             /* NOCOPY must not be followed by normal! */
             if (WARN_ON(had_nocopy)) {
@@ -1409,7 +2036,7 @@ static int iwl_pcie_enqueue_hcmd(struct iwl_trans *trans, struct iwl_host_cmd *c
     
     /* map first command fragment, if any remains */
     if (copy_size > tb0_size) {
-        struct iwl_dma_ptr *dma = allocate_dma_buf(copy_size - tb0_size, DMA_BIT_MASK(trans_pcie->addr_size));
+        struct iwl_dma_ptr *dma = iwl_pcie_hcmd_buf_get(trans, copy_size - tb0_size);
         if (!dma) {
             iwl_pcie_tfd_unmap(trans, out_meta, txq, txq->write_ptr);
             idx = -ENOMEM;
@@ -1428,10 +2055,8 @@ static int iwl_pcie_enqueue_hcmd(struct iwl_trans *trans, struct iwl_host_cmd *c
             continue;
         if (!(cmd->dataflags[i] & (IWL_HCMD_DFL_NOCOPY | IWL_HCMD_DFL_DUP)))
             continue;
-        if (cmd->dataflags[i] & IWL_HCMD_DFL_DUP)
-            data = dup_buf;
         
-        struct iwl_dma_ptr *dma = allocate_dma_buf(cmdlen[i], DMA_BIT_MASK(trans_pcie->addr_size));
+        struct iwl_dma_ptr *dma = iwl_pcie_hcmd_buf_get(trans, cmdlen[i]);
         if (!dma) {
             iwl_pcie_tfd_unmap(trans, out_meta, txq, txq->write_ptr);
             idx = -ENOMEM;
@@ -1444,33 +2069,29 @@ static int iwl_pcie_enqueue_hcmd(struct iwl_trans *trans, struct iwl_host_cmd *c
     
     BUILD_BUG_ON(IWL_TFH_NUM_TBS > sizeof(out_meta->tbs) * BITS_PER_BYTE);
     out_meta->flags = cmd->flags;
-    if (txq->entries[idx].free_buf) {
-        IWL_DEBUG_TX(trans, "txq->entries[%d].free_buf is not null", idx);
-        iwh_free((void *)txq->entries[idx].free_buf);
-    }
-    
-    txq->entries[idx].free_buf = dup_buf;
+    txq->entries[idx].waiter = waiter;
+    txq->entries[idx].tx_ns = iwl_pcie_perf_ns();
     
     //trace_iwlwifi_dev_hcmd(trans->dev, cmd, cmd_size, &out_cmd->hdr_wide);
     
     /* start timer if queue currently empty */
-    if (txq->read_ptr == txq->write_ptr && txq->wd_timeout) {
-        // TODO: Implement
-        // mod_timer(&txq->stuck_timer, jiffies + txq->wd_timeout);
-    }
+    if (txq->read_ptr == txq->write_ptr && txq->wd_timeout)
+        iwl_pcie_txq_wd_mod(txq, txq->wd_timeout);
 
     flags = IOSimpleLockLockDisableInterrupt(trans_pcie->reg_lock);
     
     ret = iwl_pcie_set_cmd_in_flight(trans, cmd);
     if (ret < 0) {
         idx = ret;
+        txq->entries[iwl_pcie_get_cmd_index(txq, txq->write_ptr)].waiter = NULL;
         IOSimpleLockUnlockEnableInterrupt(trans_pcie->reg_lock, flags);
         goto out;
     }
     
     /* Increment and update queue's write index */
     txq->write_ptr = iwl_queue_inc_wrap(txq->write_ptr);
-    iwl_pcie_txq_inc_wr_ptr(trans, txq);
+    if (kick)
+        iwl_pcie_txq_inc_wr_ptr(trans, txq);
     
     IOSimpleLockUnlockEnableInterrupt(trans_pcie->reg_lock, flags);
     
@@ -1482,6 +2103,20 @@ free_dup_buf:
     return idx;
 }
 
+static int iwl_pcie_enqueue_hcmd(struct iwl_trans *trans, struct iwl_host_cmd *cmd,
+                                 struct iwl_pcie_hcmd_waiter *waiter)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    int idx;
+    
+    /* oversized fragments are mapped with allocate_dma_buf, which may block */
+    IOLockLock(trans_pcie->hcmd_lock);
+    idx = iwl_pcie_enqueue_hcmd_locked(trans, cmd, waiter, true);
+    IOLockUnlock(trans_pcie->hcmd_lock);
+    
+    return idx;
+}
+
 // line 1810
 static int iwl_pcie_send_hcmd_async(struct iwl_trans *trans, struct iwl_host_cmd *cmd)
 {
@@ -1491,7 +2126,7 @@ static int iwl_pcie_send_hcmd_async(struct iwl_trans *trans, struct iwl_host_cmd
     if (WARN_ON(cmd->flags & CMD_WANT_SKB))
         return -EINVAL;
     
-    ret = iwl_pcie_enqueue_hcmd(trans, cmd);
+    ret = iwl_pcie_enqueue_hcmd(trans, cmd, NULL);
     if (ret < 0) {
         IWL_ERR(trans, "Error sending %s: enqueue_hcmd failed: %d\n", iwl_get_cmd_string(trans, cmd->id), ret);
         return ret;
@@ -1499,6 +2134,42 @@ static int iwl_pcie_send_hcmd_async(struct iwl_trans *trans, struct iwl_host_cmd
     return 0;
 }
 
+/*
+ * iwl_pcie_hcmd_lat_record - account the latency of a completed command
+ *
+ * Called before the slot is reclaimed, so the queue state logged for a
+ * slow command still has it in flight.
+ */
+static void iwl_pcie_hcmd_lat_record(struct iwl_trans *trans, struct iwl_txq *txq,
+                                     struct iwl_pcie_txq_entry *entry, u32 cmd_id)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_pcie_hcmd_lat *hist;
+    u64 ns, us;
+    int bucket;
+    
+    /* wide commands would alias the group 0 opcodes, DVM sends none */
+    if (iwl_cmd_groupid(cmd_id))
+        return;
+    
+    ns = iwl_pcie_perf_ns() - entry->tx_ns;
+    us = ns / NSEC_PER_USEC;
+    bucket = us ? min_t(int, 64 - __builtin_clzll(us), IWL_PCIE_HCMD_LAT_BUCKETS - 1) : 0;
+    
+    hist = &trans_pcie->hcmd_lat[iwl_cmd_opcode(cmd_id)];
+    hist->count++;
+    hist->buckets[bucket]++;
+    hist->total_ns += ns;
+    if (ns > hist->max_ns)
+        hist->max_ns = ns;
+    
+    if (trans_pcie->hcmd_slow_us && us >= trans_pcie->hcmd_slow_us)
+        IWL_WARN(trans, "Slow command %s: %llu us, cmd queue read %d write %d, %d free, %s\n",
+                 iwl_get_cmd_string(trans, cmd_id), us,
+                 txq->read_ptr, txq->write_ptr, iwl_queue_space(txq),
+                 trans_pcie->cmd_hold_nic_awake ? "holding NIC awake" : "NIC may sleep");
+}
+
 /* line 1723
  * iwl_pcie_hcmd_complete - Pull unused buffers off the queue and reclaim them
  * @rxb: Rx buffer to reclaim
@@ -1541,9 +2212,14 @@ void IntelWifi::iwl_pcie_hcmd_complete(struct iwl_trans *trans,
     
     /* Input error checking is done when commands are added to queue. */
     if (meta->flags & CMD_WANT_SKB) {
-        void *p = rxb_steal_page(rxb);
+        /* The RB page goes back to the RX queue, so hand the caller a copy
+         * of the response, freed by iwl_free_resp */
+        u32 len = sizeof(pkt->len_n_flags) + iwl_rx_packet_len(pkt);
+        void *p = iwh_malloc(len);
         
-        meta->source->resp_pkt = pkt;
+        if (p)
+            memcpy(p, pkt, len);
+        meta->source->resp_pkt = (struct iwl_rx_packet *)p;
         meta->source->_rx_page_addr = (unsigned long)p;
         meta->source->_rx_page_order = trans_pcie->rx_page_order;
     }
@@ -1551,17 +2227,23 @@ void IntelWifi::iwl_pcie_hcmd_complete(struct iwl_trans *trans,
     if (meta->flags & CMD_WANT_ASYNC_CALLBACK)
         iwl_op_mode_async_cb(trans->op_mode, cmd);
     
+    iwl_pcie_hcmd_lat_record(trans, txq, &txq->entries[cmd_index], cmd_id);
+    
     iwl_pcie_cmdq_reclaim(trans, txq_id, index);
     
     if (!(meta->flags & CMD_ASYNC)) {
-        if (!test_bit(STATUS_SYNC_HCMD_ACTIVE, &trans->status)) {
-            IWL_WARN(trans, "HCMD_ACTIVE already clear for command %s\n", iwl_get_cmd_string(trans, cmd_id));
-        }
-        clear_bit(STATUS_SYNC_HCMD_ACTIVE, &trans->status);
-        IWL_DEBUG_INFO(trans, "Clearing HCMD_ACTIVE for command %s\n", iwl_get_cmd_string(trans, cmd_id));
-
+        struct iwl_pcie_txq_entry *entry = &txq->entries[cmd_index];
+        
+        /* wake the sender of this slot only, other sync commands keep waiting */
         IOLockLock(trans_pcie->wait_command_queue);
-        IOLockWakeup(trans_pcie->wait_command_queue, &trans->status, true);
+        if (entry->waiter) {
+            entry->waiter->done = true;
+            IOLockWakeup(trans_pcie->wait_command_queue, entry->waiter, true);
+            entry->waiter = NULL;
+            IWL_DEBUG_INFO(trans, "Completing sync command %s\n", iwl_get_cmd_string(trans, cmd_id));
+        } else {
+            IWL_WARN(trans, "No sender waiting for command %s\n", iwl_get_cmd_string(trans, cmd_id));
+        }
         IOLockUnlock(trans_pcie->wait_command_queue);
     }
     
@@ -1584,22 +2266,57 @@ void IntelWifi::iwl_pcie_hcmd_complete(struct iwl_trans *trans,
 }
 
 
+/*
+ * iwl_pcie_hcmd_wake_all - let every sync sender go, no response is coming
+ *
+ * For firmware errors and rfkill, the senders find out from the status
+ * bits. Returns how many senders were waiting.
+ */
+int iwl_pcie_hcmd_wake_all(struct iwl_trans *trans)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_txq *txq = trans_pcie->txq[trans_pcie->cmd_queue];
+    int i, woken = 0;
+    
+    if (!txq || !txq->entries)
+        return 0;
+    
+    IOLockLock(trans_pcie->wait_command_queue);
+    for (i = 0; i < txq->n_window; i++) {
+        struct iwl_pcie_hcmd_waiter *waiter = txq->entries[i].waiter;
+        
+        if (!waiter)
+            continue;
+        
+        waiter->done = true;
+        txq->entries[i].waiter = NULL;
+        IOLockWakeup(trans_pcie->wait_command_queue, waiter, true);
+        woken++;
+    }
+    IOLockUnlock(trans_pcie->wait_command_queue);
+    
+    return woken;
+}
+
+
 #define HOST_COMPLETE_TIMEOUT 2000
 
-// line 1829
+/* line 1829
+ * Any number of sync commands may be in flight, each sender sleeps on the
+ * waiter of its own command queue slot.
+ */
 static int iwl_pcie_send_hcmd_sync(struct iwl_trans *trans, struct iwl_host_cmd *cmd)
 {
     struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
     struct iwl_txq *txq = trans_pcie->txq[trans_pcie->cmd_queue];
+    struct iwl_pcie_hcmd_waiter waiter;
+    AbsoluteTime deadline;
     int cmd_idx;
     int ret;
     
     IWL_DEBUG_INFO(trans, "Attempting to send sync command %s\n", iwl_get_cmd_string(trans, cmd->id));
     
-    if (test_and_set_bit(STATUS_SYNC_HCMD_ACTIVE, &trans->status))
-        return -EIO;
-    
-    IWL_DEBUG_INFO(trans, "Setting HCMD_ACTIVE for command %s\n", iwl_get_cmd_string(trans, cmd->id));
+    waiter.done = false;
     
 //    if (pm_runtime_suspended(&trans_pcie->pci_dev->dev)) {
 //        ret = wait_event_timeout(trans_pcie->d0i3_waitq,
@@ -1611,33 +2328,35 @@ static int iwl_pcie_send_hcmd_sync(struct iwl_trans *trans, struct iwl_host_cmd
 //        }
 //    }
     
-    cmd_idx = iwl_pcie_enqueue_hcmd(trans, cmd);
+    cmd_idx = iwl_pcie_enqueue_hcmd(trans, cmd, &waiter);
     if (cmd_idx < 0) {
         ret = cmd_idx;
-        clear_bit(STATUS_SYNC_HCMD_ACTIVE, &trans->status);
         IWL_ERR(trans, "Error sending %s: enqueue_hcmd failed: %d\n", iwl_get_cmd_string(trans, cmd->id), ret);
         return ret;
     }
     
-    IOLockLock(trans_pcie->wait_command_queue);
-    AbsoluteTime deadline;
     clock_interval_to_deadline(HOST_COMPLETE_TIMEOUT * 2, kMillisecondScale, (UInt64 *) &deadline);
-    ret = IOLockSleepDeadline(trans_pcie->wait_command_queue, &trans->status, deadline, THREAD_INTERRUPTIBLE);
+    ret = THREAD_AWAKENED;
+    
+    IOLockLock(trans_pcie->wait_command_queue);
+    while (!waiter.done && ret == THREAD_AWAKENED)
+        ret = IOLockSleepDeadline(trans_pcie->wait_command_queue, &waiter, deadline, THREAD_INTERRUPTIBLE);
+    
+    /* the slot must not point into this stack frame once we return */
+    if (!waiter.done && txq->entries[cmd_idx].waiter == &waiter)
+        txq->entries[cmd_idx].waiter = NULL;
     IOLockUnlock(trans_pcie->wait_command_queue);
     
-    if (ret != THREAD_AWAKENED) {
+    if (!waiter.done) {
         IWL_ERR(trans, "Error sending %s: time out after %dms.\n", iwl_get_cmd_string(trans, cmd->id),
                 HOST_COMPLETE_TIMEOUT);
 
         IWL_ERR(trans, "Current CMD queue read_ptr %d write_ptr %d\n", txq->read_ptr, txq->write_ptr);
 
-        clear_bit(STATUS_SYNC_HCMD_ACTIVE, &trans->status);
-        IWL_DEBUG_INFO(trans, "Clearing HCMD_ACTIVE for command %s\n", iwl_get_cmd_string(trans, cmd->id));
         ret = -ETIMEDOUT;
 
         iwl_force_nmi(trans);
-        // TODO: Implement
-        // iwl_trans_fw_error(trans);
+        iwl_trans_fw_error(trans);
 
         goto cancel;
     }
@@ -1702,208 +2421,427 @@ int iwl_trans_pcie_send_hcmd(struct iwl_trans *trans, struct iwl_host_cmd *cmd)
     return iwl_pcie_send_hcmd_sync(trans, cmd);
 }
 
+/*
+ * iwl_trans_pcie_send_hcmd_batch - sync host commands in consecutive slots
+ *
+ * The commands are enqueued in one hcmd_lock section and the write pointer
+ * is updated once for all of them. The firmware answers in order, so the
+ * sender sleeps on the last command's waiter only and finds the others
+ * done when it wakes.
+ */
+int iwl_trans_pcie_send_hcmd_batch(struct iwl_trans *trans, struct iwl_host_cmd *cmds,
+                                   int n, int *status)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_txq *txq = trans_pcie->txq[trans_pcie->cmd_queue];
+    struct iwl_pcie_hcmd_waiter waiters[IWL_HCMD_BATCH_MAX];
+    int cmd_idx[IWL_HCMD_BATCH_MAX];
+    IOInterruptState flags;
+    AbsoluteTime deadline;
+    bool timed_out = false;
+    int i, sent = 0, ret = 0, wait;
+    
+    IOLockLock(trans_pcie->hcmd_lock);
+    for (i = 0; i < n; i++) {
+        waiters[i].done = false;
+        cmd_idx[i] = -1;
+        
+        if (!(cmds[i].flags & CMD_SEND_IN_RFKILL) && test_bit(STATUS_RFKILL_OPMODE, &trans->status)) {
+            status[i] = -ERFKILL;
+            continue;
+        }
+        
+        cmd_idx[i] = iwl_pcie_enqueue_hcmd_locked(trans, &cmds[i], &waiters[i], false);
+        if (cmd_idx[i] < 0) {
+            status[i] = cmd_idx[i];
+            IWL_ERR(trans, "Error sending %s: enqueue_hcmd failed: %d\n",
+                    iwl_get_cmd_string(trans, cmds[i].id), status[i]);
+            continue;
+        }
+        sent++;
+    }
+    
+    /* one doorbell for the whole batch */
+    if (sent) {
+        flags = IOSimpleLockLockDisableInterrupt(trans_pcie->reg_lock);
+        iwl_pcie_txq_inc_wr_ptr(trans, txq);
+        IOSimpleLockUnlockEnableInterrupt(trans_pcie->reg_lock, flags);
+    }
+    IOLockUnlock(trans_pcie->hcmd_lock);
+    
+    clock_interval_to_deadline(HOST_COMPLETE_TIMEOUT * 2, kMillisecondScale, (UInt64 *) &deadline);
+    wait = THREAD_AWAKENED;
+    
+    IOLockLock(trans_pcie->wait_command_queue);
+    for (i = n - 1; i >= 0; i--) {
+        if (cmd_idx[i] < 0)
+            continue;
+        
+        while (!waiters[i].done && wait == THREAD_AWAKENED)
+            wait = IOLockSleepDeadline(trans_pcie->wait_command_queue, &waiters[i], deadline, THREAD_INTERRUPTIBLE);
+        
+        /* the slot must not point into this stack frame once we return */
+        if (!waiters[i].done && txq->entries[cmd_idx[i]].waiter == &waiters[i])
+            txq->entries[cmd_idx[i]].waiter = NULL;
+    }
+    IOLockUnlock(trans_pcie->wait_command_queue);
+    
+    for (i = 0; i < n; i++) {
+        /* not sent, status is already set */
+        if (cmd_idx[i] < 0) {
+            if (!ret)
+                ret = status[i];
+            continue;
+        }
+        
+        if (!waiters[i].done) {
+            status[i] = -ETIMEDOUT;
+            timed_out = true;
+            /* see iwl_pcie_send_hcmd_sync, a late response must not land in cmds[i] */
+            if (cmds[i].flags & CMD_WANT_SKB)
+                txq->entries[cmd_idx[i]].meta.flags &= ~CMD_WANT_SKB;
+        } else if (test_bit(STATUS_FW_ERROR, &trans->status)) {
+            IWL_ERR(trans, "FW error in SYNC CMD %s\n", iwl_get_cmd_string(trans, cmds[i].id));
+            status[i] = -EIO;
+        } else if (!(cmds[i].flags & CMD_SEND_IN_RFKILL) &&
+                   test_bit(STATUS_RFKILL_OPMODE, &trans->status)) {
+            status[i] = -ERFKILL;
+        } else if ((cmds[i].flags & CMD_WANT_SKB) && !cmds[i].resp_pkt) {
+            IWL_ERR(trans, "Error: Response NULL in '%s'\n", iwl_get_cmd_string(trans, cmds[i].id));
+            status[i] = -EIO;
+        } else {
+            status[i] = 0;
+        }
+        
+        if (status[i] && cmds[i].resp_pkt)
+            iwl_free_resp(&cmds[i]);
+        if (status[i] && !ret)
+            ret = status[i];
+    }
+    
+    if (timed_out) {
+        IWL_ERR(trans, "Error sending a batch of %d commands: time out after %dms.\n", n,
+                HOST_COMPLETE_TIMEOUT);
+        IWL_ERR(trans, "Current CMD queue read_ptr %d write_ptr %d\n", txq->read_ptr, txq->write_ptr);
+        iwl_force_nmi(trans);
+    }
+    
+    return ret;
+}
+
 
 
-// line 2256
-int iwl_trans_pcie_tx(struct iwl_trans *trans, struct sk_buff *skb,
-                      struct iwl_device_cmd *dev_cmd, int txq_id)
+/*
+ * Copy a chain the cursor can't map into one fresh packet, the
+ * __skb_linearize() of this port.
+ */
+static mbuf_t iwl_pcie_tx_linearize(mbuf_t skb)
 {
-    // TODO: Implement...
+    size_t len = mbuf_pkthdr_len(skb);
+    unsigned int maxchunks = 1;
+    mbuf_t lin;
     
-    return 0;
+    if (mbuf_allocpacket(MBUF_DONTWAIT, len, &maxchunks, &lin))
+        return NULL;
     
-//    mbuf_t mb;
-//    
-//    
-//    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
-////    struct ieee80211_hdr *hdr;
-//    struct iwl_tx_cmd *tx_cmd = (struct iwl_tx_cmd *)dev_cmd->payload;
-//    struct iwl_cmd_meta *out_meta;
-//    struct iwl_txq *txq;
-//    dma_addr_t tb0_phys, tb1_phys, scratch_phys;
-//    void *tb1_addr;
-//    void *tfd;
-//    u16 len, tb1_len;
-//    bool wait_write_ptr;
-//    __le16 fc;
-//    u8 hdr_len;
-//    u16 wifi_seq;
-//    bool amsdu;
-//    
-//    txq = trans_pcie->txq[txq_id];
-//
-//    if (!test_bit(txq_id, trans_pcie->queue_used))
-//        return -EINVAL;
+    mbuf_setlen(lin, len);
+    mbuf_pkthdr_setlen(lin, len);
+    
+    if (mbuf_copydata(skb, 0, len, mbuf_data(lin))) {
+        mbuf_freem(lin);
+        return NULL;
+    }
+    
+    return lin;
+}
 
-//    if (unlikely(trans_pcie->sw_csum_tx && skb->ip_summed == CHECKSUM_PARTIAL)) {
-//        int offs = skb_checksum_start_offset(skb);
-//        int csum_offs = offs + skb->csum_offset;
-//        __wsum csum;
-//
-//        if (skb_ensure_writable(skb, csum_offs + sizeof(__sum16)))
-//            return -1;
-//
-//        csum = skb_checksum(skb, offs, skb->len - offs, 0);
-//        *(__sum16 *)(skb->data + csum_offs) = csum_fold(csum);
-//
-//        skb->ip_summed = CHECKSUM_UNNECESSARY;
-//    }
+/* line 1987
+ * Map everything past the 802.11 header, which the op mode has already copied
+ * into the TX command. The mbuf chain goes into the TFD segment by segment; the
+ * cursor coalesces it when the chain has more segments than the TFD can take.
+ * If it can't (no cluster to coalesce into), the frame is linearised into a
+ * new packet that replaces the original in the queue entry once it is mapped;
+ * the original is freed then, and stays with the caller on error.
+ */
+int IntelWifi::iwl_fill_data_tbs(struct iwl_trans *trans, mbuf_t skb, struct iwl_txq *txq, u8 hdr_len,
+                                 struct iwl_cmd_meta *out_meta)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    IOPhysicalSegment segs[IWL_TFH_NUM_TBS];
+    UInt32 num_segs, i;
+    UInt32 skip = hdr_len;
+    mbuf_t lin = NULL;
+    int tb_idx;
+    
+    num_segs = fTxMbufCursor->getPhysicalSegmentsWithCoalesce(skb, segs, IWL_PCIE_MAX_DATA_SEGS(trans_pcie));
+    if (unlikely(!num_segs)) {
+        lin = iwl_pcie_tx_linearize(skb);
+        if (!lin)
+            return -ENOMEM;
+        
+        num_segs = fTxMbufCursor->getPhysicalSegments(lin, segs, IWL_PCIE_MAX_DATA_SEGS(trans_pcie));
+        if (!num_segs) {
+            mbuf_freem(lin);
+            return -EINVAL;
+        }
+    }
+    
+    for (i = 0; i < num_segs; i++) {
+        dma_addr_t tb_phys = segs[i].location;
+        u16 tb_len = segs[i].length;
+        
+        /* the header already went out with TB1 */
+        if (skip >= tb_len) {
+            skip -= tb_len;
+            continue;
+        }
+        tb_phys += skip;
+        tb_len -= skip;
+        skip = 0;
+        
+        tb_idx = iwl_pcie_txq_build_tfd(trans, txq, tb_phys, tb_len, false);
+        if (tb_idx < 0) {
+            if (lin)
+                mbuf_freem(lin);
+            return -EINVAL;
+        }
+        
+        out_meta->tbs |= BIT(tb_idx);
+    }
+    
+    if (lin) {
+        txq->entries[txq->write_ptr].skb = lin;
+        mbuf_freem(skb);
+        txq->stats.linearized++;
+    }
+    
+    return 0;
+}
 
-//    if (skb_is_nonlinear(skb) &&
-//        skb_shinfo(skb)->nr_frags > IWL_PCIE_MAX_FRAGS(trans_pcie) &&
-//        __skb_linearize(skb))
-//        return -ENOMEM;
-//
-    /* mac80211 always puts the full header into the SKB's head,
-     * so there's no need to check if it's readable there
+/* line 2256
+ * iwl_trans_pcie_tx - put a frame on a TX queue
+ * @more: more frames for this queue follow right away (xmit_more), leave
+ *    the write pointer to the last one
+ *
+ * Returns 0 once the frame is on the ring or parked in the overflow ring,
+ * -ENOSPC when the overflow ring is full too, so the caller
+ * keeps the frame until the queue is woken, or a negative error.
+ */
+int IntelWifi::iwl_trans_pcie_tx(struct iwl_trans *trans, mbuf_t skb,
+                                 struct iwl_device_cmd *dev_cmd, int txq_id, bool more)
+{
+    return iwl_pcie_txq_tx(trans, skb, dev_cmd, txq_id, more, false);
+}
+
+/* @resume: the frame comes from the overflow ring, see iwl_pcie_txq_resume */
+int IntelWifi::iwl_pcie_txq_tx(struct iwl_trans *trans, mbuf_t skb,
+                               struct iwl_device_cmd *dev_cmd, int txq_id, bool more, bool resume)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct ieee80211_hdr *hdr;
+    struct iwl_tx_cmd *tx_cmd = (struct iwl_tx_cmd *)dev_cmd->payload;
+    struct iwl_cmd_meta *out_meta;
+    struct iwl_txq *txq;
+    dma_addr_t tb0_phys, tb1_phys, scratch_phys;
+    u8 *tb1_addr;
+    void *tfd;
+    u16 len, tb1_len;
+    size_t data_len;
+    bool wait_write_ptr;
+    __le16 fc;
+    u8 hdr_len;
+    int ret;
+    u16 wifi_seq;
+    
+    txq = trans_pcie->txq[txq_id];
+    
+    if (!test_bit(txq_id, trans_pcie->queue_used))
+        return -EINVAL;
+    
+    /* the stack computes the checksums, so sw_csum_tx has nothing to do here */
+    
+    /* the op mode puts the full 802.11 header into the first mbuf */
+    if (unlikely(mbuf_len(skb) < sizeof(hdr->frame_control)))
+        return -EINVAL;
+    
+    hdr = (struct ieee80211_hdr *)mbuf_data(skb);
+    fc = hdr->frame_control;
+    hdr_len = ieee80211_hdrlen(fc);
+    
+    if (unlikely(mbuf_len(skb) < hdr_len))
+        return -EINVAL;
+    
+    IOSimpleLockLock(txq->lock);
+    
+    /* lost a race with txq_disable, the ring is gone */
+    if (unlikely(!txq->entries)) {
+        IOSimpleLockUnlock(txq->lock);
+        return -EINVAL;
+    }
+    
+    if (iwl_queue_space(txq) < txq->high_mark)
+        iwl_stop_queue(trans, txq);
+    
+    /*
+     * Don't put the packet on the ring if there is no room, nor ahead of
+     * the overflow frames a resume is moving there.
+     */
+    if (unlikely(iwl_queue_space(txq) < 3 || (txq->overflow_tx && !resume))) {
+        int idx;
+        
+        /* the op mode ignored the stop for too long, it has to hold on */
+        if (txq->overflow_len == IWL_TXQ_OVERFLOW_MAX) {
+            IOSimpleLockUnlock(txq->lock);
+            return -ENOSPC;
+        }
+        
+        idx = (txq->overflow_head + txq->overflow_len) % IWL_TXQ_OVERFLOW_MAX;
+        txq->overflow_q[idx].skb = skb;
+        txq->overflow_q[idx].dev_cmd = dev_cmd;
+        txq->overflow_len++;
+        txq->stats.overflowed++;
+        
+        /* a batch in flight won't ring for what is already on the ring */
+        iwl_pcie_txq_inc_wr_ptr(trans, txq);
+        IOSimpleLockUnlock(txq->lock);
+        return 0;
+    }
+    
+    /* In AGG mode, the index in the ring must correspond to the WiFi
+     * sequence number. This is a HW requirements to help the SCD to parse
+     * the BA.
+     * Check here that the packets are in the right place on the ring.
      */
+    wifi_seq = IEEE80211_SEQ_TO_SN(le16_to_cpu(hdr->seq_ctrl));
+    if (txq->ampdu && (wifi_seq & 0xff) != txq->write_ptr)
+        IWL_WARN(trans, "Q: %d WiFi Seq %d tfdNum %d", txq_id, wifi_seq, txq->write_ptr);
     
-//    hdr = (struct ieee80211_hdr *)skb->data;
-//    fc = hdr->frame_control;
-//    hdr_len = ieee80211_hdrlen(fc);
-//
-//    spin_lock(&txq->lock);
-//
-//    if (iwl_queue_space(txq) < txq->high_mark) {
-//        iwl_stop_queue(trans, txq);
-//
-//        /* don't put the packet on the ring, if there is no room */
-//        if (unlikely(iwl_queue_space(txq) < 3)) {
-//            struct iwl_device_cmd **dev_cmd_ptr;
-//
-//            dev_cmd_ptr = (void *)((u8 *)skb->cb +
-//                                   trans_pcie->dev_cmd_offs);
-//
-//            *dev_cmd_ptr = dev_cmd;
-//            __skb_queue_tail(&txq->overflow_q, skb);
-//
-//            spin_unlock(&txq->lock);
-//            return 0;
-//        }
-//    }
+    /* Set up driver data for this TFD */
+    txq->entries[txq->write_ptr].skb = skb;
+    txq->entries[txq->write_ptr].cmd = dev_cmd;
+    txq->entries[txq->write_ptr].tx_ns = iwl_pcie_perf_ns();
+    
+    dev_cmd->hdr.sequence = cpu_to_le16((u16)(QUEUE_TO_SEQ(txq_id) | INDEX_TO_SEQ(txq->write_ptr)));
+    
+    tb0_phys = iwl_pcie_get_first_tb_dma(txq, txq->write_ptr);
+    scratch_phys = tb0_phys + sizeof(struct iwl_cmd_header) + offsetof(struct iwl_tx_cmd, scratch);
+    
+    tx_cmd->dram_lsb_ptr = cpu_to_le32(scratch_phys);
+    tx_cmd->dram_msb_ptr = iwl_get_dma_hi_addr(scratch_phys);
+    
+    /* Set up first empty entry in queue's array of Tx/cmd buffers */
+    out_meta = &txq->entries[txq->write_ptr].meta;
+    out_meta->flags = 0;
+    out_meta->tbs = 0;
+    
+    /*
+     * The second TB (tb1) points to the remainder of the TX command
+     * and the 802.11 header - dword aligned size
+     * (This calculation modifies the TX command, so do it before the
+     * setup of the first TB)
+     */
+    len = sizeof(struct iwl_tx_cmd) + sizeof(struct iwl_cmd_header) + hdr_len - IWL_FIRST_TB_SIZE;
+    tb1_len = ALIGN(len, 4);
+    /* Tell NIC about any 2-byte padding after MAC header */
+    if (tb1_len != len)
+        tx_cmd->tx_flags |= cpu_to_le32(TX_CMD_FLG_MH_PAD);
+    
+    /*
+     * The first TB points to bi-directional DMA data, we'll
+     * memcpy the data into it later.
+     */
+    iwl_pcie_txq_build_tfd(trans, txq, tb0_phys, IWL_FIRST_TB_SIZE, true);
+    
+    /* there must be data left over for TB1 or this code must be changed */
+    BUILD_BUG_ON(sizeof(struct iwl_tx_cmd) < IWL_FIRST_TB_SIZE);
+    
+    /* TB1 must fit into the bounce slot even with the longest header */
+    BUILD_BUG_ON(sizeof(struct iwl_tx_cmd) + sizeof(struct iwl_cmd_header) + 36 + 3 -
+                 IWL_FIRST_TB_SIZE > IWL_TX_BOUNCE_TB1_SIZE);
+    
+    /*
+     * dev_cmd isn't DMA-able memory, so TB1 is a copy of its tail in the
+     * pre-mapped bounce slot. A small payload is copied right behind it and
+     * goes out in the same TB, which is cheaper than mapping the mbuf.
+     */
+    tb1_addr = txq->bounce_bufs[txq->write_ptr].buf;
+    tb1_phys = iwl_pcie_get_bounce_dma(txq, txq->write_ptr);
+    memcpy(tb1_addr, ((u8 *)&dev_cmd->hdr) + IWL_FIRST_TB_SIZE, tb1_len);
+    
+    data_len = mbuf_pkthdr_len(skb) - hdr_len;
+    txq->stats.frames++;
+    
+    if (data_len <= trans_pcie->tx_copybreak) {
+        if (data_len)
+            mbuf_copydata(skb, hdr_len, data_len, tb1_addr + tb1_len);
+        iwl_pcie_txq_build_tfd(trans, txq, tb1_phys, tb1_len + data_len, false);
+        txq->stats.bounced++;
+    } else {
+        iwl_pcie_txq_build_tfd(trans, txq, tb1_phys, tb1_len, false);
+        
+        ret = iwl_fill_data_tbs(trans, skb, txq, hdr_len, out_meta);
+        if (unlikely(ret))
+            goto out_err;
+    }
+    
+    memcpy(&txq->first_tb_bufs[txq->write_ptr], &dev_cmd->hdr, IWL_FIRST_TB_SIZE);
+    
+    tfd = iwl_pcie_get_tfd(trans_pcie, txq, txq->write_ptr);
+    /* Set up entry for this TFD in Tx byte-count array */
+    iwl_pcie_txq_update_byte_cnt_tbl(trans, txq, le16_to_cpu(tx_cmd->len),
+                                     iwl_pcie_tfd_get_num_tbs(trans, tfd));
+    
+    wait_write_ptr = more || ieee80211_has_morefrags(fc);
+    
+    /* start timer if queue currently empty */
+    if (txq->read_ptr == txq->write_ptr) {
+        if (txq->wd_timeout)
+            iwl_pcie_txq_wd_mod(txq, txq->wd_timeout);
+        IWL_DEBUG_RPM(trans, "Q: %d first tx - take ref\n", txq->id);
+        iwl_trans_ref(trans);
+    }
+    
+    /* Tell device the write index *just past* this latest filled TFD */
+    txq->write_ptr = iwl_queue_inc_wrap(txq->write_ptr);
+    if (!wait_write_ptr)
+        iwl_pcie_txq_inc_wr_ptr(trans, txq);
+    
+    /*
+     * At this point the frame is "transmitted" successfully
+     * and we will get a TX status notification eventually.
+     */
+    IOSimpleLockUnlock(txq->lock);
+    return 0;
+out_err:
+    /* the mbuf and the TX command stay with the caller */
+    iwl_pcie_tfd_unmap(trans, out_meta, txq, txq->write_ptr);
+    txq->entries[txq->write_ptr].skb = NULL;
+    txq->entries[txq->write_ptr].cmd = NULL;
+    IOSimpleLockUnlock(txq->lock);
+    return ret;
+}
 
-//    /* In AGG mode, the index in the ring must correspond to the WiFi
-//     * sequence number. This is a HW requirements to help the SCD to parse
-//     * the BA.
-//     * Check here that the packets are in the right place on the ring.
-//     */
-//    wifi_seq = IEEE80211_SEQ_TO_SN(le16_to_cpu(hdr->seq_ctrl));
-//    WARN_ONCE(txq->ampdu &&
-//              (wifi_seq & 0xff) != txq->write_ptr,
-//              "Q: %d WiFi Seq %d tfdNum %d",
-//              txq_id, wifi_seq, txq->write_ptr);
-//
-//    /* Set up driver data for this TFD */
-//    txq->entries[txq->write_ptr].skb = skb;
-//    txq->entries[txq->write_ptr].cmd = dev_cmd;
-//
-//    dev_cmd->hdr.sequence =
-//    cpu_to_le16((u16)(QUEUE_TO_SEQ(txq_id) |
-//                      INDEX_TO_SEQ(txq->write_ptr)));
-//
-//    tb0_phys = iwl_pcie_get_first_tb_dma(txq, txq->write_ptr);
-//    scratch_phys = tb0_phys + sizeof(struct iwl_cmd_header) +
-//    offsetof(struct iwl_tx_cmd, scratch);
-//
-//    tx_cmd->dram_lsb_ptr = cpu_to_le32(scratch_phys);
-//    tx_cmd->dram_msb_ptr = iwl_get_dma_hi_addr(scratch_phys);
-//
-//    /* Set up first empty entry in queue's array of Tx/cmd buffers */
-//    out_meta = &txq->entries[txq->write_ptr].meta;
-//    out_meta->flags = 0;
-//
-//    /*
-//     * The second TB (tb1) points to the remainder of the TX command
-//     * and the 802.11 header - dword aligned size
-//     * (This calculation modifies the TX command, so do it before the
-//     * setup of the first TB)
-//     */
-//    len = sizeof(struct iwl_tx_cmd) + sizeof(struct iwl_cmd_header) +
-//    hdr_len - IWL_FIRST_TB_SIZE;
-//    /* do not align A-MSDU to dword as the subframe header aligns it */
-//    amsdu = ieee80211_is_data_qos(fc) &&
-//    (*ieee80211_get_qos_ctl(hdr) &
-//     IEEE80211_QOS_CTL_A_MSDU_PRESENT);
-//    if (trans_pcie->sw_csum_tx || !amsdu) {
-//        tb1_len = ALIGN(len, 4);
-//        /* Tell NIC about any 2-byte padding after MAC header */
-//        if (tb1_len != len)
-//            tx_cmd->tx_flags |= cpu_to_le32(TX_CMD_FLG_MH_PAD);
-//    } else {
-//        tb1_len = len;
-//    }
-//
-//    /*
-//     * The first TB points to bi-directional DMA data, we'll
-//     * memcpy the data into it later.
-//     */
-//    iwl_pcie_txq_build_tfd(trans, txq, tb0_phys,
-//                           IWL_FIRST_TB_SIZE, true);
-//
-//    /* there must be data left over for TB1 or this code must be changed */
-//    BUILD_BUG_ON(sizeof(struct iwl_tx_cmd) < IWL_FIRST_TB_SIZE);
-//
-//    /* map the data for TB1 */
-//    tb1_addr = ((u8 *)&dev_cmd->hdr) + IWL_FIRST_TB_SIZE;
-//    tb1_phys = dma_map_single(trans->dev, tb1_addr, tb1_len, DMA_TO_DEVICE);
-//    if (unlikely(dma_mapping_error(trans->dev, tb1_phys)))
-//        goto out_err;
-//    iwl_pcie_txq_build_tfd(trans, txq, tb1_phys, tb1_len, false);
-//
-//    if (amsdu) {
-//        if (unlikely(iwl_fill_data_tbs_amsdu(trans, skb, txq, hdr_len,
-//                                             out_meta, dev_cmd,
-//                                             tb1_len)))
-//            goto out_err;
-//    } else if (unlikely(iwl_fill_data_tbs(trans, skb, txq, hdr_len,
-//                                          out_meta, dev_cmd, tb1_len))) {
-//        goto out_err;
-//    }
-//
-//    /* building the A-MSDU might have changed this data, so memcpy it now */
-//    memcpy(&txq->first_tb_bufs[txq->write_ptr], &dev_cmd->hdr,
-//           IWL_FIRST_TB_SIZE);
-//
-//    tfd = iwl_pcie_get_tfd(trans_pcie, txq, txq->write_ptr);
-//    /* Set up entry for this TFD in Tx byte-count array */
-//    iwl_pcie_txq_update_byte_cnt_tbl(trans, txq, le16_to_cpu(tx_cmd->len),
-//                                     iwl_pcie_tfd_get_num_tbs(trans, tfd));
-//
-//    wait_write_ptr = ieee80211_has_morefrags(fc);
-//
-//    /* start timer if queue currently empty */
-//    if (txq->read_ptr == txq->write_ptr) {
-//        if (txq->wd_timeout) {
-//            /*
-//             * If the TXQ is active, then set the timer, if not,
-//             * set the timer in remainder so that the timer will
-//             * be armed with the right value when the station will
-//             * wake up.
-//             */
-//            if (!txq->frozen)
-//                mod_timer(&txq->stuck_timer,
-//                          jiffies + txq->wd_timeout);
-//            else
-//                txq->frozen_expiry_remainder = txq->wd_timeout;
-//        }
-//        IWL_DEBUG_RPM(trans, "Q: %d first tx - take ref\n", txq->id);
-//        iwl_trans_ref(trans);
-//    }
-//
-//    /* Tell device the write index *just past* this latest filled TFD */
-//    txq->write_ptr = iwl_queue_inc_wrap(txq->write_ptr);
-//    if (!wait_write_ptr)
-//        iwl_pcie_txq_inc_wr_ptr(trans, txq);
-//
-//    /*
-//     * At this point the frame is "transmitted" successfully
-//     * and we will get a TX status notification eventually.
-//     */
-//    spin_unlock(&txq->lock);
-//    return 0;
-//out_err:
-//    spin_unlock(&txq->lock);
-//    return -1;
+/*
+ * iwl_trans_pcie_tx_push - publish the write pointer that frames sent with
+ * the "more frames coming" hint left behind
+ *
+ * The op mode pushes every queue of a burst once the burst is over, so the
+ * write pointer, and the MAC sleep check in front of it, is written once
+ * per queue and burst.
+ */
+void IntelWifi::iwl_trans_pcie_tx_push(struct iwl_trans *trans, int txq_id)
+{
+    struct iwl_trans_pcie *trans_pcie = IWL_TRANS_GET_PCIE_TRANS(trans);
+    struct iwl_txq *txq = trans_pcie->txq[txq_id];
+    
+    if (!test_bit(txq_id, trans_pcie->queue_used))
+        return;
+    
+    IOSimpleLockLock(txq->lock);
+    /* lost a race with txq_disable, the ring is gone */
+    if (txq->entries)
+        iwl_pcie_txq_inc_wr_ptr(trans, txq);
+    IOSimpleLockUnlock(txq->lock);
 }
 
 
@@ -14,6 +14,7 @@
 IwlDvmOpMode::IwlDvmOpMode(IwlTransOps *ops) {
     _ops = ops;
     mutex = IOLockAlloc();
+    restart_pending = 0;
 }
 
 
@@ -37,11 +38,34 @@ void IwlDvmOpMode::nic_config(struct iwl_priv *priv) {
 }
 
 void IwlDvmOpMode::stop(struct iwl_priv *priv) {
+    /* no restart is queued from now on, let a running one finish */
+    set_bit(STATUS_EXIT_PENDING, &this->priv->status);
+    while (restart_pending)
+        IOSleep(10);
+    
     iwl_op_mode_dvm_stop(priv);
 }
 
 void IwlDvmOpMode::rx(struct iwl_priv *priv, struct napi_struct *napi, struct iwl_rx_cmd_buffer *rxb) {
+    struct iwl_rx_packet *pkt = (struct iwl_rx_packet *)rxb_addr(rxb);
+    
+    /* TX status reclaims through the transport ops, so it is not in rx_handlers */
+    switch (pkt->hdr.cmd) {
+        case REPLY_TX:
+            this->priv->rx_handlers_stats[pkt->hdr.cmd]++;
+            iwlagn_rx_reply_tx(this->priv, rxb);
+            return;
+        case REPLY_COMPRESSED_BA:
+            this->priv->rx_handlers_stats[pkt->hdr.cmd]++;
+            iwlagn_rx_reply_compressed_ba(this->priv, rxb);
+            return;
+    }
+    
     iwl_rx_dispatch(this->priv, napi, rxb);
+    
+    /* a block ack action frame moves the aggregation state machine on */
+    if (this->priv->ba_action.pending)
+        iwlagn_process_ba_action(this->priv);
 }
 
 void IwlDvmOpMode::scan() {
@@ -58,6 +82,35 @@ void IwlDvmOpMode::scan() {
     }
 }
 
+int IwlDvmOpMode::tx(struct iwl_priv *priv, mbuf_t m, u8 ac, bool more) {
+    return iwlagn_mac_tx(this->priv, m, ac, more);
+}
+
+u32 IwlDvmOpMode::tx_drops(struct iwl_priv *priv) {
+    u32 drops = this->priv->tx_drops;
+    
+    this->priv->tx_drops = 0;
+    return drops;
+}
+
+void IwlDvmOpMode::queue_full(struct iwl_priv *priv, int queue) {
+    iwl_stop_sw_queue(this->priv, queue);
+}
+
+void IwlDvmOpMode::queue_not_full(struct iwl_priv *priv, int queue) {
+    u8 mq = this->priv->queue_to_mac80211[queue];
+    
+    iwl_wake_sw_queue(this->priv, queue);
+    
+    /* the station queues of that AC may have a backlog waiting */
+    if (mq < IEEE80211_NUM_ACS)
+        iwl_sta_txq_schedule(this->priv, mq);
+}
+
+void IwlDvmOpMode::nic_error(struct iwl_priv *priv) {
+    iwlagn_fw_error(this->priv, false);
+}
+
 void IwlDvmOpMode::add_interface(struct ieee80211_vif *vif) {
     //DebugLog("ADD INTERFACE");
 //    IOLockLock(mutex);
@@ -50,6 +50,11 @@ public:
                     struct iwl_rx_cmd_buffer *rxb) override;
     
     virtual void scan() override;
+    virtual int tx(struct iwl_priv *priv, mbuf_t m, u8 ac, bool more) override;
+    virtual u32 tx_drops(struct iwl_priv *priv) override;
+    virtual void queue_full(struct iwl_priv *priv, int queue) override;
+    virtual void queue_not_full(struct iwl_priv *priv, int queue) override;
+    virtual void nic_error(struct iwl_priv *priv) override;
     
     virtual void add_interface(struct ieee80211_vif *vif) override;
     virtual void channel_switch(struct iwl_priv *priv, struct ieee80211_vif *vif, struct ieee80211_channel_switch *chsw) override;
@@ -61,6 +66,17 @@ private:
                                            const struct iwl_cfg *cfg,
                                            const struct iwl_fw *fw); // line 1232
     void iwl_op_mode_dvm_stop(struct iwl_priv* priv); // line 1524
+    void iwl_stop_sw_queue(struct iwl_priv *priv, int queue); // line 2041
+    void iwl_wake_sw_queue(struct iwl_priv *priv, int queue); // line 2059
+    void iwlagn_fw_error(struct iwl_priv *priv, bool ondemand);
+    void iwl_bg_restart(struct iwl_priv *priv);
+    static void restartThread(void *arg, wait_result_t wr);
+    
+    // lib.c
+    void iwlagn_prepare_restart(struct iwl_priv *priv);
+    
+    // rs.c
+    u32 iwl_rs_expected_airtime(struct iwl_priv *priv, u8 sta_id, u8 tid, u32 len);
     
     // mac80211.c
     int __iwl_up(struct iwl_priv *priv); // line 238
@@ -71,6 +87,34 @@ private:
 
     int iwl_setup_interface(struct iwl_priv *priv, struct iwl_rxon_context *ctx); // line 1251
     int iwlagn_mac_add_interface(struct iwl_priv *priv, struct ieee80211_vif *vif); // line 1297
+    int iwlagn_mac_tx(struct iwl_priv *priv, mbuf_t skb, u8 ac, bool more);
+    
+    // airtime fair TX scheduler
+    mbuf_t iwl_sta_txq_dequeue(struct iwl_priv *priv, struct iwl_sta_txq *txq);
+    void iwl_sta_txq_schedule(struct iwl_priv *priv, u8 ac);
+    void iwl_sta_txq_push(struct iwl_priv *priv);
+    void iwl_sta_txq_wake(struct iwl_priv *priv, u8 sta_id, u8 tid);
+    void iwl_sta_txq_free(struct iwl_priv *priv);
+    
+    // tx.c
+    int iwlagn_tx_skb(struct iwl_priv *priv, mbuf_t skb, u8 sta_id, u8 tid, bool more);
+    void iwlagn_rx_reply_tx(struct iwl_priv *priv, struct iwl_rx_cmd_buffer *rxb);
+    void iwlagn_rx_reply_compressed_ba(struct iwl_priv *priv, struct iwl_rx_cmd_buffer *rxb);
+    int iwlagn_alloc_agg_txq(struct iwl_priv *priv, int mq);
+    void iwlagn_dealloc_agg_txq(struct iwl_priv *priv, int q);
+    int iwlagn_tx_agg_start(struct iwl_priv *priv, u8 sta_id, u16 tid, u16 *ssn);
+    int iwlagn_tx_agg_oper(struct iwl_priv *priv, u8 sta_id, u16 tid, u8 buf_size);
+    int iwlagn_tx_agg_stop(struct iwl_priv *priv, u8 sta_id, u16 tid, bool send_delba);
+    int iwlagn_tx_agg_flush(struct iwl_priv *priv, u8 sta_id, u16 tid);
+    enum iwl_agg_state iwlagn_check_ratid_empty(struct iwl_priv *priv, int sta_id, u8 tid);
+    void iwlagn_agg_emptied(struct iwl_priv *priv, u8 sta_id, u8 tid, enum iwl_agg_state emptied);
+    void iwlagn_agg_tids_put(struct iwl_priv *priv, u8 sta_id);
+    
+    // mac80211 agg-tx.c, the block ack session handshake
+    int iwlagn_send_ba_action(struct iwl_priv *priv, u8 sta_id, u8 tid, u8 action_code);
+    void iwlagn_tx_ba_start_cb(struct iwl_priv *priv, u8 sta_id, u8 tid);
+    void iwlagn_tx_ba_stop_cb(struct iwl_priv *priv, u8 sta_id, u8 tid, bool send_delba);
+    void iwlagn_process_ba_action(struct iwl_priv *priv);
     
     // ucode.c
     int iwl_load_ucode_wait_alive(struct iwl_priv *priv,
@@ -88,6 +132,9 @@ private:
     struct iwl_priv *priv;
     
     IOLock *mutex;
+    
+    /* a restart thread is queued or running */
+    volatile UInt32 restart_pending;
 };
 
 
@@ -105,6 +105,44 @@ int iwlagn_hwrate_to_mac80211_idx(u32 rate_n_flags, enum nl80211_band band)
     return -1;
 }
 
+/* line 136
+ * @flags: CMD_ASYNC from the RX path, which can't wait for the response
+ */
+int iwlagn_txfifo_flush(struct iwl_priv *priv, u32 scd_q_msk, u32 flags)
+{
+    struct iwl_txfifo_flush_cmd_v3 flush_cmd_v3 = {
+        .flush_control = cpu_to_le16(IWL_DROP_ALL),
+    };
+    struct iwl_txfifo_flush_cmd_v2 flush_cmd_v2 = {
+        .flush_control = cpu_to_le16(IWL_DROP_ALL),
+    };
+    
+    u32 queue_control = IWL_SCD_VO_MSK | IWL_SCD_VI_MSK |
+                        IWL_SCD_BE_MSK | IWL_SCD_BK_MSK | IWL_SCD_MGMT_MSK;
+    
+    if ((priv->valid_contexts != BIT(IWL_RXON_CTX_BSS)))
+        queue_control |= IWL_PAN_SCD_VO_MSK | IWL_PAN_SCD_VI_MSK |
+                         IWL_PAN_SCD_BE_MSK | IWL_PAN_SCD_BK_MSK |
+                         IWL_PAN_SCD_MGMT_MSK |
+                         IWL_PAN_SCD_MULTICAST_MSK;
+    
+    if (priv->nvm_data->sku_cap_11n_enable)
+        queue_control |= IWL_AGG_TX_QUEUE_MSK;
+    
+    if (scd_q_msk)
+        queue_control = scd_q_msk;
+    
+    IWL_DEBUG_INFO(priv, "queue control: 0x%x\n", queue_control);
+    flush_cmd_v3.queue_control = cpu_to_le32(queue_control);
+    flush_cmd_v2.queue_control = cpu_to_le16((u16)queue_control);
+    
+    if (IWL_UCODE_API(priv->fw->ucode_ver) > 2)
+        return iwl_dvm_send_cmd_pdu(priv, REPLY_TXFIFO_FLUSH, flags,
+                                    sizeof(flush_cmd_v3), &flush_cmd_v3);
+    return iwl_dvm_send_cmd_pdu(priv, REPLY_TXFIFO_FLUSH, flags,
+                                sizeof(flush_cmd_v2), &flush_cmd_v2);
+}
+
 
 /*
  * BT coex
@@ -409,6 +447,54 @@ u8 iwl_toggle_tx_ant(struct iwl_priv *priv, u8 ant, u8 valid)
     return ant;
 }
 
+/*
+ * iwlagn_prepare_restart - take the driver down before a firmware restart
+ *
+ * iwl_down() does not stop the transport in this port, so the device is
+ * stopped here.
+ */
+void IwlDvmOpMode::iwlagn_prepare_restart(struct iwl_priv *priv)
+{
+    bool bt_full_concurrent;
+    u8 bt_ci_compliance;
+    u8 bt_load;
+    u8 bt_status;
+    bool bt_is_sco;
+    int i;
+    
+    //lockdep_assert_held(&priv->mutex);
+    
+    priv->is_open = 0;
+    
+    /*
+     * __iwl_down() will clear the BT status variables,
+     * which is correct, but when we restart we really
+     * want to keep them as they were before the restart
+     */
+    bt_full_concurrent = priv->bt_full_concurrent;
+    bt_ci_compliance = priv->bt_ci_compliance;
+    bt_load = priv->bt_traffic_load;
+    bt_status = priv->bt_status;
+    bt_is_sco = priv->bt_is_sco;
+    
+    iwl_down(priv);
+    _ops->stop_device(priv->trans, true);
+    
+    priv->bt_full_concurrent = bt_full_concurrent;
+    priv->bt_ci_compliance = bt_ci_compliance;
+    priv->bt_traffic_load = bt_load;
+    priv->bt_status = bt_status;
+    priv->bt_is_sco = bt_is_sco;
+    
+    /* reset aggregation queues */
+    for (i = IWLAGN_FIRST_AMPDU_QUEUE; i < IWL_MAX_HW_QUEUES; i++)
+        priv->queue_to_mac80211[i] = IWL_INVALID_MAC80211_QUEUE;
+    /* and stop counts */
+    for (i = 0; i < IWL_MAX_HW_QUEUES; i++)
+        priv->queue_stop_count[i] = 0;
+    
+    memset(priv->agg_q_alloc, 0, sizeof(priv->agg_q_alloc));
+}
 
 
 // line 1237
@@ -446,6 +532,37 @@ int iwl_dvm_send_cmd(struct iwl_priv *priv, struct iwl_host_cmd *cmd)
     return iwl_trans_send_cmd(priv->trans, cmd);
 }
 
+/*
+ * iwl_dvm_send_cmd_batch - send a chain of synchronous commands with one
+ * round trip, @status gets the result of each of them
+ */
+int iwl_dvm_send_cmd_batch(struct iwl_priv *priv, struct iwl_host_cmd *cmds, int n, int *status)
+{
+    int i;
+    
+    if (iwl_is_rfkill(priv) || iwl_is_ctkill(priv)) {
+        IWL_WARN(priv, "Not sending commands - %s KILL\n", iwl_is_rfkill(priv) ? "RF" : "CT");
+        goto fail;
+    }
+    
+    if (test_bit(STATUS_FW_ERROR, &priv->status)) {
+        IWL_ERR(priv, "Command batch failed: FW Error\n");
+        goto fail;
+    }
+    
+    if (!priv->ucode_loaded) {
+        IWL_ERR(priv, "Fw not loaded - dropping command batch\n");
+        goto fail;
+    }
+    
+    return iwl_trans_send_cmd_batch(priv->trans, cmds, n, status);
+    
+fail:
+    for (i = 0; i < n; i++)
+        status[i] = -EIO;
+    return -EIO;
+}
+
 // line 1271
 int iwl_dvm_send_cmd_pdu(struct iwl_priv *priv, u8 id, u32 flags, u16 len, const void *data)
 {
@@ -42,6 +42,8 @@ extern "C" {
 
 #include "IwlDvmOpMode.hpp"
 
+#include <kern/clock.h>
+
 /*****************************************************************************
  *
  * mac80211 entry point functions
@@ -560,6 +562,1504 @@ out:
     return err;
 }
 
+/*
+ * Airtime fair TX scheduling
+ *
+ * Frames wait in a queue per station and TID. Each AC runs a deficit round
+ * robin over its backlogged queues and charges every frame the airtime it
+ * is expected to take, so a station on a slow rate can't starve the fast
+ * ones. CoDel keeps standing queues short. All of it runs on the controller
+ * work loop, which serialises it with the queue wakes.
+ */
+
+/* the TID an AC's frames are sent on */
+static const u8 iwl_ac_to_tid[IEEE80211_NUM_ACS] = {
+    6, /* IEEE80211_AC_VO */
+    4, /* IEEE80211_AC_VI */
+    0, /* IEEE80211_AC_BE */
+    1, /* IEEE80211_AC_BK */
+};
+
+/* 802.1d user priority to AC */
+static const u8 iwl_tid_to_ac[IWL_MAX_TID_COUNT] = {
+    IEEE80211_AC_BE,
+    IEEE80211_AC_BK,
+    IEEE80211_AC_BK,
+    IEEE80211_AC_BE,
+    IEEE80211_AC_VI,
+    IEEE80211_AC_VI,
+    IEEE80211_AC_VO,
+    IEEE80211_AC_VO,
+};
+
+static u64 iwl_sta_txq_now(void)
+{
+    u64 abstime, ns;
+    
+    clock_get_uptime(&abstime);
+    absolutetime_to_nanoseconds(abstime, &ns);
+    return ns;
+}
+
+static u32 iwl_codel_int_sqrt(u32 x)
+{
+    u32 r = 0, bit = 1u << 30;
+    
+    while (bit > x)
+        bit >>= 2;
+    
+    while (bit) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return r;
+}
+
+/* drops get closer together with the square root of the drop count */
+static u64 iwl_codel_control_law(u64 t, u32 count)
+{
+    return t + IWL_CODEL_INTERVAL / iwl_codel_int_sqrt(count);
+}
+
+static mbuf_t iwl_sta_txq_pop(struct iwl_sta_txq *txq, u64 *time)
+{
+    mbuf_t skb;
+    
+    if (!txq->len)
+        return NULL;
+    
+    skb = txq->frames[txq->head].skb;
+    *time = txq->frames[txq->head].time;
+    txq->frames[txq->head].skb = NULL;
+    txq->head = (txq->head + 1) % IWL_STA_TXQ_LEN;
+    txq->len--;
+    return skb;
+}
+
+/* puts back the frame iwl_sta_txq_pop just took, its queue time is still there */
+static void iwl_sta_txq_unpop(struct iwl_sta_txq *txq, mbuf_t skb)
+{
+    txq->head = (txq->head + IWL_STA_TXQ_LEN - 1) % IWL_STA_TXQ_LEN;
+    txq->frames[txq->head].skb = skb;
+    txq->len++;
+}
+
+static bool iwl_codel_should_drop(struct iwl_sta_txq *txq, u64 sojourn, u64 now)
+{
+    /* below target, or nothing left standing behind this frame */
+    if (sojourn < IWL_CODEL_TARGET || !txq->len) {
+        txq->first_above_time = 0;
+        return false;
+    }
+    
+    if (!txq->first_above_time) {
+        txq->first_above_time = now + IWL_CODEL_INTERVAL;
+        return false;
+    }
+    
+    return now >= txq->first_above_time;
+}
+
+/*
+ * Takes the next frame off a station/TID queue, dropping frames while the
+ * queue has been above the CoDel target for a whole interval.
+ */
+mbuf_t IwlDvmOpMode::iwl_sta_txq_dequeue(struct iwl_priv *priv, struct iwl_sta_txq *txq)
+{
+    u64 now = iwl_sta_txq_now();
+    u64 time;
+    mbuf_t skb;
+    bool drop;
+    
+    skb = iwl_sta_txq_pop(txq, &time);
+    if (!skb) {
+        txq->dropping = false;
+        return NULL;
+    }
+    
+    drop = iwl_codel_should_drop(txq, now - time, now);
+    
+    if (txq->dropping) {
+        if (!drop) {
+            txq->dropping = false;
+            return skb;
+        }
+        
+        while (txq->dropping && now >= txq->drop_next) {
+            mbuf_freem(skb);
+            txq->drops++;
+            txq->drop_count++;
+            priv->tx_drops++;
+            
+            skb = iwl_sta_txq_pop(txq, &time);
+            if (!skb) {
+                txq->dropping = false;
+                return NULL;
+            }
+            
+            if (!iwl_codel_should_drop(txq, now - time, now))
+                txq->dropping = false;
+            else
+                txq->drop_next = iwl_codel_control_law(txq->drop_next, txq->drop_count);
+        }
+    } else if (drop) {
+        mbuf_freem(skb);
+        txq->drops++;
+        priv->tx_drops++;
+        
+        skb = iwl_sta_txq_pop(txq, &time);
+        txq->dropping = true;
+        
+        /* pick up the drop rate of a dropping state that ended recently */
+        if (txq->drop_count > 2 && (s64)(now - txq->drop_next) < 16 * IWL_CODEL_INTERVAL)
+            txq->drop_count -= 2;
+        else
+            txq->drop_count = 1;
+        txq->drop_next = iwl_codel_control_law(now, txq->drop_count);
+        
+        IWL_DEBUG_TX(priv, "sta %d tid %d: standing queue, %u frames dropped so far\n",
+                     txq->sta_id, txq->tid, txq->drops);
+    }
+    
+    return skb;
+}
+
+/*
+ * Hands frames of one AC to the hardware until its queue stops or nothing
+ * is left. A queue that used up its airtime goes to the back of the round
+ * with a new quantum.
+ */
+void IwlDvmOpMode::iwl_sta_txq_schedule(struct iwl_priv *priv, u8 ac)
+{
+    struct iwl_sta_txq *txq;
+    mbuf_t skb;
+    u32 airtime;
+    int ret;
+    
+    while (!ieee80211_queue_stopped(priv->hw, ac) &&
+           (txq = TAILQ_FIRST(&priv->active_txqs[ac]))) {
+        if (txq->deficit < 0) {
+            txq->deficit += IWL_AIRTIME_QUANTUM;
+            TAILQ_REMOVE(&priv->active_txqs[ac], txq, list);
+            TAILQ_INSERT_TAIL(&priv->active_txqs[ac], txq, list);
+            continue;
+        }
+        
+        skb = iwl_sta_txq_dequeue(priv, txq);
+        if (!skb) {
+            TAILQ_REMOVE(&priv->active_txqs[ac], txq, list);
+            txq->scheduled = false;
+            continue;
+        }
+        
+        airtime = iwl_rs_expected_airtime(priv, txq->sta_id, txq->tid, (u32)mbuf_pkthdr_len(skb));
+        txq->deficit -= airtime;
+        
+        /* frames after this one may follow on the same HW queue */
+        ret = iwlagn_tx_skb(priv, skb, txq->sta_id, txq->tid, true);
+        if (ret == -ENOSPC || ret == -EBUSY) {
+            iwl_sta_txq_unpop(txq, skb);
+            txq->deficit += airtime;
+            
+            /* the transport is full, the next wake picks up from here */
+            if (ret == -ENOSPC)
+                break;
+            
+            /* the TID's session is changing state, iwl_sta_txq_wake brings it back */
+            TAILQ_REMOVE(&priv->active_txqs[ac], txq, list);
+            txq->scheduled = false;
+            continue;
+        }
+        
+        if (ret) {
+            mbuf_freem(skb);
+            priv->tx_drops++;
+        }
+    }
+    
+    iwl_sta_txq_push(priv);
+}
+
+/*
+ * Publishes the write pointer of every HW queue the scheduler sent to,
+ * one doorbell per queue for the whole round, as Linux does once
+ * xmit_more is clear.
+ */
+void IwlDvmOpMode::iwl_sta_txq_push(struct iwl_priv *priv)
+{
+    u32 queues = priv->tx_push_queues;
+    int q;
+    
+    priv->tx_push_queues = 0;
+    
+    for (q = 0; queues; q++, queues >>= 1)
+        if (queues & 1)
+            _ops->tx_push(priv->trans, q);
+}
+
+/*
+ * Puts a station/TID queue that iwlagn_tx_skb held back while its
+ * aggregation session started or stopped back into the round.
+ */
+void IwlDvmOpMode::iwl_sta_txq_wake(struct iwl_priv *priv, u8 sta_id, u8 tid)
+{
+    struct iwl_sta_txq *txq = &priv->sta_txq[sta_id][tid];
+    u8 ac = iwl_tid_to_ac[tid];
+    
+    if (txq->scheduled || !txq->len)
+        return;
+    
+    TAILQ_INSERT_TAIL(&priv->active_txqs[ac], txq, list);
+    txq->scheduled = true;
+    iwl_sta_txq_schedule(priv, ac);
+}
+
+/*
+ * Empties the queues of a station that goes away and resets them for the
+ * next station to get its ID.
+ */
+void iwl_sta_txq_flush(struct iwl_priv *priv, u8 sta_id)
+{
+    struct iwl_sta_txq *txq;
+    u64 time;
+    mbuf_t skb;
+    int tid;
+    
+    for (tid = 0; tid < IWL_MAX_TID_COUNT; tid++) {
+        txq = &priv->sta_txq[sta_id][tid];
+        
+        if (txq->scheduled)
+            TAILQ_REMOVE(&priv->active_txqs[iwl_tid_to_ac[tid]], txq, list);
+        
+        while ((skb = iwl_sta_txq_pop(txq, &time))) {
+            mbuf_freem(skb);
+            priv->tx_drops++;
+        }
+        
+        txq->head = 0;
+        txq->scheduled = false;
+        txq->deficit = 0;
+        txq->first_above_time = 0;
+        txq->drop_next = 0;
+        txq->drop_count = 0;
+        txq->dropping = false;
+    }
+}
+
+void IwlDvmOpMode::iwl_sta_txq_free(struct iwl_priv *priv)
+{
+    int sta_id;
+    
+    for (sta_id = 0; sta_id < IWLAGN_STATION_COUNT; sta_id++)
+        iwl_sta_txq_flush(priv, sta_id);
+}
+
+/*
+ * ieee80211_subif_start_xmit - put an 802.11 data header and, unless the
+ * payload already starts with an LLC header, a SNAP header in place of the
+ * Ethernet header. The mbuf is gone if this fails.
+ */
+static int iwlagn_tx_encap(struct iwl_rxon_context *ctx, mbuf_t *skb,
+                           const struct ether_header *eh, u8 tid)
+{
+    struct ieee80211_qos_hdr *hdr;
+    u16 ethertype = be16_to_cpu(eh->ether_type);
+    bool tods = ctx->vif && ctx->vif->type == NL80211_IFTYPE_STATION;
+    __le16 fc = cpu_to_le16(IEEE80211_FTYPE_DATA);
+    size_t hdr_len, snap_len = 0;
+    u8 *snap;
+    
+    if (tods)
+        fc |= cpu_to_le16(IEEE80211_FCTL_TODS);
+    
+    /* group addressed frames of an IBSS have no station to be QoS with */
+    if (ctx->qos_data.qos_active && (tods || !is_multicast_ether_addr(eh->ether_dhost)))
+        fc |= cpu_to_le16(IEEE80211_STYPE_QOS_DATA);
+    
+    hdr_len = ieee80211_hdrlen(fc);
+    
+    /* below 0x600 the field is a length and the LLC header is in the payload */
+    if (ethertype >= 0x600)
+        snap_len = IWLAGN_SNAP_LEN;
+    
+    mbuf_adj(*skb, ETHER_HDR_LEN);
+    if (mbuf_prepend(skb, hdr_len + snap_len, MBUF_DONTWAIT))
+        return -ENOMEM;
+    
+    hdr = (struct ieee80211_qos_hdr *)mbuf_data(*skb);
+    memset(hdr, 0, hdr_len);
+    hdr->frame_control = fc;
+    
+    if (tods) {
+        memcpy(hdr->addr1, ctx->active.bssid_addr, ETH_ALEN);
+        memcpy(hdr->addr2, eh->ether_shost, ETH_ALEN);
+        memcpy(hdr->addr3, eh->ether_dhost, ETH_ALEN);
+    } else {
+        memcpy(hdr->addr1, eh->ether_dhost, ETH_ALEN);
+        memcpy(hdr->addr2, eh->ether_shost, ETH_ALEN);
+        memcpy(hdr->addr3, ctx->active.bssid_addr, ETH_ALEN);
+    }
+    
+    if (ieee80211_is_data_qos(fc))
+        hdr->qos_ctrl = cpu_to_le16(tid);
+    
+    if (snap_len) {
+        snap = (u8 *)hdr + hdr_len;
+        
+        /* AppleTalk ARP and IPX keep the bridge tunnel encapsulation */
+        if (ethertype == 0x80f3 || ethertype == 0x8137)
+            memcpy(snap, iwlagn_bridge_tunnel_header, sizeof(iwlagn_bridge_tunnel_header));
+        else
+            memcpy(snap, iwlagn_rfc1042_header, sizeof(iwlagn_rfc1042_header));
+        memcpy(snap + sizeof(iwlagn_rfc1042_header), &eh->ether_type, sizeof(eh->ether_type));
+    }
+    
+    return 0;
+}
+
+/*
+ * The controller passes Ethernet frames per AC. They are turned into 802.11
+ * data frames, queued for their station and TID and go out through the
+ * airtime scheduler. -ENOSPC means the station/TID queue is full and the
+ * frame stays with the caller, as it does on any other error. A frame that
+ * is lost after that is counted in tx_drops.
+ *
+ * With @more the scheduler waits for the last frame of the burst, so its
+ * round sends them all with one doorbell per HW queue.
+ */
+int IwlDvmOpMode::iwlagn_mac_tx(struct iwl_priv *priv, mbuf_t skb, u8 ac, bool more)
+{
+    struct iwl_rxon_context *ctx = &priv->contexts[IWL_RXON_CTX_BSS];
+    struct iwl_sta_txq *txq;
+    struct ether_header eh;
+    u8 sta_id = IWL_INVALID_STATION;
+    u8 tid = iwl_ac_to_tid[ac];
+    int i, idx, ret = 0;
+    
+    if (mbuf_pkthdr_len(skb) < ETHER_HDR_LEN) {
+        ret = -EINVAL;
+        goto out;
+    }
+    mbuf_copydata(skb, 0, ETHER_HDR_LEN, &eh);
+    
+    IOSimpleLockLock(priv->sta_lock);
+    
+    /* a station sends everything to its AP, group addressed frames too */
+    if (ctx->vif && ctx->vif->type == NL80211_IFTYPE_STATION) {
+        sta_id = ctx->ap_sta_id;
+    } else if (is_multicast_ether_addr(eh.ether_dhost)) {
+        sta_id = ctx->bcast_sta_id;
+    } else {
+        for (i = IWL_STA_ID; i < IWLAGN_STATION_COUNT; i++) {
+            if (priv->stations[i].used &&
+                ether_addr_equal(priv->stations[i].sta.sta.addr, eh.ether_dhost)) {
+                sta_id = i;
+                break;
+            }
+        }
+    }
+    
+    /* not associated yet */
+    if (sta_id != IWL_INVALID_STATION && !(priv->stations[sta_id].used & IWL_STA_DRIVER_ACTIVE))
+        sta_id = IWL_INVALID_STATION;
+    
+    IOSimpleLockUnlock(priv->sta_lock);
+    
+    if (sta_id == IWL_INVALID_STATION) {
+        ret = -EINVAL;
+        goto out;
+    }
+    
+    txq = &priv->sta_txq[sta_id][tid];
+    
+    if (txq->len == IWL_STA_TXQ_LEN) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    
+    if (iwlagn_tx_encap(ctx, &skb, &eh, tid)) {
+        priv->tx_drops++;
+        goto out;
+    }
+    
+    idx = (txq->head + txq->len) % IWL_STA_TXQ_LEN;
+    txq->frames[idx].skb = skb;
+    txq->frames[idx].time = iwl_sta_txq_now();
+    txq->len++;
+    
+    if (!txq->scheduled) {
+        TAILQ_INSERT_TAIL(&priv->active_txqs[ac], txq, list);
+        txq->scheduled = true;
+    }
+    
+out:
+    /* the caller holds on to the rest of a burst that found its queue full */
+    if (!more || ret == -ENOSPC)
+        iwl_sta_txq_schedule(priv, ac);
+    return ret;
+}
+
+/*
+ * tx.c
+ * iwlagn_tx_cmd_build_basic - TX command fields shared by data and
+ * management frames
+ */
+static void iwlagn_tx_cmd_build_basic(struct iwl_priv *priv, struct iwl_tx_cmd *tx_cmd,
+                                      struct ieee80211_hdr *hdr, u8 sta_id)
+{
+    __le16 fc = hdr->frame_control;
+    __le32 tx_flags = 0;
+    
+    tx_cmd->stop_time.life_time = TX_CMD_LIFE_TIME_INFINITE;
+    
+    /* nobody acks a group addressed frame */
+    if (!is_multicast_ether_addr(hdr->addr1))
+        tx_flags |= TX_CMD_FLG_ACK_MSK;
+    
+    tx_cmd->sta_id = sta_id;
+    if (ieee80211_has_morefrags(fc))
+        tx_flags |= TX_CMD_FLG_MORE_FRAG_MSK;
+    
+    if (ieee80211_is_data_qos(fc)) {
+        u8 *qc = ieee80211_get_qos_ctl(hdr);
+        tx_cmd->tid_tspec = qc[0] & 0xf;
+    } else {
+        tx_cmd->tid_tspec = IWL_TID_NON_QOS;
+        /* the uCode numbers non QoS frames, nothing here keeps a counter for them */
+        tx_flags |= TX_CMD_FLG_SEQ_CTL_MSK;
+    }
+    
+    if (ieee80211_is_mgmt(fc)) {
+        if (ieee80211_is_assoc_req(fc) || ieee80211_is_reassoc_req(fc))
+            tx_cmd->timeout.pm_frame_timeout = cpu_to_le16(3);
+        else
+            tx_cmd->timeout.pm_frame_timeout = cpu_to_le16(2);
+    } else {
+        tx_cmd->timeout.pm_frame_timeout = 0;
+    }
+    
+    tx_cmd->driver_txop = 0;
+    tx_cmd->tx_flags = tx_flags;
+    tx_cmd->next_frame_len = 0;
+}
+
+/*
+ * tx.c
+ * iwlagn_tx_cmd_build_rate - data frames go out at the rates of the
+ * station's link quality table, management frames at the lowest rate of
+ * the band
+ */
+static void iwlagn_tx_cmd_build_rate(struct iwl_priv *priv, struct iwl_tx_cmd *tx_cmd, __le16 fc)
+{
+    u32 rate_flags = 0;
+    u8 rate_plcp;
+    
+    tx_cmd->rts_retry_limit = IWLAGN_RTS_DFAULT_RETRY_LIMIT;
+    
+    if (ieee80211_is_data(fc)) {
+        tx_cmd->data_retry_limit = IWLAGN_DEFAULT_TX_RETRY;
+        
+        /* DATA packets will use the uCode station table for rate/antenna selection */
+        tx_cmd->initial_rate_index = 0;
+        tx_cmd->tx_flags |= TX_CMD_FLG_STA_RATE_MSK;
+        return;
+    }
+    
+    tx_cmd->data_retry_limit = IWLAGN_MGMT_DFAULT_RETRY_LIMIT;
+    
+    /* there is no rate control info for management frames, as in scan.c */
+    if (priv->band == NL80211_BAND_5GHZ) {
+        rate_plcp = IWL_RATE_6M_PLCP;
+    } else {
+        rate_plcp = IWL_RATE_1M_PLCP;
+        rate_flags |= RATE_MCS_CCK_MSK;
+    }
+    
+    priv->mgmt_tx_ant = iwl_toggle_tx_ant(priv, priv->mgmt_tx_ant, priv->nvm_data->valid_tx_ant);
+    rate_flags |= iwl_ant_idx_to_flags(priv->mgmt_tx_ant);
+    
+    tx_cmd->rate_n_flags = iwl_hw_set_rate_n_flags(rate_plcp, rate_flags);
+}
+
+/* pairwise or default WEP keys are installed for the context */
+static bool iwlagn_tx_keyed(struct iwl_rxon_context *ctx)
+{
+    int i;
+    
+    if (ctx->key_mapping_keys)
+        return true;
+    
+    for (i = 0; i < WEP_KEYS_MAX; i++)
+        if (ctx->wep_keys[i].key_size)
+            return true;
+    
+    return false;
+}
+
+/*
+ * tx.c
+ * iwlagn_tx_skb - build the TX command and hand the frame to the transport
+ *
+ * The frame already starts with its 802.11 header, @tid only matters for
+ * data frames. With @more the queue's write pointer is left to
+ * iwl_sta_txq_push. -ENOSPC means the
+ * transport is full and -EBUSY that the TID's aggregation session is
+ * starting or stopping; the frame stays with the caller then, as it does on
+ * any other error.
+ */
+int IwlDvmOpMode::iwlagn_tx_skb(struct iwl_priv *priv, mbuf_t skb, u8 sta_id, u8 tid, bool more)
+{
+    struct ieee80211_hdr *hdr = (struct ieee80211_hdr *)mbuf_data(skb);
+    struct iwl_rxon_context *ctx = &priv->contexts[priv->stations[sta_id].ctxid];
+    struct iwl_tid_data *tid_data = NULL;
+    struct iwl_device_cmd *dev_cmd;
+    struct iwl_tx_cmd *tx_cmd;
+    __le16 fc = hdr->frame_control;
+    u8 hdr_len = ieee80211_hdrlen(fc);
+    u16 seq_number = 0;
+    int txq_id, ret;
+    
+    if (iwl_is_rfkill(priv)) {
+        IWL_DEBUG_DROP(priv, "Dropping - RF KILL\n");
+        return -EIO;
+    }
+    
+    /*
+     * iwlagn_tx_cmd_build_hwcrypto needs the TX key of the station, which
+     * this port doesn't keep. Don't send plaintext on a keyed link.
+     */
+    if (ieee80211_is_data(fc) && iwlagn_tx_keyed(ctx)) {
+        IWL_DEBUG_DROP(priv, "Dropping - no TX key for a keyed link\n");
+        return -EACCES;
+    }
+    
+    dev_cmd = iwl_trans_alloc_tx_cmd(priv->trans);
+    if (unlikely(!dev_cmd))
+        return -ENOMEM;
+    
+    memset(dev_cmd, 0, sizeof(*dev_cmd));
+    dev_cmd->hdr.cmd = REPLY_TX;
+    tx_cmd = (struct iwl_tx_cmd *)dev_cmd->payload;
+    
+    /* Total # bytes to be transmitted */
+    tx_cmd->len = cpu_to_le16((u16)mbuf_pkthdr_len(skb));
+    
+    iwlagn_tx_cmd_build_basic(priv, tx_cmd, hdr, sta_id);
+    iwlagn_tx_cmd_build_rate(priv, tx_cmd, fc);
+    
+    /* management frames go out on the VO queue, as mac80211 queues them */
+    if (ieee80211_is_data(fc))
+        txq_id = ctx->ac_to_queue[iwl_tid_to_ac[tid]];
+    else
+        txq_id = ctx->ac_to_queue[IEEE80211_AC_VO];
+    
+    IOSimpleLockLock(priv->sta_lock);
+    
+    if (ieee80211_is_data_qos(fc)) {
+        tid_data = &priv->tid_data[sta_id][tid];
+        
+        /* mac80211 holds the frames of a TID while its session changes state */
+        if (tid_data->agg.state != IWL_AGG_ON && tid_data->agg.state != IWL_AGG_OFF) {
+            IOSimpleLockUnlock(priv->sta_lock);
+            iwl_trans_free_tx_cmd(priv->trans, dev_cmd);
+            return -EBUSY;
+        }
+        
+        seq_number = tid_data->seq_number;
+        seq_number &= IEEE80211_SCTL_SEQ;
+        hdr->seq_ctrl &= cpu_to_le16(IEEE80211_SCTL_FRAG);
+        hdr->seq_ctrl |= cpu_to_le16(seq_number);
+        seq_number += 0x10;
+        
+        /* aggregation is on for this <sta,tid> */
+        if (tid_data->agg.state == IWL_AGG_ON)
+            txq_id = tid_data->agg.txq_id;
+    }
+    
+    IOSimpleLockUnlock(priv->sta_lock);
+    
+    /* Copy MAC header from skb into command buffer */
+    memcpy(tx_cmd->hdr, hdr, hdr_len);
+    
+    IWL_DEBUG_TX(priv, "TX to [%d|%d] Q:%d - seq: 0x%x\n", sta_id, tid, txq_id, seq_number);
+    
+    /*
+     * Not under sta_lock, the transport maps the mbuf. Everything that
+     * sends runs on the work loop, so nobody takes the sequence number
+     * meanwhile, and it only moves on once the ring index did too.
+     */
+    ret = _ops->tx(priv->trans, skb, dev_cmd, txq_id, more);
+    if (ret) {
+        iwl_trans_free_tx_cmd(priv->trans, dev_cmd);
+        return ret;
+    }
+    
+    /* IWLAGN_NUM_QUEUES HW queues, they all fit */
+    if (more)
+        priv->tx_push_queues |= BIT(txq_id);
+    
+    if (tid_data && !ieee80211_has_morefrags(fc)) {
+        IOSimpleLockLock(priv->sta_lock);
+        tid_data->seq_number = seq_number;
+        IOSimpleLockUnlock(priv->sta_lock);
+    }
+    
+    return 0;
+}
+
+static inline u32 iwlagn_get_scd_ssn(struct iwlagn_tx_resp *tx_resp)
+{
+    return le32_to_cpup((__le32 *)&tx_resp->status + tx_resp->frame_count) & IEEE80211_MAX_SN;
+}
+
+// line 859
+static void iwlagn_count_agg_tx_err_status(struct iwl_priv *priv, u16 status)
+{
+    status &= AGG_TX_STATUS_MSK;
+    
+    switch (status) {
+        case AGG_TX_STATE_UNDERRUN_MSK:
+            priv->reply_agg_tx_stats.underrun++;
+            break;
+        case AGG_TX_STATE_BT_PRIO_MSK:
+            priv->reply_agg_tx_stats.bt_prio++;
+            break;
+        case AGG_TX_STATE_FEW_BYTES_MSK:
+            priv->reply_agg_tx_stats.few_bytes++;
+            break;
+        case AGG_TX_STATE_ABORT_MSK:
+            priv->reply_agg_tx_stats.abort++;
+            break;
+        case AGG_TX_STATE_LAST_SENT_TTL_MSK:
+            priv->reply_agg_tx_stats.last_sent_ttl++;
+            break;
+        case AGG_TX_STATE_LAST_SENT_TRY_CNT_MSK:
+            priv->reply_agg_tx_stats.last_sent_try++;
+            break;
+        case AGG_TX_STATE_LAST_SENT_BT_KILL_MSK:
+            priv->reply_agg_tx_stats.last_sent_bt_kill++;
+            break;
+        case AGG_TX_STATE_SCD_QUERY_MSK:
+            priv->reply_agg_tx_stats.scd_query++;
+            break;
+        case AGG_TX_STATE_TEST_BAD_CRC32_MSK:
+            priv->reply_agg_tx_stats.bad_crc32++;
+            break;
+        case AGG_TX_STATE_RESPONSE_MSK:
+            priv->reply_agg_tx_stats.response++;
+            break;
+        case AGG_TX_STATE_DUMP_TX_MSK:
+            priv->reply_agg_tx_stats.dump_tx++;
+            break;
+        case AGG_TX_STATE_DELAY_TX_MSK:
+            priv->reply_agg_tx_stats.delay_tx++;
+            break;
+        default:
+            priv->reply_agg_tx_stats.unknown++;
+            break;
+    }
+}
+
+/* line 913
+ * iwl_rx_reply_tx_agg - status of the frames of an aggregate, the block ack
+ * that reclaims them comes on its own
+ */
+static void iwl_rx_reply_tx_agg(struct iwl_priv *priv, struct iwlagn_tx_resp *tx_resp)
+{
+    struct agg_tx_status *frame_status = &tx_resp->status;
+    int tid = (tx_resp->ra_tid & IWLAGN_TX_RES_TID_MSK) >> IWLAGN_TX_RES_TID_POS;
+    int sta_id = (tx_resp->ra_tid & IWLAGN_TX_RES_RA_MSK) >> IWLAGN_TX_RES_RA_POS;
+    struct iwl_ht_agg *agg = &priv->tid_data[sta_id][tid].agg;
+    u32 status = le16_to_cpu(tx_resp->status.status);
+    int i;
+    
+    //lockdep_assert_held(&priv->sta_lock);
+    
+    if (agg->wait_for_ba)
+        IWL_DEBUG_TX_REPLY(priv, "got tx response w/o block-ack\n");
+    
+    agg->rate_n_flags = le32_to_cpu(tx_resp->rate_n_flags);
+    agg->wait_for_ba = (tx_resp->frame_count > 1);
+    
+    if (tx_resp->frame_count == 1)
+        return;
+    
+    IWL_DEBUG_TX_REPLY(priv, "TXQ %d initial_rate 0x%x ssn %d frm_cnt %d\n",
+                       agg->txq_id, le32_to_cpu(tx_resp->rate_n_flags),
+                       iwlagn_get_scd_ssn(tx_resp), tx_resp->frame_count);
+    
+    /* Construct bit-map of pending frames within Tx window */
+    for (i = 0; i < tx_resp->frame_count; i++) {
+        u16 fstatus = le16_to_cpu(frame_status[i].status);
+        u8 retry_cnt = (fstatus & AGG_TX_TRY_MSK) >> AGG_TX_TRY_POS;
+        
+        if (status & AGG_TX_STATUS_MSK)
+            iwlagn_count_agg_tx_err_status(priv, fstatus);
+        
+        if (status & (AGG_TX_STATE_FEW_BYTES_MSK | AGG_TX_STATE_ABORT_MSK))
+            continue;
+        
+        if (status & AGG_TX_STATUS_MSK || retry_cnt > 1)
+            IWL_DEBUG_TX_REPLY(priv, "%d: status 0x%04x, try-count (0x%01x)\n",
+                               i, fstatus & AGG_TX_STATUS_MSK, retry_cnt);
+    }
+}
+
+/* line 1126
+ * iwl_check_abort_status - the firmware dropped a frame for RF kill and
+ * wants the rest of the queues flushed. Linux queues the flush as work,
+ * here it goes out asynchronously as the RX path can't wait for it.
+ */
+static void iwl_check_abort_status(struct iwl_priv *priv, u8 frame_count, u32 status)
+{
+    if (frame_count == 1 && status == TX_STATUS_FAIL_RFKILL_FLUSH) {
+        IWL_ERR(priv, "Tx flush command to flush out all frames\n");
+        if (!test_bit(STATUS_EXIT_PENDING, &priv->status))
+            iwlagn_txfifo_flush(priv, 0, CMD_ASYNC);
+    }
+}
+
+/*
+ * tx.c
+ * iwlagn_rx_reply_tx - the firmware is done with a frame, or with the first
+ * frame of an aggregate
+ */
+void IwlDvmOpMode::iwlagn_rx_reply_tx(struct iwl_priv *priv, struct iwl_rx_cmd_buffer *rxb)
+{
+    struct iwl_rx_packet *pkt = (struct iwl_rx_packet *)rxb_addr(rxb);
+    u16 sequence = le16_to_cpu(pkt->hdr.sequence);
+    int txq_id = SEQ_TO_QUEUE(sequence);
+    int cmd_index = SEQ_TO_INDEX(sequence);
+    struct iwlagn_tx_resp *tx_resp = (struct iwlagn_tx_resp *)pkt->data;
+    u32 status = le16_to_cpu(tx_resp->status.status);
+    u16 ssn = iwlagn_get_scd_ssn(tx_resp);
+    bool is_agg = txq_id >= IWLAGN_FIRST_AMPDU_QUEUE;
+    bool reclaim = false;
+    mbuf_t skbs = NULL;
+    int tid, sta_id;
+    enum iwl_agg_state emptied = IWL_AGG_OFF;
+    
+    tid = (tx_resp->ra_tid & IWLAGN_TX_RES_TID_MSK) >> IWLAGN_TX_RES_TID_POS;
+    sta_id = (tx_resp->ra_tid & IWLAGN_TX_RES_RA_MSK) >> IWLAGN_TX_RES_RA_POS;
+    
+    IOSimpleLockLock(priv->sta_lock);
+    
+    if (is_agg) {
+        /* an aggregation queue only carries QoS frames of a known station */
+        if (WARN_ON(tid >= IWL_MAX_TID_COUNT || sta_id >= IWLAGN_STATION_COUNT)) {
+            IOSimpleLockUnlock(priv->sta_lock);
+            return;
+        }
+        iwl_rx_reply_tx_agg(priv, tx_resp);
+    }
+    
+    if (tx_resp->frame_count == 1) {
+        u16 next_reclaimed = le16_to_cpu(tx_resp->seq_ctl);
+        
+        next_reclaimed = IEEE80211_SEQ_TO_SN(next_reclaimed + 0x10);
+        
+        if (is_agg) {
+            /* If this is an aggregation queue, we can rely on the
+             * ssn since the wifi sequence number corresponds to
+             * the index in the TFD ring (%256).
+             * The seq_ctl is the sequence control of the packet
+             * to which this Tx response relates. But if there is a
+             * hole in the bitmap of the BA we received, this Tx
+             * response may allow to reclaim the hole and all the
+             * subsequent packets that were already acked.
+             * In that case, seq_ctl != ssn, and the next packet
+             * to be reclaimed will be ssn and not seq_ctl.
+             */
+            next_reclaimed = ssn;
+        }
+        
+        if (tid != IWL_TID_NON_QOS && sta_id < IWLAGN_STATION_COUNT) {
+            priv->tid_data[sta_id][tid].next_reclaimed = next_reclaimed;
+            IWL_DEBUG_TX_REPLY(priv, "Next reclaimed packet:%d\n", next_reclaimed);
+            emptied = iwlagn_check_ratid_empty(priv, sta_id, tid);
+        }
+        
+        reclaim = true;
+    }
+    
+    IWL_DEBUG_TX_REPLY(priv, "TXQ %d status 0x%08x (%s) idx %d ssn %d\n",
+                       txq_id, status, is_agg ? "agg" : "single", cmd_index, ssn);
+    
+    IOSimpleLockUnlock(priv->sta_lock);
+    
+    /*
+     * Not under sta_lock: the reclaim moves overflow frames onto the ring,
+     * and mapping those may sleep.
+     */
+    if (reclaim)
+        _ops->reclaim(priv->trans, txq_id, ssn, &skbs);
+    
+    iwl_check_abort_status(priv, tx_resp->frame_count, status);
+    
+    iwlagn_agg_emptied(priv, sta_id, tid, emptied);
+    
+    /* there is no ieee80211_tx_status to hand the frames to */
+    if (skbs)
+        mbuf_freem_list(skbs);
+}
+
+/*
+ * tx.c
+ * iwlagn_rx_reply_compressed_ba - Handler for REPLY_COMPRESSED_BA
+ *
+ * Handles block-acknowledge notification from device, which reports success
+ * of frames sent via aggregation.
+ */
+void IwlDvmOpMode::iwlagn_rx_reply_compressed_ba(struct iwl_priv *priv, struct iwl_rx_cmd_buffer *rxb)
+{
+    struct iwl_rx_packet *pkt = (struct iwl_rx_packet *)rxb_addr(rxb);
+    struct iwl_compressed_ba_resp *ba_resp = (struct iwl_compressed_ba_resp *)pkt->data;
+    struct iwl_ht_agg *agg;
+    mbuf_t reclaimed_skbs = NULL;
+    int sta_id;
+    int tid;
+    enum iwl_agg_state emptied;
+    
+    /* "flow" corresponds to Tx queue */
+    u16 scd_flow = le16_to_cpu(ba_resp->scd_flow);
+    
+    /* "ssn" is start of block-ack Tx window, corresponds to index
+     * (in Tx queue's circular buffer) of first TFD/frame in window */
+    u16 ba_resp_scd_ssn = le16_to_cpu(ba_resp->scd_ssn);
+    
+    if (scd_flow >= priv->cfg->base_params->num_of_queues) {
+        IWL_ERR(priv, "BUG_ON scd_flow is bigger than number of queues\n");
+        return;
+    }
+    
+    sta_id = ba_resp->sta_id;
+    tid = ba_resp->tid;
+    agg = &priv->tid_data[sta_id][tid].agg;
+    
+    IOSimpleLockLock(priv->sta_lock);
+    
+    if (unlikely(!agg->wait_for_ba)) {
+        if (unlikely(ba_resp->bitmap))
+            IWL_ERR(priv, "Received BA when not expected\n");
+        IOSimpleLockUnlock(priv->sta_lock);
+        return;
+    }
+    
+    if (unlikely(scd_flow != agg->txq_id)) {
+        /*
+         * FIXME: this is a uCode bug which need to be addressed,
+         * log the information and return for now.
+         * Since it is can possibly happen very often and in order
+         * not to fill the syslog, don't use IWL_ERR or IWL_WARN
+         */
+        IWL_DEBUG_TX_QUEUES(priv, "Bad queue mapping txq_id=%d, agg_txq[sta:%d,tid:%d]=%d\n",
+                            scd_flow, sta_id, tid, agg->txq_id);
+        IOSimpleLockUnlock(priv->sta_lock);
+        return;
+    }
+    
+    IWL_DEBUG_TX_REPLY(priv, "REPLY_COMPRESSED_BA [%d] Received from %pM, sta_id = %d\n",
+                       agg->wait_for_ba, (u8 *) &ba_resp->sta_addr_lo32, ba_resp->sta_id);
+    IWL_DEBUG_TX_REPLY(priv, "TID = %d, SeqCtl = %d, bitmap = 0x%llx, scd_flow = %d, scd_ssn = %d sent:%d, acked:%d\n",
+                       ba_resp->tid, le16_to_cpu(ba_resp->seq_ctl),
+                       (unsigned long long)le64_to_cpu(ba_resp->bitmap),
+                       scd_flow, ba_resp_scd_ssn, ba_resp->txed,
+                       ba_resp->txed_2_done);
+    
+    /* Mark that the expected block-ack response arrived */
+    agg->wait_for_ba = false;
+    
+    /* Sanity check values reported by uCode */
+    if (ba_resp->txed_2_done > ba_resp->txed) {
+        IWL_DEBUG_TX_REPLY(priv, "bogus sent(%d) and ack(%d) count\n",
+                           ba_resp->txed, ba_resp->txed_2_done);
+        /*
+         * set txed_2_done = txed,
+         * so it won't impact rate scale
+         */
+        ba_resp->txed_2_done = ba_resp->txed;
+    }
+    
+    priv->tid_data[sta_id][tid].next_reclaimed = ba_resp_scd_ssn;
+    
+    emptied = iwlagn_check_ratid_empty(priv, sta_id, tid);
+    
+    IOSimpleLockUnlock(priv->sta_lock);
+    
+    /* Release all TFDs before the SSN, i.e. all TFDs in front of
+     * block-ack window (we assume that they've been successfully
+     * transmitted ... if not, it's too late anyway). Not under
+     * sta_lock, as in iwlagn_rx_reply_tx. */
+    _ops->reclaim(priv->trans, scd_flow, ba_resp_scd_ssn, &reclaimed_skbs);
+    
+    iwlagn_agg_emptied(priv, sta_id, tid, emptied);
+    
+    /* one free for the whole block ack */
+    if (reclaimed_skbs)
+        mbuf_freem_list(reclaimed_skbs);
+}
+
+/*
+ * tx.c
+ * TX aggregation sessions
+ *
+ * An A-MPDU session gets a scheduler queue of its own, whose ring index is
+ * the 802.11 sequence number so the scheduler can match block acks to TFDs.
+ * The session can only start or stop once everything sent on the TID before
+ * is reclaimed: until then it waits in one of the EMPTYING states and
+ * iwlagn_check_ratid_empty moves it on from the TX status handlers.
+ */
+int IwlDvmOpMode::iwlagn_alloc_agg_txq(struct iwl_priv *priv, int mq)
+{
+    int q;
+    
+    for (q = IWLAGN_FIRST_AMPDU_QUEUE; q < priv->cfg->base_params->num_of_queues; q++) {
+        if (!test_and_set_bit(q, priv->agg_q_alloc)) {
+            priv->queue_to_mac80211[q] = mq;
+            return q;
+        }
+    }
+    
+    return -ENOSPC;
+}
+
+void IwlDvmOpMode::iwlagn_dealloc_agg_txq(struct iwl_priv *priv, int q)
+{
+    clear_bit(q, priv->agg_q_alloc);
+    priv->queue_to_mac80211[q] = IWL_INVALID_MAC80211_QUEUE;
+}
+
+int IwlDvmOpMode::iwlagn_tx_agg_start(struct iwl_priv *priv, u8 sta_id, u16 tid, u16 *ssn)
+{
+    struct iwl_rxon_context *ctx;
+    struct iwl_tid_data *tid_data;
+    int txq_id, ret;
+    bool starting;
+    
+    if (sta_id >= IWLAGN_STATION_COUNT) {
+        IWL_ERR(priv, "Start AGG on invalid station\n");
+        return -ENXIO;
+    }
+    if (unlikely(tid >= IWL_MAX_TID_COUNT))
+        return -EINVAL;
+    
+    IWL_DEBUG_HT(priv, "TX AGG request on sta %d tid = %d\n", sta_id, tid);
+    
+    if (priv->tid_data[sta_id][tid].agg.state != IWL_AGG_OFF) {
+        IWL_ERR(priv, "Start AGG when state is not IWL_AGG_OFF !\n");
+        return -ENXIO;
+    }
+    
+    ctx = &priv->contexts[priv->stations[sta_id].ctxid];
+    
+    txq_id = iwlagn_alloc_agg_txq(priv, ctx->ac_to_queue[iwl_tid_to_ac[tid]]);
+    if (txq_id < 0) {
+        IWL_DEBUG_TX_QUEUES(priv, "No free aggregation queue for %d/%d\n", sta_id, tid);
+        return txq_id;
+    }
+    
+    ret = iwl_sta_tx_modify_enable_tid(priv, sta_id, tid);
+    if (ret) {
+        iwlagn_dealloc_agg_txq(priv, txq_id);
+        return ret;
+    }
+    
+    IOSimpleLockLock(priv->sta_lock);
+    tid_data = &priv->tid_data[sta_id][tid];
+    tid_data->agg.ssn = IEEE80211_SEQ_TO_SN(tid_data->seq_number);
+    tid_data->agg.txq_id = txq_id;
+    
+    *ssn = tid_data->agg.ssn;
+    starting = *ssn == tid_data->next_reclaimed;
+    
+    if (starting) {
+        IWL_DEBUG_TX_QUEUES(priv, "Can proceed: ssn = next_recl = %d\n", tid_data->agg.ssn);
+        tid_data->agg.state = IWL_AGG_STARTING;
+    } else {
+        IWL_DEBUG_TX_QUEUES(priv, "Can't proceed: ssn %d, next_reclaimed = %d\n",
+                            tid_data->agg.ssn, tid_data->next_reclaimed);
+        tid_data->agg.state = IWL_EMPTYING_HW_QUEUE_ADDBA;
+    }
+    IOSimpleLockUnlock(priv->sta_lock);
+    
+    if (starting)
+        iwlagn_tx_ba_start_cb(priv, sta_id, tid);
+    
+    return 0;
+}
+
+/*
+ * tx.c
+ * iwlagn_tx_agg_oper - the peer accepted the ADDBA, open the scheduler
+ * window at the session's ssn
+ */
+int IwlDvmOpMode::iwlagn_tx_agg_oper(struct iwl_priv *priv, u8 sta_id, u16 tid, u8 buf_size)
+{
+    struct iwl_rxon_context *ctx;
+    struct iwl_link_quality_cmd *lq;
+    int q, fifo;
+    u16 ssn;
+    
+    if (sta_id >= IWLAGN_STATION_COUNT || tid >= IWL_MAX_TID_COUNT) {
+        IWL_ERR(priv, "Invalid station for AGG tid %d\n", tid);
+        return -ENXIO;
+    }
+    
+    ctx = &priv->contexts[priv->stations[sta_id].ctxid];
+    lq = priv->stations[sta_id].lq;
+    
+    buf_size = min_t(int, buf_size, LINK_QUAL_AGG_FRAME_LIMIT_DEF);
+    
+    IOSimpleLockLock(priv->sta_lock);
+    
+    /* only a session whose ADDBA went out can become operational */
+    if (priv->tid_data[sta_id][tid].agg.state != IWL_AGG_STARTING) {
+        IWL_WARN(priv, "AGG oper while state not starting for %d on %d (%d)\n",
+                 sta_id, tid, priv->tid_data[sta_id][tid].agg.state);
+        IOSimpleLockUnlock(priv->sta_lock);
+        return -EINVAL;
+    }
+    
+    ssn = priv->tid_data[sta_id][tid].agg.ssn;
+    q = priv->tid_data[sta_id][tid].agg.txq_id;
+    priv->tid_data[sta_id][tid].agg.state = IWL_AGG_ON;
+    IOSimpleLockUnlock(priv->sta_lock);
+    
+    /* iwlagn_agg_tids_put gives it back once the session is off again */
+    priv->agg_tids_count++;
+    IWL_DEBUG_HT(priv, "priv->agg_tids_count = %u\n", priv->agg_tids_count);
+    
+    fifo = ctx->ac_to_fifo[iwl_tid_to_ac[tid]];
+    
+    /* ring and scheduler read pointer both start at ssn */
+    iwl_trans_txq_enable(priv->trans, q, fifo, sta_id, tid, buf_size, ssn, 0);
+    
+    /* the frames held back since the ADDBA go out on the new queue */
+    iwl_sta_txq_wake(priv, sta_id, tid);
+    
+    if (!lq)
+        return 0;
+    
+    /*
+     * Even though in theory the peer could have different
+     * aggregation reorder buffer sizes for different sessions,
+     * our ucode doesn't allow for that and has a global limit
+     * for each station. Therefore, use the minimum of all the
+     * aggregation sessions and our default value.
+     */
+    if (!lq->agg_params.agg_frame_cnt_limit)
+        lq->agg_params.agg_frame_cnt_limit = LINK_QUAL_AGG_FRAME_LIMIT_DEF;
+    lq->agg_params.agg_frame_cnt_limit = min_t(u8, lq->agg_params.agg_frame_cnt_limit, buf_size);
+    
+    if (priv->hw_params.use_rts_for_aggregation) {
+        /*
+         * switch to RTS/CTS if it is the prefer protection
+         * method for HT traffic
+         */
+        lq->general_params.flags |= LINK_QUAL_FLAGS_SET_STA_TLC_RTS_MSK;
+    }
+    
+    IWL_DEBUG_HT(priv, "Tx aggregation enabled on sta %d tid = %d\n", sta_id, tid);
+    
+    return iwl_send_lq_cmd(priv, ctx, lq, CMD_ASYNC, false);
+}
+
+/*
+ * tx.c
+ * iwlagn_tx_agg_stop - tear the session down once its frames are reclaimed
+ *
+ * @send_delba is set when we end the session, not when the peer declined
+ * the ADDBA or sent a DELBA itself.
+ */
+int IwlDvmOpMode::iwlagn_tx_agg_stop(struct iwl_priv *priv, u8 sta_id, u16 tid, bool send_delba)
+{
+    struct iwl_tid_data *tid_data;
+    int txq_id;
+    enum iwl_agg_state agg_state;
+    
+    if (sta_id >= IWLAGN_STATION_COUNT || tid >= IWL_MAX_TID_COUNT) {
+        IWL_ERR(priv, "Invalid station for AGG tid %d\n", tid);
+        return -ENXIO;
+    }
+    
+    IOSimpleLockLock(priv->sta_lock);
+    
+    tid_data = &priv->tid_data[sta_id][tid];
+    txq_id = tid_data->agg.txq_id;
+    
+    switch (tid_data->agg.state) {
+        case IWL_EMPTYING_HW_QUEUE_ADDBA:
+            /*
+             * This can happen if the peer stops aggregation
+             * again before we've had a chance to drain the
+             * queue we selected previously, i.e. before the
+             * session was really started completely.
+             */
+            IWL_DEBUG_HT(priv, "AGG stop before setup done\n");
+            goto turn_off;
+        case IWL_AGG_STARTING:
+            /*
+             * This can happen when the session is stopped before
+             * we receive ADDBA response
+             */
+            IWL_DEBUG_HT(priv, "AGG stop before AGG became operational\n");
+            goto turn_off;
+        case IWL_AGG_ON:
+            break;
+        default:
+            IWL_WARN(priv, "Stopping AGG while state not ON or starting for %d on %d (%d)\n",
+                     sta_id, tid, tid_data->agg.state);
+            IOSimpleLockUnlock(priv->sta_lock);
+            return 0;
+    }
+    
+    tid_data->agg.ssn = IEEE80211_SEQ_TO_SN(tid_data->seq_number);
+    
+    /* There are still packets for this RA / TID in the HW */
+    if (!test_bit(txq_id, priv->agg_q_alloc)) {
+        IWL_DEBUG_TX_QUEUES(priv, "stopping AGG on STA/TID %d/%d but hwq %d not used\n",
+                            sta_id, tid, txq_id);
+    } else if (tid_data->agg.ssn != tid_data->next_reclaimed) {
+        IWL_DEBUG_TX_QUEUES(priv, "Can't proceed: ssn %d, next_recl = %d\n",
+                            tid_data->agg.ssn, tid_data->next_reclaimed);
+        tid_data->agg.state = IWL_EMPTYING_HW_QUEUE_DELBA;
+        tid_data->agg.send_delba = send_delba;
+        IOSimpleLockUnlock(priv->sta_lock);
+        return 0;
+    }
+    
+    IWL_DEBUG_TX_QUEUES(priv, "Can proceed: ssn = next_recl = %d\n", tid_data->agg.ssn);
+turn_off:
+    agg_state = tid_data->agg.state;
+    tid_data->agg.state = IWL_AGG_OFF;
+    
+    IOSimpleLockUnlock(priv->sta_lock);
+    
+    if (test_bit(txq_id, priv->agg_q_alloc)) {
+        /*
+         * If the transport didn't know that we wanted to start
+         * agreggation, don't tell it that we want to stop them.
+         * This can happen when we don't get the addBA response on
+         * time, or we hadn't time to drain the AC queues.
+         */
+        if (agg_state == IWL_AGG_ON)
+            iwl_trans_txq_disable(priv->trans, txq_id, true);
+        else
+            IWL_DEBUG_TX_QUEUES(priv, "Don't disable tx agg: %d\n", agg_state);
+        iwlagn_dealloc_agg_txq(priv, txq_id);
+    }
+    
+    if (agg_state == IWL_AGG_ON)
+        iwlagn_agg_tids_put(priv, sta_id);
+    
+    /* the peer never saw an ADDBA while we were still draining for it */
+    iwlagn_tx_ba_stop_cb(priv, sta_id, tid,
+                         send_delba && agg_state != IWL_EMPTYING_HW_QUEUE_ADDBA);
+    
+    return 0;
+}
+
+/*
+ * tx.c
+ * iwlagn_tx_agg_flush - drop the session without waiting for its frames,
+ * the station is going away. The FIFO flush waits for the firmware, so
+ * this can't run from the RX path.
+ */
+int IwlDvmOpMode::iwlagn_tx_agg_flush(struct iwl_priv *priv, u8 sta_id, u16 tid)
+{
+    struct iwl_tid_data *tid_data;
+    enum iwl_agg_state agg_state;
+    int txq_id;
+    
+    if (sta_id >= IWLAGN_STATION_COUNT || tid >= IWL_MAX_TID_COUNT) {
+        IWL_ERR(priv, "Invalid station for AGG tid %d\n", tid);
+        return -ENXIO;
+    }
+    
+    /*
+     * First set the agg state to OFF to avoid calling
+     * ieee80211_stop_tx_ba_cb in iwlagn_check_ratid_empty.
+     */
+    IOSimpleLockLock(priv->sta_lock);
+    
+    tid_data = &priv->tid_data[sta_id][tid];
+    txq_id = tid_data->agg.txq_id;
+    agg_state = tid_data->agg.state;
+    IWL_DEBUG_TX_QUEUES(priv, "Flush AGG: sta %d tid %d q %d state %d\n",
+                        sta_id, tid, txq_id, tid_data->agg.state);
+    
+    tid_data->agg.state = IWL_AGG_OFF;
+    
+    IOSimpleLockUnlock(priv->sta_lock);
+    
+    if (test_bit(txq_id, priv->agg_q_alloc)) {
+        if (agg_state == IWL_AGG_ON || agg_state == IWL_EMPTYING_HW_QUEUE_DELBA) {
+            /* only a queue the scheduler runs has frames to flush */
+            if (iwlagn_txfifo_flush(priv, BIT(txq_id), 0))
+                IWL_ERR(priv, "Couldn't flush the AGG queue\n");
+            iwl_trans_txq_disable(priv->trans, txq_id, true);
+        } else {
+            IWL_DEBUG_TX_QUEUES(priv, "Don't disable tx agg: %d\n", agg_state);
+        }
+        iwlagn_dealloc_agg_txq(priv, txq_id);
+    }
+    
+    if (agg_state == IWL_AGG_ON || agg_state == IWL_EMPTYING_HW_QUEUE_DELBA)
+        iwlagn_agg_tids_put(priv, sta_id);
+    
+    return 0;
+}
+
+/*
+ * tx.c
+ * iwlagn_check_ratid_empty - a pending ADDBA or DELBA can go on once
+ * everything sent before the session's ssn is reclaimed
+ *
+ * Returns the state that emptied, IWL_EMPTYING_HW_QUEUE_ADDBA or
+ * IWL_EMPTYING_HW_QUEUE_DELBA, or IWL_AGG_OFF if none did. The caller
+ * passes it to iwlagn_agg_emptied after dropping sta_lock, as going on
+ * sends frames and gives the queue's rings back to the transport.
+ */
+enum iwl_agg_state IwlDvmOpMode::iwlagn_check_ratid_empty(struct iwl_priv *priv, int sta_id, u8 tid)
+{
+    struct iwl_tid_data *tid_data = &priv->tid_data[sta_id][tid];
+    enum iwl_agg_state emptied = IWL_AGG_OFF;
+    
+    //lockdep_assert_held(&priv->sta_lock);
+    
+    switch (priv->tid_data[sta_id][tid].agg.state) {
+        case IWL_EMPTYING_HW_QUEUE_DELBA:
+            /* There are no packets for this RA / TID in the HW any more */
+            if (tid_data->agg.ssn == tid_data->next_reclaimed) {
+                IWL_DEBUG_TX_QUEUES(priv, "Can continue DELBA flow ssn = next_recl = %d\n",
+                                    tid_data->next_reclaimed);
+                tid_data->agg.state = IWL_AGG_OFF;
+                emptied = IWL_EMPTYING_HW_QUEUE_DELBA;
+            }
+            break;
+        case IWL_EMPTYING_HW_QUEUE_ADDBA:
+            /* There are no packets for this RA / TID in the HW any more */
+            if (tid_data->agg.ssn == tid_data->next_reclaimed) {
+                IWL_DEBUG_TX_QUEUES(priv, "Can continue ADDBA flow ssn = next_recl = %d\n",
+                                    tid_data->next_reclaimed);
+                tid_data->agg.state = IWL_AGG_STARTING;
+                emptied = IWL_EMPTYING_HW_QUEUE_ADDBA;
+            }
+            break;
+        default:
+            break;
+    }
+    
+    return emptied;
+}
+
+/*
+ * iwlagn_agg_emptied - go on with the ADDBA or DELBA that
+ * iwlagn_check_ratid_empty let through. A DELBA's queue stays allocated in
+ * agg_q_alloc until here, so no new session can pick it up meanwhile.
+ */
+void IwlDvmOpMode::iwlagn_agg_emptied(struct iwl_priv *priv, u8 sta_id, u8 tid,
+                                      enum iwl_agg_state emptied)
+{
+    int txq_id;
+    bool send_delba;
+    
+    switch (emptied) {
+        case IWL_EMPTYING_HW_QUEUE_DELBA:
+            IOSimpleLockLock(priv->sta_lock);
+            txq_id = priv->tid_data[sta_id][tid].agg.txq_id;
+            send_delba = priv->tid_data[sta_id][tid].agg.send_delba;
+            IOSimpleLockUnlock(priv->sta_lock);
+            
+            iwl_trans_txq_disable(priv->trans, txq_id, true);
+            iwlagn_dealloc_agg_txq(priv, txq_id);
+            iwlagn_agg_tids_put(priv, sta_id);
+            iwlagn_tx_ba_stop_cb(priv, sta_id, tid, send_delba);
+            break;
+        case IWL_EMPTYING_HW_QUEUE_ADDBA:
+            iwlagn_tx_ba_start_cb(priv, sta_id, tid);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * iwlagn_agg_tids_put - a session that was on is off again. Once none is
+ * left, RTS/CTS protection goes back off if iwlagn_tx_agg_oper turned it on.
+ */
+void IwlDvmOpMode::iwlagn_agg_tids_put(struct iwl_priv *priv, u8 sta_id)
+{
+    struct iwl_link_quality_cmd *lq = priv->stations[sta_id].lq;
+    
+    if (WARN_ON(!priv->agg_tids_count))
+        return;
+    
+    priv->agg_tids_count--;
+    IWL_DEBUG_HT(priv, "priv->agg_tids_count = %u\n", priv->agg_tids_count);
+    
+    if (priv->agg_tids_count || !priv->hw_params.use_rts_for_aggregation || !lq)
+        return;
+    
+    lq->general_params.flags &= ~LINK_QUAL_FLAGS_SET_STA_TLC_RTS_MSK;
+    iwl_send_lq_cmd(priv, &priv->contexts[priv->stations[sta_id].ctxid], lq, CMD_ASYNC, false);
+}
+
+/*
+ * mac80211 agg-tx.c
+ * ieee80211_send_addba_request / ieee80211_send_delba - the action frames of
+ * our TX sessions. Like mac80211's management frames they skip the station
+ * queues.
+ */
+int IwlDvmOpMode::iwlagn_send_ba_action(struct iwl_priv *priv, u8 sta_id, u8 tid, u8 action_code)
+{
+    struct iwl_rxon_context *ctx = &priv->contexts[priv->stations[sta_id].ctxid];
+    struct iwl_ht_agg *agg = &priv->tid_data[sta_id][tid].agg;
+    struct ieee80211_mgmt *mgmt;
+    size_t len = IEEE80211_MIN_ACTION_SIZE;
+    mbuf_t skb;
+    u16 params;
+    int ret;
+    
+    if (action_code == WLAN_ACTION_ADDBA_REQ)
+        len += sizeof(mgmt->u.action.u.addba_req);
+    else
+        len += sizeof(mgmt->u.action.u.delba);
+    
+    if (mbuf_allocpacket(MBUF_DONTWAIT, len, NULL, &skb))
+        return -ENOMEM;
+    
+    mbuf_setlen(skb, len);
+    mbuf_pkthdr_setlen(skb, len);
+    
+    mgmt = (struct ieee80211_mgmt *)mbuf_data(skb);
+    memset(mgmt, 0, len);
+    
+    mgmt->frame_control = cpu_to_le16(IEEE80211_FTYPE_MGMT | IEEE80211_STYPE_ACTION);
+    memcpy(mgmt->da, priv->stations[sta_id].sta.sta.addr, ETH_ALEN);
+    memcpy(mgmt->sa, ctx->active.node_addr, ETH_ALEN);
+    memcpy(mgmt->bssid, ctx->active.bssid_addr, ETH_ALEN);
+    
+    mgmt->u.action.category = WLAN_CATEGORY_BACK;
+    
+    IOSimpleLockLock(priv->sta_lock);
+    
+    if (action_code == WLAN_ACTION_ADDBA_REQ) {
+        mgmt->u.action.u.addba_req.action_code = WLAN_ACTION_ADDBA_REQ;
+        mgmt->u.action.u.addba_req.dialog_token = agg->dialog_token;
+        
+        /* immediate block ack, no A-MSDU in A-MPDU */
+        params = IEEE80211_ADDBA_PARAM_POLICY_MASK;
+        params |= (u16)(tid << 2);
+        params |= (u16)(LINK_QUAL_AGG_FRAME_LIMIT_DEF << 6);
+        
+        mgmt->u.action.u.addba_req.capab = cpu_to_le16(params);
+        mgmt->u.action.u.addba_req.timeout = 0;
+        mgmt->u.action.u.addba_req.start_seq_num = cpu_to_le16(IEEE80211_SN_TO_SEQ(agg->ssn));
+    } else {
+        mgmt->u.action.u.delba.action_code = WLAN_ACTION_DELBA;
+        
+        params = (u16)(WLAN_BACK_INITIATOR << 11);
+        params |= (u16)(tid << 12);
+        
+        mgmt->u.action.u.delba.params = cpu_to_le16(params);
+        mgmt->u.action.u.delba.reason_code = cpu_to_le16(WLAN_REASON_QSTA_NOT_USE);
+    }
+    
+    IOSimpleLockUnlock(priv->sta_lock);
+    
+    ret = iwlagn_tx_skb(priv, skb, sta_id, tid, false);
+    if (ret) {
+        IWL_DEBUG_HT(priv, "BA action %d for sta %d tid %d not sent: %d\n",
+                     action_code, sta_id, tid, ret);
+        mbuf_freem(skb);
+    }
+    
+    return ret;
+}
+
+/*
+ * mac80211 agg-tx.c
+ * ieee80211_start_tx_ba_cb - the session reached IWL_AGG_STARTING, ask the
+ * peer for it. Its ADDBA response goes to iwlagn_process_ba_action.
+ */
+void IwlDvmOpMode::iwlagn_tx_ba_start_cb(struct iwl_priv *priv, u8 sta_id, u8 tid)
+{
+    struct iwl_ht_agg *agg = &priv->tid_data[sta_id][tid].agg;
+    
+    IOSimpleLockLock(priv->sta_lock);
+    /* a new token each time, so a late response to an old request is ignored */
+    if (!++agg->dialog_token)
+        agg->dialog_token = 1;
+    IOSimpleLockUnlock(priv->sta_lock);
+    
+    /* a lost request times out at the peer, mac80211 stops the session then */
+    if (iwlagn_send_ba_action(priv, sta_id, tid, WLAN_ACTION_ADDBA_REQ))
+        iwlagn_tx_agg_stop(priv, sta_id, tid, false);
+}
+
+/*
+ * mac80211 agg-tx.c
+ * ieee80211_stop_tx_ba_cb - the session is off, the TID's frames go out on
+ * its AC queue again
+ */
+void IwlDvmOpMode::iwlagn_tx_ba_stop_cb(struct iwl_priv *priv, u8 sta_id, u8 tid, bool send_delba)
+{
+    if (send_delba)
+        iwlagn_send_ba_action(priv, sta_id, tid, WLAN_ACTION_DELBA);
+    
+    iwl_sta_txq_wake(priv, sta_id, tid);
+}
+
+/*
+ * mac80211 agg-tx.c / agg-rx.c
+ * ieee80211_process_addba_resp / ieee80211_process_delba - act on the frame
+ * rx.c left in ba_action
+ */
+void IwlDvmOpMode::iwlagn_process_ba_action(struct iwl_priv *priv)
+{
+    struct iwl_ba_action *ba = &priv->ba_action;
+    bool starting;
+    u8 buf_size;
+    
+    ba->pending = false;
+    
+    switch (ba->action_code) {
+        case WLAN_ACTION_ADDBA_RESP:
+            IOSimpleLockLock(priv->sta_lock);
+            starting = priv->tid_data[ba->sta_id][ba->tid].agg.state == IWL_AGG_STARTING &&
+                    priv->tid_data[ba->sta_id][ba->tid].agg.dialog_token == ba->dialog_token;
+            IOSimpleLockUnlock(priv->sta_lock);
+            
+            if (!starting) {
+                IWL_DEBUG_HT(priv, "unexpected ADDBA response for sta %d tid %d\n",
+                             ba->sta_id, ba->tid);
+                break;
+            }
+            
+            /* a peer that names no buffer size takes what we asked for */
+            buf_size = ba->buf_size ? min_t(u16, ba->buf_size, LINK_QUAL_AGG_FRAME_LIMIT_DEF)
+                                    : LINK_QUAL_AGG_FRAME_LIMIT_DEF;
+            
+            if (ba->status == WLAN_STATUS_SUCCESS)
+                iwlagn_tx_agg_oper(priv, ba->sta_id, ba->tid, buf_size);
+            else
+                iwlagn_tx_agg_stop(priv, ba->sta_id, ba->tid, false);
+            break;
+        case WLAN_ACTION_DELBA:
+            /* nothing aggregates towards us, only our own sessions can end */
+            if (!ba->initiator)
+                iwlagn_tx_agg_stop(priv, ba->sta_id, ba->tid, false);
+            break;
+        default:
+            break;
+    }
+}
 
 // line 1637
 /* This function both allocates and initializes hw and priv. */
@@ -535,6 +535,118 @@ void iwl_down(struct iwl_priv *priv)
     //priv->beacon_skb = NULL;
 }
 
+/*
+ * iwl_bg_restart - bring the firmware back after an error
+ *
+ * Runs on its own thread, host commands sleep until their response is
+ * handled on the work loop. After iwlagn_prepare_restart() it does what
+ * ieee80211_restart_hw() does for us on Linux: start the device again,
+ * add the interfaces back and wake the queues.
+ */
+void IwlDvmOpMode::iwl_bg_restart(struct iwl_priv *priv)
+{
+    struct iwl_rxon_context *ctx;
+    int ret;
+    
+    if (test_bit(STATUS_EXIT_PENDING, &priv->status))
+        return;
+    
+    if (!test_and_clear_bit(STATUS_FW_ERROR, &priv->status))
+        return;
+    
+    IOLockLock(priv->mutex);
+    iwlagn_prepare_restart(priv);
+    IOLockUnlock(priv->mutex);
+    
+    ret = iwlagn_mac_start(priv);
+    if (ret) {
+        IWL_ERR(priv, "Restart failed: %d\n", ret);
+        return;
+    }
+    
+    for_each_context(priv, ctx) {
+        if (!ctx->vif)
+            continue;
+        ret = iwlagn_mac_add_interface(priv, ctx->vif);
+        if (ret)
+            IWL_ERR(priv, "Failed to add interface %d after restart: %d\n", ctx->ctxid, ret);
+    }
+    
+    priv->transport_queue_stop = 0;
+    priv->hw->queue_stopped = 0;
+    
+    IWL_INFO(priv, "Firmware restarted\n");
+}
+
+void IwlDvmOpMode::restartThread(void *arg, wait_result_t wr)
+{
+    IwlDvmOpMode *me = (IwlDvmOpMode *)arg;
+    
+    me->iwl_bg_restart(me->priv);
+    OSCompareAndSwap(1, 0, &me->restart_pending);
+    thread_terminate(current_thread());
+}
+
+// line 1954
+void IwlDvmOpMode::iwlagn_fw_error(struct iwl_priv *priv, bool ondemand)
+{
+    unsigned long reload_msec;
+    unsigned long reload_jiffies;
+    thread_t thread;
+    
+    /* Set the FW error flag -- cleared on iwl_down */
+    set_bit(STATUS_FW_ERROR, &priv->status);
+    
+    iwl_abort_notification_waits(&priv->notif_wait);
+    
+    /* Keep the restart process from trying to send host
+     * commands by clearing the ready bit */
+    clear_bit(STATUS_READY, &priv->status);
+    
+    if (!ondemand) {
+        /*
+         * If firmware keep reloading, then it indicate something
+         * serious wrong and firmware having problem to recover
+         * from it. Instead of keep trying which will fill the syslog
+         * and hang the system, let's just stop it
+         */
+        reload_jiffies = jiffies;
+        /* HZ is 1000 */
+        reload_msec = reload_jiffies - priv->reload_jiffies;
+        priv->reload_jiffies = reload_jiffies;
+        if (reload_msec <= IWL_MIN_RELOAD_DURATION) {
+            priv->reload_count++;
+            if (priv->reload_count >= IWL_MAX_CONTINUE_RELOAD_CNT) {
+                IWL_ERR(priv, "BUG_ON, Stop restarting\n");
+                return;
+            }
+        } else
+            priv->reload_count = 0;
+    }
+    
+    if (!iwlwifi_mod_params.fw_restart) {
+        IWL_DEBUG_FW(priv, "Detected FW error, but not restarting\n");
+        return;
+    }
+    
+    /* one restart at a time, none once stop() has begun */
+    if (!OSCompareAndSwap(0, 1, &restart_pending))
+        return;
+    if (test_bit(STATUS_EXIT_PENDING, &priv->status)) {
+        restart_pending = 0;
+        return;
+    }
+    
+    IWL_DEBUG_FW(priv, "Restarting adapter due to uCode error.\n");
+    //queue_work(priv->workqueue, &priv->restart);
+    if (kernel_thread_start((thread_continue_t) &IwlDvmOpMode::restartThread, this, &thread) != KERN_SUCCESS) {
+        IWL_ERR(priv, "Failed to start the restart thread\n");
+        restart_pending = 0;
+        return;
+    }
+    thread_deallocate(thread);
+}
+
 
 // line 1112
 static int iwl_init_drv(struct iwl_priv *priv)
@@ -756,9 +868,10 @@ struct iwl_priv *IwlDvmOpMode::iwl_op_mode_dvm_start(struct iwl_trans *trans, co
             trans_cfg.rx_buf_size = IWL_AMSDU_4K;
             break;
         case IWL_AMSDU_8K:
+        case IWL_AMSDU_12K:
+            /* HT A-MSDUs are at most 7935 bytes, they fit in 8K RBs */
             trans_cfg.rx_buf_size = IWL_AMSDU_8K;
             break;
-        case IWL_AMSDU_12K:
         default:
             trans_cfg.rx_buf_size = IWL_AMSDU_4K;
             TraceLog("Unsupported amsdu_size: %d\n", iwlwifi_mod_params.amsdu_size);
@@ -892,6 +1005,16 @@ struct iwl_priv *IwlDvmOpMode::iwl_op_mode_dvm_start(struct iwl_trans *trans, co
         
         priv->queue_stop_count[i] = 0;
     }
+    
+    for (i = 0; i < IEEE80211_NUM_ACS; i++)
+        TAILQ_INIT(&priv->active_txqs[i]);
+    
+    for (i = 0; i < IWLAGN_STATION_COUNT * IWL_MAX_TID_COUNT; i++) {
+        struct iwl_sta_txq *txq = &priv->sta_txq[i / IWL_MAX_TID_COUNT][i % IWL_MAX_TID_COUNT];
+        
+        txq->sta_id = i / IWL_MAX_TID_COUNT;
+        txq->tid = i % IWL_MAX_TID_COUNT;
+    }
 
     if (iwl_init_drv(priv))
         goto out_free_eeprom;
@@ -956,6 +1079,8 @@ void IwlDvmOpMode::iwl_op_mode_dvm_stop(struct iwl_priv* priv)
 //    iwlagn_mac_unregister(priv);
 
     iwl_tt_exit(priv);
+    
+    iwl_sta_txq_free(priv);
 
     iwh_free((void *)priv->eeprom_blob);
     iwh_free(priv->nvm_data);
@@ -978,6 +1103,41 @@ void IwlDvmOpMode::iwl_op_mode_dvm_stop(struct iwl_priv* priv)
     //ieee80211_free_hw(priv->hw);
 }
 
+// line 2041
+void IwlDvmOpMode::iwl_stop_sw_queue(struct iwl_priv *priv, int queue)
+{
+    int mq = priv->queue_to_mac80211[queue];
+    
+    if (WARN_ON_ONCE(mq == IWL_INVALID_MAC80211_QUEUE))
+        return;
+    
+    if (OSIncrementAtomic(&priv->queue_stop_count[mq]) > 0) {
+        IWL_DEBUG_TX_QUEUES(priv, "queue %d (mac80211 %d) already stopped\n", queue, mq);
+        return;
+    }
+    
+    set_bit(mq, &priv->transport_queue_stop);
+    ieee80211_stop_queue(priv->hw, mq);
+}
+
+// line 2059
+void IwlDvmOpMode::iwl_wake_sw_queue(struct iwl_priv *priv, int queue)
+{
+    int mq = priv->queue_to_mac80211[queue];
+    
+    if (WARN_ON_ONCE(mq == IWL_INVALID_MAC80211_QUEUE))
+        return;
+    
+    if (OSDecrementAtomic(&priv->queue_stop_count[mq]) > 1) {
+        IWL_DEBUG_TX_QUEUES(priv, "queue %d (mac80211 %d) still stopped\n", queue, mq);
+        return;
+    }
+    
+    clear_bit(mq, &priv->transport_queue_stop);
+    
+    if (!priv->passive_no_rx)
+        ieee80211_wake_queue(priv->hw, mq);
+}
 
 #define EEPROM_RF_CONFIG_TYPE_MAX      0x3
 
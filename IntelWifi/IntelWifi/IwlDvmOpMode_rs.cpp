@@ -103,3 +103,84 @@ const struct iwl_rate_info iwl_rates[IWL_RATE_COUNT] = {
     /* FIXME:RS:          ^^    should be INV (legacy) */
 };
 
+static int iwl_hwrate_to_plcp_idx(u32 rate_n_flags)
+{
+    int idx = 0;
+    
+    /* HT rate format */
+    if (rate_n_flags & RATE_MCS_HT_MSK) {
+        idx = (rate_n_flags & 0xff);
+        
+        if (idx >= IWL_RATE_MIMO3_6M_PLCP)
+            idx = idx - IWL_RATE_MIMO3_6M_PLCP;
+        else if (idx >= IWL_RATE_MIMO2_6M_PLCP)
+            idx = idx - IWL_RATE_MIMO2_6M_PLCP;
+        
+        idx += IWL_FIRST_OFDM_RATE;
+        /* skip 9M not supported in ht*/
+        if (idx >= IWL_RATE_9M_INDEX)
+            idx += 1;
+        if ((idx >= IWL_FIRST_OFDM_RATE) && (idx <= IWL_LAST_OFDM_RATE))
+            return idx;
+        
+    /* legacy rate format, search for match in table */
+    } else {
+        for (idx = 0; idx < ARRAY_SIZE(iwl_rates); idx++)
+            if (iwl_rates[idx].plcp == (rate_n_flags & 0xFF))
+                return idx;
+    }
+    
+    return -1;
+}
+
+/*
+ * expected_tpt should contain the expected throughput for each rate,
+ * they are used by rate scaling and the airtime scheduler.
+ */
+static const u16 expected_tpt_legacy[IWL_RATE_COUNT] = {
+    7, 13, 35, 58, 40, 57, 72, 98, 121, 154, 177, 186, 0
+};
+
+static const u16 expected_tpt_siso20MHz[4][IWL_RATE_COUNT] = {
+    {0, 0, 0, 0, 42, 0,  76, 102, 124, 159, 183, 193, 202}, /* Norm */
+    {0, 0, 0, 0, 46, 0,  82, 110, 132, 168, 192, 202, 210}, /* SGI */
+    {0, 0, 0, 0, 47, 0,  91, 133, 171, 242, 305, 334, 362}, /* AGG */
+    {0, 0, 0, 0, 52, 0, 101, 145, 187, 264, 330, 361, 390}, /* AGG+SGI */
+};
+
+/*
+ * Airtime a frame of len bytes takes to reach a station, in
+ * IWL_AIRTIME_SHIFT units. Rate scaling is not ported yet, so the rate
+ * comes from the first entry of the station's link quality command and
+ * HT rates use the 20 MHz SISO table; that underestimates MIMO and 40 MHz
+ * links, it doesn't change their order.
+ */
+u32 IwlDvmOpMode::iwl_rs_expected_airtime(struct iwl_priv *priv, u8 sta_id, u8 tid, u32 len)
+{
+    const u16 *tpt = expected_tpt_legacy;
+    u32 rate_n_flags = 0;
+    u16 expected;
+    int idx;
+    
+    IOSimpleLockLock(priv->sta_lock);
+    if (priv->stations[sta_id].lq)
+        rate_n_flags = le32_to_cpu(priv->stations[sta_id].lq->rs_table[0].rate_n_flags);
+    IOSimpleLockUnlock(priv->sta_lock);
+    
+    if (rate_n_flags & RATE_MCS_HT_MSK) {
+        int row = (rate_n_flags & RATE_MCS_SGI_MSK) ? 1 : 0;
+        
+        if (tid < IWL_MAX_TID_COUNT && priv->tid_data[sta_id][tid].agg.state == IWL_AGG_ON)
+            row += 2;
+        tpt = expected_tpt_siso20MHz[row];
+    }
+    
+    idx = iwl_hwrate_to_plcp_idx(rate_n_flags);
+    expected = idx < 0 ? 0 : tpt[idx];
+    /* no usable rate yet, charge it like the lowest OFDM rate */
+    if (!expected)
+        expected = expected_tpt_legacy[IWL_RATE_6M_INDEX];
+    
+    return (len << IWL_AIRTIME_SHIFT) / expected;
+}
+
@@ -43,6 +43,7 @@ extern "C" {
 }
 
 #include <sys/kpi_mbuf.h>
+#include <net/ethernet.h>
 #include <IOKit/network/IOEthernetController.h>
 #include <IOKit/IOCommandGate.h>
 
@@ -609,6 +610,188 @@ static int iwlagn_set_decrypted_flag(struct iwl_priv *priv,
     return 0;
 }
 
+const u8 iwlagn_rfc1042_header[] = { 0xaa, 0xaa, 0x03, 0x00, 0x00, 0x00 };
+const u8 iwlagn_bridge_tunnel_header[] = { 0xaa, 0xaa, 0x03, 0x00, 0x00, 0xf8 };
+
+/*
+ * iwlagn_rx_msdu_input - convert an MSDU to an Ethernet frame in place
+ *
+ * The Ethernet header is built right before the ethertype of the SNAP header,
+ * so the payload is never moved and the frame is passed up from the RB page.
+ * @da and @sa may overlap the new header and are copied out first.
+ */
+static void iwlagn_rx_msdu_input(struct iwl_priv *priv, struct iwl_rx_cmd_buffer *rxb,
+                                 const u8 *da, const u8 *sa, u8 *payload, u16 len)
+{
+    struct ether_header *eh;
+    u8 addrs[2 * ETH_ALEN];
+    
+    if (len < IWLAGN_SNAP_LEN ||
+        (memcmp(payload, iwlagn_rfc1042_header, sizeof(iwlagn_rfc1042_header)) &&
+         memcmp(payload, iwlagn_bridge_tunnel_header, sizeof(iwlagn_bridge_tunnel_header)))) {
+        IWL_DEBUG_DROP(priv, "Dropping frame without SNAP header\n");
+        return;
+    }
+    
+    memcpy(addrs, da, ETH_ALEN);
+    memcpy(addrs + ETH_ALEN, sa, ETH_ALEN);
+    
+    eh = (struct ether_header *)(payload + IWLAGN_SNAP_LEN - ETHER_HDR_LEN);
+    memcpy(eh, addrs, sizeof(addrs));
+    
+    if (iwl_trans_rxb_input(priv->trans, rxb, eh, len - IWLAGN_SNAP_LEN + ETHER_HDR_LEN))
+        IWL_DEBUG_DROP(priv, "Dropping frame, interface is down\n");
+}
+
+/*
+ * iwlagn_rx_amsdu_input - pass every subframe of an A-MSDU up
+ */
+static void iwlagn_rx_amsdu_input(struct iwl_priv *priv, struct iwl_rx_cmd_buffer *rxb,
+                                  u8 *data, u16 len)
+{
+    while (len >= ETHER_HDR_LEN) {
+        struct ether_header *sub = (struct ether_header *)data;
+        u16 sub_len = be16_to_cpu(sub->ether_type);
+        u16 padded;
+        
+        if (ETHER_HDR_LEN + sub_len > len) {
+            IWL_DEBUG_DROP(priv, "Dropping truncated A-MSDU subframe\n");
+            return;
+        }
+        
+        iwlagn_rx_msdu_input(priv, rxb, sub->ether_dhost, sub->ether_shost,
+                             data + ETHER_HDR_LEN, sub_len);
+        
+        /* subframes are padded to a multiple of 4 bytes */
+        padded = ALIGN(ETHER_HDR_LEN + sub_len, 4);
+        if (padded >= len)
+            break;
+        data += padded;
+        len -= padded;
+    }
+}
+
+/*
+ * iwlagn_rx_data_input - strip the 802.11 header of a data frame and pass
+ * the payload to the network stack
+ */
+static void iwlagn_rx_data_input(struct iwl_priv *priv, struct ieee80211_hdr *hdr, u16 len,
+                                 u32 ampdu_status, struct iwl_rx_cmd_buffer *rxb,
+                                 struct ieee80211_rx_status *stats)
+{
+    __le16 fc = hdr->frame_control;
+    unsigned int hdrlen = offsetof(struct ieee80211_hdr, addr4);
+    const u8 *da, *sa;
+    bool amsdu = false;
+    
+    if (ieee80211_has_a4(fc))
+        hdrlen += ETH_ALEN;
+    if (len < hdrlen)
+        return;
+    
+    if (ieee80211_is_data_qos(fc)) {
+        u8 *qc = (u8 *)hdr + hdrlen;
+        
+        /* the QoS control field must be in the frame before it is read */
+        if (len < hdrlen + IEEE80211_QOS_CTL_LEN)
+            return;
+        amsdu = qc[0] & IEEE80211_QOS_CTL_A_MSDU_PRESENT;
+        hdrlen += IEEE80211_QOS_CTL_LEN;
+        if (ieee80211_has_order(fc))
+            hdrlen += IEEE80211_HT_CTL_LEN;
+    }
+    
+    if (ieee80211_has_protected(fc)) {
+        /* Only frames decrypted by the device can be passed up */
+        if (!(stats->flag & RX_FLAG_DECRYPTED) ||
+            (ampdu_status & RX_RES_STATUS_SEC_TYPE_MSK) != RX_RES_STATUS_SEC_TYPE_CCMP) {
+            IWL_DEBUG_DROP(priv, "Dropping frame not decrypted by HW\n");
+            return;
+        }
+        if (len < hdrlen + IEEE80211_CCMP_HDR_LEN + IEEE80211_CCMP_MIC_LEN)
+            return;
+        hdrlen += IEEE80211_CCMP_HDR_LEN;
+        len -= IEEE80211_CCMP_MIC_LEN;
+    }
+    
+    if (len <= hdrlen)
+        return;
+    
+    da = ieee80211_has_tods(fc) ? hdr->addr3 : hdr->addr1;
+    if (!ieee80211_has_fromds(fc))
+        sa = hdr->addr2;
+    else
+        sa = ieee80211_has_a4(fc) ? hdr->addr4 : hdr->addr3;
+    
+    if (amsdu)
+        iwlagn_rx_amsdu_input(priv, rxb, (u8 *)hdr + hdrlen, len - hdrlen);
+    else
+        iwlagn_rx_msdu_input(priv, rxb, da, sa, (u8 *)hdr + hdrlen, len - hdrlen);
+}
+
+/*
+ * mac80211 rx.c
+ * ieee80211_rx_h_action, for the block ack frames of our TX sessions. The
+ * op mode acts on them in iwlagn_process_ba_action once the RX handler
+ * returned, mac80211 too defers them to its interface work.
+ */
+static void iwlagn_rx_back_action(struct iwl_priv *priv, struct ieee80211_mgmt *mgmt, u16 len)
+{
+    struct iwl_ba_action ba = {};
+    u16 params;
+    int i;
+    
+    if (len < IEEE80211_MIN_ACTION_SIZE + 1 || mgmt->u.action.category != WLAN_CATEGORY_BACK)
+        return;
+    
+    ba.action_code = mgmt->u.action.u.addba_resp.action_code;
+    
+    switch (ba.action_code) {
+        case WLAN_ACTION_ADDBA_RESP:
+            if (len < IEEE80211_MIN_ACTION_SIZE + sizeof(mgmt->u.action.u.addba_resp))
+                return;
+            params = le16_to_cpu(mgmt->u.action.u.addba_resp.capab);
+            ba.tid = (params & IEEE80211_ADDBA_PARAM_TID_MASK) >> 2;
+            ba.buf_size = (params & IEEE80211_ADDBA_PARAM_BUF_SIZE_MASK) >> 6;
+            ba.dialog_token = mgmt->u.action.u.addba_resp.dialog_token;
+            ba.status = le16_to_cpu(mgmt->u.action.u.addba_resp.status);
+            break;
+        case WLAN_ACTION_DELBA:
+            if (len < IEEE80211_MIN_ACTION_SIZE + sizeof(mgmt->u.action.u.delba))
+                return;
+            params = le16_to_cpu(mgmt->u.action.u.delba.params);
+            ba.tid = (params & IEEE80211_DELBA_PARAM_TID_MASK) >> 12;
+            ba.initiator = (params & IEEE80211_DELBA_PARAM_INITIATOR_MASK) >> 11;
+            break;
+        default:
+            /* nothing aggregates towards us, a peer's ADDBA request times out */
+            return;
+    }
+    
+    if (ba.tid >= IWL_MAX_TID_COUNT)
+        return;
+    
+    ba.sta_id = IWL_INVALID_STATION;
+    
+    IOSimpleLockLock(priv->sta_lock);
+    for (i = 0; i < IWLAGN_STATION_COUNT; i++) {
+        if ((priv->stations[i].used & IWL_STA_DRIVER_ACTIVE) &&
+            ether_addr_equal(priv->stations[i].sta.sta.addr, mgmt->sa)) {
+            ba.sta_id = i;
+            break;
+        }
+    }
+    IOSimpleLockUnlock(priv->sta_lock);
+    
+    if (ba.sta_id == IWL_INVALID_STATION) {
+        IWL_DEBUG_HT(priv, "BA action from unknown station %pM\n", mgmt->sa);
+        return;
+    }
+    
+    ba.pending = true;
+    priv->ba_action = ba;
+}
+
 // line 622
 static void iwlagn_pass_packet_to_mac80211(struct iwl_priv *priv,
                                            struct ieee80211_hdr *hdr,
@@ -641,7 +824,13 @@ static void iwlagn_pass_packet_to_mac80211(struct iwl_priv *priv,
             IWL_DEBUG_RX(priv, "BEACON => FC: 0x%x; SC: 0x%x; Duration ID: %d; SSID: %d %s(%d)",
                          mgmt->frame_control, mgmt->seq_ctrl, mgmt->duration, ssid_el_id, ssid, ssid_len);
         }
+        
+        if (ieee80211_is_action(hdr->frame_control))
+            iwlagn_rx_back_action(priv, (struct ieee80211_mgmt *)hdr, len);
     }
+    
+    if (ieee80211_is_data_present(hdr->frame_control))
+        iwlagn_rx_data_input(priv, hdr, len, ampdu_status, rxb, stats);
 }
 
 
@@ -922,10 +1111,7 @@ void iwl_setup_rx_handlers(struct iwl_priv *priv)
     handlers[REPLY_RX_PHY_CMD] = iwlagn_rx_reply_rx_phy;
     handlers[REPLY_RX_MPDU_CMD] = iwlagn_rx_reply_rx;
 
-    /* block ack */
-    ///handlers[REPLY_COMPRESSED_BA] = iwlagn_rx_reply_compressed_ba;
-
-//    priv->rx_handlers[REPLY_TX] = iwlagn_rx_reply_tx;
+    /* block ack and REPLY_TX go to IwlDvmOpMode::rx, they need the transport */
 
     /* set up notification wait support */
     iwl_notification_wait_init(&priv->notif_wait);
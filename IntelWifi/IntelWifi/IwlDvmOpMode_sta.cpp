@@ -495,6 +495,9 @@ int iwl_remove_station(struct iwl_priv *priv, const u8 sta_id, const u8 *addr)
     if (WARN_ON(sta_id == IWL_INVALID_STATION))
         return -EINVAL;
     
+    /* the frames still queued for it have nowhere to go */
+    iwl_sta_txq_flush(priv, sta_id);
+    
     //IOSimpleLockLock(priv->sta_lock);
     
     if (!(priv->stations[sta_id].used & IWL_STA_DRIVER_ACTIVE)) {
@@ -545,6 +548,8 @@ void iwl_deactivate_station(struct iwl_priv *priv, const u8 sta_id, const u8 *ad
     if (WARN_ON_ONCE(sta_id == IWL_INVALID_STATION))
         return;
     
+    iwl_sta_txq_flush(priv, sta_id);
+    
     //IOSimpleLockLock(priv->sta_lock);
     
     //WARN_ON_ONCE(!(priv->stations[sta_id].used & IWL_STA_DRIVER_ACTIVE));
@@ -643,23 +648,35 @@ void iwl_clear_ucode_stations(struct iwl_priv *priv, struct iwl_rxon_context *ct
         IWL_DEBUG_INFO(priv, "No active stations found to be cleared\n");
 }
 
+static bool is_lq_table_valid(struct iwl_priv *priv, struct iwl_rxon_context *ctx, struct iwl_link_quality_cmd *lq);
+
+/* the ADD_STA and LQ commands of a station restore, one batch each */
+struct iwl_restore_batch {
+    struct iwl_host_cmd sta_cmds[IWLAGN_STATION_COUNT];
+    struct iwl_host_cmd lq_cmds[IWLAGN_STATION_COUNT];
+    struct iwl_link_quality_cmd lq[IWLAGN_STATION_COUNT];
+    u8 sta_ids[IWLAGN_STATION_COUNT];
+    int status[IWLAGN_STATION_COUNT];
+};
+
 /** line 654
  * iwl_restore_stations() - Restore driver known stations to device
  *
  * All stations considered active by driver, but not present in ucode, is
- * restored.
+ * restored. All their ADD_STA commands go out as one batch, then the LQ
+ * commands of the stations that were added as another.
  *
  * Function sleeps.
  */
 void iwl_restore_stations(struct iwl_priv *priv, struct iwl_rxon_context *ctx)
 {
-    struct iwl_addsta_cmd sta_cmd;
     static const struct iwl_link_quality_cmd zero_lq = {};
-    struct iwl_link_quality_cmd lq;
-    int i;
+    struct iwl_restore_batch *b;
+    struct iwl_add_sta_resp *add_sta_resp;
+    int i, n, n_lq;
     bool found = false;
-    int ret;
-    bool send_lq;
+    
+    BUILD_BUG_ON(IWLAGN_STATION_COUNT > IWL_HCMD_BATCH_MAX);
     
     if (!iwl_is_ready(priv)) {
         IWL_DEBUG_INFO(priv, "Not ready yet, not restoring any stations.\n");
@@ -679,44 +696,90 @@ void iwl_restore_stations(struct iwl_priv *priv, struct iwl_rxon_context *ctx)
         }
     }
     
-    for (i = 0; i < IWLAGN_STATION_COUNT; i++) {
-        if ((priv->stations[i].used & IWL_STA_UCODE_INPROGRESS)) {
-            memcpy(&sta_cmd, &priv->stations[i].sta, sizeof(struct iwl_addsta_cmd));
-            send_lq = false;
-            if (priv->stations[i].lq) {
-                if (priv->wowlan)
-                    iwl_sta_fill_lq(priv, ctx, i, &lq);
-                else
-                    memcpy(&lq, priv->stations[i].lq, sizeof(struct iwl_link_quality_cmd));
-                
-                if (memcmp(&lq, &zero_lq, sizeof(lq)))
-                    send_lq = true;
-            }
-            //IOSimpleLockUnlock(priv->sta_lock);
-            ret = iwl_send_add_sta(priv, &sta_cmd, 0);
-            if (ret) {
-                //IOSimpleLockLock(priv->sta_lock);
-                IWL_ERR(priv, "Adding station " MAC_FMT " failed.\n", MAC_BYTES(priv->stations[i].sta.sta.addr));
-                priv->stations[i].used &= ~IWL_STA_DRIVER_ACTIVE;
-                priv->stations[i].used &= ~IWL_STA_UCODE_INPROGRESS;
-                continue;
-            }
-            /*
-             * Rate scaling has already been initialized, send
-             * current LQ command
-             */
-            if (send_lq)
-                iwl_send_lq_cmd(priv, ctx, &lq, 0, true);
-            //IOSimpleLockLock(priv->sta_lock);
+    if (!found) {
+        IWL_DEBUG_INFO(priv, "Restoring all known stations .... no stations to be restored.\n");
+        return;
+    }
+    
+    b = (struct iwl_restore_batch *)iwh_zalloc(sizeof(*b));
+    if (!b) {
+        IWL_ERR(priv, "Unable to allocate memory for restoring stations.\n");
+        for (i = 0; i < IWLAGN_STATION_COUNT; i++)
             priv->stations[i].used &= ~IWL_STA_UCODE_INPROGRESS;
+        return;
+    }
+    
+    /* the commands are copied when they are queued, point at the table */
+    n = 0;
+    for (i = 0; i < IWLAGN_STATION_COUNT; i++) {
+        if (!(priv->stations[i].used & IWL_STA_UCODE_INPROGRESS))
+            continue;
+        b->sta_ids[n] = i;
+        b->sta_cmds[n].id = REPLY_ADD_STA;
+        b->sta_cmds[n].flags = CMD_WANT_SKB;
+        b->sta_cmds[n].data[0] = &priv->stations[i].sta;
+        b->sta_cmds[n].len[0] = sizeof(struct iwl_addsta_cmd);
+        n++;
+    }
+    //IOSimpleLockUnlock(priv->sta_lock);
+    
+    iwl_dvm_send_cmd_batch(priv, b->sta_cmds, n, b->status);
+    
+    n_lq = 0;
+    for (i = 0; i < n; i++) {
+        u8 sta_id = b->sta_ids[i];
+        struct iwl_link_quality_cmd *lq = &b->lq[n_lq];
+        
+        if (!b->status[i]) {
+            add_sta_resp = (struct iwl_add_sta_resp *)b->sta_cmds[i].resp_pkt->data;
+            
+            /* debug messages are printed in the handler */
+            if (add_sta_resp->status == ADD_STA_SUCCESS_MSK)
+                iwl_sta_ucode_activate(priv, sta_id);
+            else
+                b->status[i] = -EIO;
+            iwl_free_resp(&b->sta_cmds[i]);
         }
+        
+        if (b->status[i]) {
+            IWL_ERR(priv, "Adding station " MAC_FMT " failed.\n", MAC_BYTES(priv->stations[sta_id].sta.sta.addr));
+            priv->stations[sta_id].used &= ~IWL_STA_DRIVER_ACTIVE;
+            priv->stations[sta_id].used &= ~IWL_STA_UCODE_INPROGRESS;
+            continue;
+        }
+        
+        /*
+         * Rate scaling has already been initialized, send
+         * current LQ command
+         */
+        if (!priv->stations[sta_id].lq)
+            continue;
+        
+        if (priv->wowlan)
+            iwl_sta_fill_lq(priv, ctx, sta_id, lq);
+        else
+            memcpy(lq, priv->stations[sta_id].lq, sizeof(struct iwl_link_quality_cmd));
+        
+        if (!memcmp(lq, &zero_lq, sizeof(*lq)) || !is_lq_table_valid(priv, ctx, lq))
+            continue;
+        
+        b->lq_cmds[n_lq].id = REPLY_TX_LINK_QUALITY_CMD;
+        b->lq_cmds[n_lq].data[0] = lq;
+        b->lq_cmds[n_lq].len[0] = sizeof(struct iwl_link_quality_cmd);
+        n_lq++;
     }
     
+    if (n_lq)
+        iwl_dvm_send_cmd_batch(priv, b->lq_cmds, n_lq, b->status);
+    
+    //IOSimpleLockLock(priv->sta_lock);
+    for (i = 0; i < n; i++)
+        priv->stations[b->sta_ids[i]].used &= ~IWL_STA_UCODE_INPROGRESS;
     //IOSimpleLockUnlock(priv->sta_lock);
-    if (!found)
-        IWL_DEBUG_INFO(priv, "Restoring all known stations .... no stations to be restored.\n");
-    else
-        IWL_DEBUG_INFO(priv, "Restoring all known stations .... complete.\n");
+    
+    iwh_free(b);
+    
+    IWL_DEBUG_INFO(priv, "Restoring all known stations .... complete.\n");
 }
 
 // line 740
@@ -1293,3 +1356,22 @@ int iwl_update_bcast_station(struct iwl_priv *priv, struct iwl_rxon_context *ctx
     return 0;
 }
 
+/*
+ * iwl_sta_tx_modify_enable_tid - let the firmware send on a TID that is
+ * getting an aggregation session
+ */
+int iwl_sta_tx_modify_enable_tid(struct iwl_priv *priv, int sta_id, int tid)
+{
+    struct iwl_addsta_cmd sta_cmd;
+    
+    //lockdep_assert_held(&priv->mutex);
+    
+    /* Remove "disable" flag, to enable Tx for this TID */
+    IOSimpleLockLock(priv->sta_lock);
+    priv->stations[sta_id].sta.tid_disable_tx &= cpu_to_le16(~(1 << tid));
+    priv->stations[sta_id].sta.mode = STA_CONTROL_MODIFY_MSK;
+    memcpy(&sta_cmd, &priv->stations[sta_id].sta, sizeof(struct iwl_addsta_cmd));
+    IOSimpleLockUnlock(priv->sta_lock);
+    
+    return iwl_send_add_sta(priv, &sta_cmd, 0);
+}
@@ -11,6 +11,8 @@
 
 #include "IwlTransOps.h"
 
+#include <sys/kpi_mbuf.h>
+
 extern "C" {
 #include "iwl-trans.h"
 }
@@ -26,22 +28,37 @@ public:
     virtual void nic_config(struct iwl_priv *priv) = 0;
     virtual void stop(struct iwl_priv *priv) = 0;
     virtual void rx(struct iwl_priv *priv, struct napi_struct *napi, struct iwl_rx_cmd_buffer *rxb) = 0;
+    /*
+     * data queue RX notifications, op modes without RSS handle them like rx.
+     * Called with fWorkLoop's gate held, so never concurrently with rx.
+     */
+    virtual void rx_rss(struct iwl_priv *priv, struct napi_struct *napi,
+                        struct iwl_rx_cmd_buffer *rxb, unsigned int queue) {
+        rx(priv, napi, rxb);
+    }
     
     virtual void scan() = 0;
+    /*
+     * mac80211 tx, ac is one of IEEE80211_AC_*; a non zero return leaves m
+     * with the caller. more says another frame of this AC follows right
+     * away (xmit_more), the op mode may hold the doorbell for it.
+     */
+    virtual int tx(struct iwl_priv *priv, mbuf_t m, u8 ac, bool more) = 0;
+    /* frames taken by tx and lost on the way since the last call */
+    virtual u32 tx_drops(struct iwl_priv *priv) = 0;
     
     
     virtual void add_interface(struct ieee80211_vif *vif) = 0;
     virtual void channel_switch(struct iwl_priv *priv, struct ieee80211_vif *vif, struct ieee80211_channel_switch *chsw) = 0;
 
-//    void (*rx_rss)(struct iwl_op_mode *op_mode, struct napi_struct *napi,
-//                   struct iwl_rx_cmd_buffer *rxb, unsigned int queue);
 //    void (*async_cb)(struct iwl_op_mode *op_mode,
 //                     const struct iwl_device_cmd *cmd);
-//    void (*queue_full)(struct iwl_op_mode *op_mode, int queue);
-//    void (*queue_not_full)(struct iwl_op_mode *op_mode, int queue);
+    virtual void queue_full(struct iwl_priv *priv, int queue) = 0;
+    virtual void queue_not_full(struct iwl_priv *priv, int queue) = 0;
 //    bool (*hw_rf_kill)(struct iwl_op_mode *op_mode, bool state);
 //    void (*free_skb)(struct iwl_op_mode *op_mode, struct sk_buff *skb);
-//    void (*nic_error)(struct iwl_op_mode *op_mode);
+    /* the firmware died, called once per error from the transport */
+    virtual void nic_error(struct iwl_priv *priv) = 0;
 //    void (*cmd_queue_full)(struct iwl_op_mode *op_mode);
 //    void (*nic_config)(struct iwl_op_mode *op_mode);
 //    void (*wimax_active)(struct iwl_op_mode *op_mode);
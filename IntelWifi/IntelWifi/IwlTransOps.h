@@ -10,6 +10,7 @@
 #define IwlTransOps_h
 
 #include <linux/types.h>
+#include <sys/kpi_mbuf.h>
 
 #include "iwl-trans.h"
 
@@ -21,6 +22,16 @@ public:
     virtual void configure(struct iwl_trans *trans, const struct iwl_trans_config *trans_cfg) = 0;
     virtual void stop_device(struct iwl_trans *trans, bool low_power) = 0;
     virtual int start_fw(struct iwl_trans *trans, const struct fw_img *fw, bool run_in_rfkill) = 0;
+    /*
+     * 0 once the transport owns the frame and the TX command, -ENOSPC when
+     * it is out of room and both stay with the op mode until the queue
+     * wakes, another negative error otherwise. With @more the write pointer
+     * isn't published, tx_push does that once the burst is over.
+     */
+    virtual int tx(struct iwl_trans *trans, mbuf_t skb, struct iwl_device_cmd *dev_cmd, int queue, bool more) = 0;
+    virtual void tx_push(struct iwl_trans *trans, int queue) = 0;
+    /* the freed frames come back chained through their nextpkt pointers */
+    virtual void reclaim(struct iwl_trans *trans, int queue, int ssn, mbuf_t *skbs) = 0;
     
     
 //    int (*start_fw)(struct iwl_trans *trans, const struct fw_img *fw,
@@ -36,11 +47,6 @@ public:
 //
 //    int (*send_cmd)(struct iwl_trans *trans, struct iwl_host_cmd *cmd);
 //
-//    int (*tx)(struct iwl_trans *trans, struct sk_buff *skb,
-//              struct iwl_device_cmd *dev_cmd, int queue);
-//    void (*reclaim)(struct iwl_trans *trans, int queue, int ssn,
-//                    struct sk_buff_head *skbs);
-//
 //    bool (*txq_enable)(struct iwl_trans *trans, int queue, u16 ssn,
 //                       const struct iwl_trans_txq_scd_cfg *cfg,
 //                       unsigned int queue_wdg_timeout);
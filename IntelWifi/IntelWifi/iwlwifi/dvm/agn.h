@@ -121,7 +121,6 @@ static inline void iwl_set_calib_hdr(struct iwl_calib_hdr *hdr, u8 cmd)
 
 void iwl_down(struct iwl_priv *priv);
 //void iwl_cancel_deferred_work(struct iwl_priv *priv);
-//void iwlagn_prepare_restart(struct iwl_priv *priv);
 void iwl_rx_dispatch(struct iwl_priv* priv, struct napi_struct *napi, struct iwl_rx_cmd_buffer *rxb);
 //
 //bool iwl_check_for_ct_kill(struct iwl_priv *priv);
@@ -135,6 +134,8 @@ int iwlagn_mac_setup_register(struct iwl_priv *priv, const struct iwl_ucode_capa
 //
 ///* commands */
 int iwl_dvm_send_cmd(struct iwl_priv *priv, struct iwl_host_cmd *cmd);
+int iwl_dvm_send_cmd_batch(struct iwl_priv *priv, struct iwl_host_cmd *cmds,
+			   int n, int *status);
 int iwl_dvm_send_cmd_pdu(struct iwl_priv *priv, u8 id, u32 flags, u16 len, const void *data);
 //
 ///* RXON */
@@ -172,7 +173,7 @@ void iwl_calib_free_results(struct iwl_priv *priv);
 ///* lib */
 int iwlagn_send_tx_power(struct iwl_priv *priv);
 void iwlagn_temperature(struct iwl_priv *priv);
-//int iwlagn_txfifo_flush(struct iwl_priv *priv, u32 scd_q_msk);
+int iwlagn_txfifo_flush(struct iwl_priv *priv, u32 scd_q_msk, u32 flags);
 //void iwlagn_dev_txfifo_flush(struct iwl_priv *priv);
 //int iwlagn_send_beacon_cmd(struct iwl_priv *priv);
 int iwl_send_statistics_request(struct iwl_priv *priv, u8 flags, bool clear);
@@ -194,6 +195,11 @@ int iwlagn_hwrate_to_mac80211_idx(u32 rate_n_flags, enum nl80211_band band);
 void iwl_setup_rx_handlers(struct iwl_priv *priv);
 void iwl_chswitch_done(struct iwl_priv *priv, bool is_success);
 
+/* LLC/SNAP headers which take the place of the Ethernet header */
+extern const u8 iwlagn_rfc1042_header[6];
+extern const u8 iwlagn_bridge_tunnel_header[6];
+#define IWLAGN_SNAP_LEN (sizeof(iwlagn_rfc1042_header) + sizeof(u16))
+
 
 /* tx */
 //int iwlagn_tx_skb(struct iwl_priv *priv,
@@ -308,6 +314,7 @@ int iwl_add_station_common(struct iwl_priv *priv, struct iwl_rxon_context *ctx,
 int iwl_remove_station(struct iwl_priv *priv, const u8 sta_id, const u8 *addr);
 //void iwl_deactivate_station(struct iwl_priv *priv, const u8 sta_id,
 //                const u8 *addr);
+void iwl_sta_txq_flush(struct iwl_priv *priv, u8 sta_id);
 u8 iwl_prep_station(struct iwl_priv *priv, struct iwl_rxon_context *ctx,
             const u8 *addr, bool is_ap, struct ieee80211_sta *sta);
 
@@ -339,7 +346,7 @@ int iwl_remove_dynamic_key(struct iwl_priv *priv, struct iwl_rxon_context *ctx,
                            struct ieee80211_sta *sta);
 void iwl_update_tkip_key(struct iwl_priv *priv, struct ieee80211_vif *vif, struct ieee80211_key_conf *keyconf,
                          struct ieee80211_sta *sta, u32 iv32, u16 *phase1key);
-//int iwl_sta_tx_modify_enable_tid(struct iwl_priv *priv, int sta_id, int tid);
+int iwl_sta_tx_modify_enable_tid(struct iwl_priv *priv, int sta_id, int tid);
 //int iwl_sta_rx_agg_start(struct iwl_priv *priv, struct ieee80211_sta *sta,
 //             int tid, u16 ssn);
 //int iwl_sta_rx_agg_stop(struct iwl_priv *priv, struct ieee80211_sta *sta,
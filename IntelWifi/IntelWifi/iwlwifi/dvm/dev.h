@@ -32,6 +32,7 @@
 #define __iwl_dev_h__
 
 #include <linux/mac80211.h>
+#include <sys/kpi_mbuf.h>
 
 //#include <linux/interrupt.h>
 //#include <linux/kernel.h>
@@ -163,6 +164,8 @@ enum iwl_agg_state {
  *	Basically when next_reclaimed reaches ssn, we can tell mac80211 that
  *	we are ready to finish the Tx AGG stop / start flow.
  * @wait_for_ba: Expect block-ack before next Tx reply
+ * @dialog_token: token of the last ADDBA request, the response must match it
+ * @send_delba: we stopped the session, the peer gets a DELBA once it is off
  */
 struct iwl_ht_agg {
 	u32 rate_n_flags;
@@ -170,6 +173,34 @@ struct iwl_ht_agg {
 	u16 txq_id;
 	u16 ssn;
 	bool wait_for_ba;
+	u8 dialog_token;
+	bool send_delba;
+};
+
+/**
+ * struct iwl_ba_action - block ack action frame from a peer
+
+ * The RX handler only parses it, the aggregation state machine acts on it
+ * once the handler returned.
+
+ * @pending: not acted on yet
+ * @action_code: WLAN_ACTION_ADDBA_RESP or WLAN_ACTION_DELBA
+ * @sta_id: station the frame came from
+ * @tid: TID of the session
+ * @dialog_token: ADDBA response only, token of the request it answers
+ * @status: ADDBA response only, WLAN_STATUS_*
+ * @buf_size: ADDBA response only, the peer's reorder buffer size
+ * @initiator: DELBA only, the peer ends a session it initiated
+ */
+struct iwl_ba_action {
+	bool pending;
+	u8 action_code;
+	u8 sta_id;
+	u8 tid;
+	u8 dialog_token;
+	u16 status;
+	u16 buf_size;
+	bool initiator;
 };
 
 /**
@@ -188,6 +219,54 @@ struct iwl_tid_data {
 	struct iwl_ht_agg agg;
 };
 
+/* frames a station/TID queue holds before tail dropping */
+#define IWL_STA_TXQ_LEN		64
+/* airtime is charged as (bytes << IWL_AIRTIME_SHIFT) / expected_tpt */
+#define IWL_AIRTIME_SHIFT	8
+/* DRR quantum, one 1500 byte frame at 6 Mbps */
+#define IWL_AIRTIME_QUANTUM	9600
+/* CoDel target and interval, in ns */
+#define IWL_CODEL_TARGET	(5 * NSEC_PER_MSEC)
+#define IWL_CODEL_INTERVAL	(100 * NSEC_PER_MSEC)
+
+/**
+ * struct iwl_sta_txq - software TX queue of one station/TID
+ *
+ * Frames wait here until the airtime scheduler hands them to the hardware
+ * queue of their AC. Only used from the controller work loop.
+ *
+ * @frames: ring of frames with the time (ns) they were queued
+ * @head: oldest frame in @frames
+ * @len: number of frames in @frames
+ * @sta_id: station the frames go to
+ * @tid: TID of the frames
+ * @scheduled: the queue is on priv->active_txqs
+ * @deficit: airtime the queue may still use in this DRR round
+ * @first_above_time: when the sojourn time went over target for good
+ * @drop_next: next CoDel drop
+ * @drop_count: drops in the current dropping state
+ * @dropping: CoDel is in dropping state
+ * @drops: frames dropped by CoDel or for lack of room
+ */
+struct iwl_sta_txq {
+	struct {
+		mbuf_t skb;
+		u64 time;
+	} frames[IWL_STA_TXQ_LEN];
+	int head;
+	int len;
+	u8 sta_id;
+	u8 tid;
+	bool scheduled;
+	s32 deficit;
+	u64 first_above_time;
+	u64 drop_next;
+	u32 drop_count;
+	bool dropping;
+	u32 drops;
+	TAILQ_ENTRY(iwl_sta_txq) list;
+};
+
 /*
  * Structure should be accessed with sta_lock held. When station addition
  * is in progress (IWL_STA_UCODE_INPROGRESS) it is possible to access only
@@ -770,6 +849,13 @@ struct iwl_priv {
 	struct iwl_station_entry stations[IWLAGN_STATION_COUNT];
 	unsigned long ucode_key_table;
 	struct iwl_tid_data tid_data[IWLAGN_STATION_COUNT][IWL_MAX_TID_COUNT];
+	/* airtime fair TX scheduling, one queue per station/TID for the driver's life */
+	struct iwl_sta_txq sta_txq[IWLAGN_STATION_COUNT][IWL_MAX_TID_COUNT];
+	TAILQ_HEAD(, iwl_sta_txq) active_txqs[IEEE80211_NUM_ACS];
+	/* frames dropped on the way out, until the controller counts them */
+	u32 tx_drops;
+	/* HW queues the scheduler sent to with the "more" hint, not pushed yet */
+	u32 tx_push_queues;
 	int num_aux_in_flight;
 
 	u8 mac80211_registered;
@@ -814,6 +900,9 @@ struct iwl_priv {
 	 */
 	u8 agg_tids_count;
 
+	/* block ack action frame rx.c left for the aggregation state machine */
+	struct iwl_ba_action ba_action;
+
 	struct iwl_rx_phy_res last_phy_res;
 	u32 ampdu_ref;
 	bool last_phy_res_valid;
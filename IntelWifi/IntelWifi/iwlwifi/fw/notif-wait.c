@@ -68,51 +68,57 @@
 
 void iwl_notification_wait_init(struct iwl_notif_wait_data *notif_wait)
 {
-    notif_wait->notif_wait_lock = IOSimpleLockAlloc();
-    STAILQ_INIT(&notif_wait->notif_waits);
+    int i;
+    
+    TAILQ_INIT(&notif_wait->notif_waits);
+    for (i = 0; i < IWL_NOTIF_WAIT_BUCKETS; i++)
+        TAILQ_INIT(&notif_wait->buckets[i]);
     notif_wait->notif_waitq = IOLockAlloc();
 }
 IWL_EXPORT_SYMBOL(iwl_notification_wait_init);
 
+static inline u32 iwl_notif_wait_bucket(u16 cmd)
+{
+    return iwl_cmd_opcode(cmd) & (IWL_NOTIF_WAIT_BUCKETS - 1);
+}
+
 bool iwl_notification_wait(struct iwl_notif_wait_data *notif_wait, struct iwl_rx_packet *pkt)
 {
+	u16 rec_id = WIDE_ID(pkt->hdr.group_id, pkt->hdr.cmd);
+	u32 bucket = iwl_notif_wait_bucket(rec_id);
+	struct iwl_notif_wait_link *link;
 	bool triggered = false;
 
-	if (!STAILQ_EMPTY(&notif_wait->notif_waits)) {
-		struct iwl_notification_wait *w;
-
-        //IOSimpleLockLock(notif_wait->notif_wait_lock);
-        STAILQ_FOREACH(w, &notif_wait->notif_waits, list) {
-			int i;
-			bool found = false;
-
-			/*
-			 * If it already finished (triggered) or has been
-			 * aborted then don't evaluate it again to avoid races,
-			 * Otherwise the function could be called again even
-			 * though it returned true before
-			 */
-			if (w->triggered || w->aborted)
-				continue;
-
-			for (i = 0; i < w->n_cmds; i++) {
-				u16 rec_id = WIDE_ID(pkt->hdr.group_id, pkt->hdr.cmd);
-
-				if (w->cmds[i] == rec_id || (!iwl_cmd_groupid(w->cmds[i]) && DEF_ID(w->cmds[i]) == rec_id)) {
-					found = true;
-					break;
-				}
-			}
-			if (!found)
-				continue;
-
-			if (!w->fn || w->fn(notif_wait, pkt, w->fn_data)) {
-				w->triggered = true;
-				triggered = true;
-			}
+	/*
+	 * Unlocked peek, a waiter is always added before the command that
+	 * makes the firmware send its notification.
+	 */
+	if (TAILQ_EMPTY(&notif_wait->buckets[bucket]))
+		return false;
+
+	IOLockLock(notif_wait->notif_waitq);
+	TAILQ_FOREACH(link, &notif_wait->buckets[bucket], list) {
+		struct iwl_notification_wait *w = link->wait;
+
+		/*
+		 * If it already finished (triggered) or has been
+		 * aborted then don't evaluate it again to avoid races,
+		 * Otherwise the function could be called again even
+		 * though it returned true before
+		 */
+		if (w->triggered || w->aborted)
+			continue;
+
+		if (link->cmd != rec_id && (iwl_cmd_groupid(link->cmd) || DEF_ID(link->cmd) != rec_id))
+			continue;
+
+		if (!w->fn || w->fn(notif_wait, pkt, w->fn_data)) {
+			w->triggered = true;
+			triggered = true;
+			IOLockWakeup(notif_wait->notif_waitq, w, true);
 		}
-        //IOSimpleLockUnlock(notif_wait->notif_wait_lock);
 	}
+	IOLockUnlock(notif_wait->notif_waitq);
 
 	return triggered;
 }
@@ -122,16 +128,11 @@ void iwl_abort_notification_waits(struct iwl_notif_wait_data *notif_wait)
 {
 	struct iwl_notification_wait *wait_entry;
 
-    //IOSimpleLockLock(notif_wait->notif_wait_lock);
-    STAILQ_FOREACH(wait_entry, &notif_wait->notif_waits, list)
-		wait_entry->aborted = true;
-    //IOSimpleLockUnlock(notif_wait->notif_wait_lock);
-    
-    // TODO: Implement
-	//wake_up_all(&notif_wait->notif_waitq);
     IOLockLock(notif_wait->notif_waitq);
-    STAILQ_FOREACH(wait_entry, &notif_wait->notif_waits, list)
+    TAILQ_FOREACH(wait_entry, &notif_wait->notif_waits, list) {
+		wait_entry->aborted = true;
         IOLockWakeup(notif_wait->notif_waitq, wait_entry, true);
+    }
     IOLockUnlock(notif_wait->notif_waitq);
 }
 IWL_EXPORT_SYMBOL(iwl_abort_notification_waits);
@@ -142,6 +143,8 @@ iwl_init_notification_wait(struct iwl_notif_wait_data *notif_wait, struct iwl_no
                            bool (*fn)(struct iwl_notif_wait_data *notif_wait, struct iwl_rx_packet *pkt, void *data),
                            void *fn_data)
 {
+	int i, j;
+
 	if (WARN_ON(n_cmds > MAX_NOTIF_CMDS))
 		n_cmds = MAX_NOTIF_CMDS;
 
@@ -152,39 +155,78 @@ iwl_init_notification_wait(struct iwl_notif_wait_data *notif_wait, struct iwl_no
 	wait_entry->triggered = false;
 	wait_entry->aborted = false;
 
-    //IOSimpleLockLock(notif_wait->notif_wait_lock);
-    STAILQ_INSERT_HEAD(&notif_wait->notif_waits, wait_entry, list);
-    //IOSimpleLockUnlock(notif_wait->notif_wait_lock);
+    IOLockLock(notif_wait->notif_waitq);
+    TAILQ_INSERT_HEAD(&notif_wait->notif_waits, wait_entry, list);
+	for (i = 0; i < n_cmds; i++) {
+		struct iwl_notif_wait_link *link = &wait_entry->links[i];
+
+		link->wait = wait_entry;
+		link->cmd = cmds[i];
+
+		/* a repeated id would run fn twice for one notification */
+		for (j = 0; j < i; j++)
+			if (cmds[j] == cmds[i])
+				break;
+		if (j < i) {
+			link->wait = NULL;
+			continue;
+		}
+
+		TAILQ_INSERT_TAIL(&notif_wait->buckets[iwl_notif_wait_bucket(cmds[i])], link, list);
+	}
+    IOLockUnlock(notif_wait->notif_waitq);
 }
 IWL_EXPORT_SYMBOL(iwl_init_notification_wait);
 
+/* the entry can be anywhere in the lists, waiters go in any order */
+static void iwl_remove_notification_locked(struct iwl_notif_wait_data *notif_wait,
+                                           struct iwl_notification_wait *wait_entry)
+{
+	int i;
+
+	for (i = 0; i < wait_entry->n_cmds; i++) {
+		struct iwl_notif_wait_link *link = &wait_entry->links[i];
+
+		if (!link->wait)
+			continue;
+		TAILQ_REMOVE(&notif_wait->buckets[iwl_notif_wait_bucket(link->cmd)], link, list);
+		link->wait = NULL;
+	}
+    TAILQ_REMOVE(&notif_wait->notif_waits, wait_entry, list);
+}
+
 void iwl_remove_notification(struct iwl_notif_wait_data *notif_wait,
 			     struct iwl_notification_wait *wait_entry)
 {
-    //IOSimpleLockLock(notif_wait->notif_wait_lock);
-    STAILQ_REMOVE_HEAD(&notif_wait->notif_waits, list);
-    //IOSimpleLockUnlock(notif_wait->notif_wait_lock);
+    IOLockLock(notif_wait->notif_waitq);
+    iwl_remove_notification_locked(notif_wait, wait_entry);
+    IOLockUnlock(notif_wait->notif_waitq);
 }
 IWL_EXPORT_SYMBOL(iwl_remove_notification);
 
 int iwl_wait_notification(struct iwl_notif_wait_data *notif_wait, struct iwl_notification_wait *wait_entry,
                           unsigned long timeout)
 {
-	int ret = 0;
-    
-    IOLockLock(notif_wait->notif_waitq);
+	bool triggered, aborted;
     AbsoluteTime deadline;
+    
     clock_interval_to_deadline((u32)timeout, kMillisecondScale, (UInt64 *) &deadline);
     
-    ret = IOLockSleepDeadline(notif_wait->notif_waitq, wait_entry, deadline, THREAD_INTERRUPTIBLE);
-    iwl_remove_notification(notif_wait, wait_entry);
+    /* the notification may have come in before we got here */
+    IOLockLock(notif_wait->notif_waitq);
+    while (!wait_entry->triggered && !wait_entry->aborted) {
+        if (IOLockSleepDeadline(notif_wait->notif_waitq, wait_entry, deadline, THREAD_INTERRUPTIBLE) != THREAD_AWAKENED)
+            break;
+    }
+    triggered = wait_entry->triggered;
+    aborted = wait_entry->aborted;
+    iwl_remove_notification_locked(notif_wait, wait_entry);
     IOLockUnlock(notif_wait->notif_waitq);
 
-	if (wait_entry->aborted)
+	if (aborted)
 		return -EIO;
 
-	/* return value is always >= 0 */
-	if (ret != THREAD_AWAKENED)
+	if (!triggered)
 		return -ETIMEDOUT;
 	return 0;
 }
@@ -70,9 +70,32 @@
 
 struct iwl_notification_wait;
 
+/*
+ * Waiters are hashed by command opcode, so a notification only looks at
+ * the waiters that could want it. The group is left out of the hash, a
+ * group 0 id also matches the same opcode in the legacy group.
+ */
+#define IWL_NOTIF_WAIT_BUCKETS	32
+
+/**
+ * struct iwl_notif_wait_link - a waiter in the bucket of one of its commands
+ * @list: bucket list
+ * @wait: the waiter
+ * @cmd: the command ID this link stands for
+ */
+struct iwl_notif_wait_link {
+    TAILQ_ENTRY(iwl_notif_wait_link) list;
+    struct iwl_notification_wait *wait;
+    u16 cmd;
+};
+
+/*
+ * The lists and the triggered/aborted flags are under notif_waitq, the
+ * waiters sleep on it with their own entry as the wake event.
+ */
 struct iwl_notif_wait_data {
-    STAILQ_HEAD(, iwl_notification_wait) notif_waits;
-	IOSimpleLock *notif_wait_lock;
+    TAILQ_HEAD(, iwl_notification_wait) notif_waits;
+    TAILQ_HEAD(, iwl_notif_wait_link) buckets[IWL_NOTIF_WAIT_BUCKETS];
 	IOLock *notif_waitq;
 };
 
@@ -81,6 +104,7 @@ struct iwl_notif_wait_data {
 /**
  * struct iwl_notification_wait - notification wait entry
  * @list: list head for global list
+ * @links: the waiter in the buckets of its commands
  * @fn: Function called with the notification. If the function
  *	returns true, the wait is over, if it returns false then
  *	the waiter stays blocked. If no function is given, any
@@ -103,7 +127,8 @@ struct iwl_notif_wait_data {
  * the code for them.
  */
 struct iwl_notification_wait {
-    STAILQ_ENTRY(iwl_notification_wait) list;
+    TAILQ_ENTRY(iwl_notification_wait) list;
+    struct iwl_notif_wait_link links[MAX_NOTIF_CMDS];
 
 	bool (*fn)(struct iwl_notif_wait_data *notif_data,
 		   struct iwl_rx_packet *pkt, void *data);
@@ -120,24 +145,12 @@ void iwl_notification_wait_init(struct iwl_notif_wait_data *notif_data);
 bool iwl_notification_wait(struct iwl_notif_wait_data *notif_data, struct iwl_rx_packet *pkt);
 void iwl_abort_notification_waits(struct iwl_notif_wait_data *notif_data);
 
-static inline void
-iwl_notification_notify(struct iwl_notif_wait_data *notif_data)
-{
-    struct iwl_notification_wait *wait_entry;
-    IOLockLock(notif_data->notif_waitq);
-    STAILQ_FOREACH(wait_entry, &notif_data->notif_waits, list)
-        IOLockWakeup(notif_data->notif_waitq, wait_entry, true);
-    IOLockUnlock(notif_data->notif_waitq);
-}
-
+/* iwl_notification_wait() wakes the waiters it triggers itself */
 static inline void
 iwl_notification_wait_notify(struct iwl_notif_wait_data *notif_data,
 			     struct iwl_rx_packet *pkt)
 {
-    if (iwl_notification_wait(notif_data, pkt)) {
-        iwl_notification_notify(notif_data);
-    }
-		
+    iwl_notification_wait(notif_data, pkt);
 }
 
 /* user functions */
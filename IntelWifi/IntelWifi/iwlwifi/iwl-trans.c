@@ -192,6 +192,71 @@ int iwl_trans_send_cmd(struct iwl_trans *trans, struct iwl_host_cmd *cmd)
 }
 IWL_EXPORT_SYMBOL(iwl_trans_send_cmd);
 
+/*
+ * iwl_trans_send_cmd_batch - send a chain of synchronous host commands
+ *
+ * @status gets the result of each command, the return value is the first
+ * error or 0. Commands after a failed one are still sent: the firmware
+ * rejects what depends on it, and the op mode sees which ones those were.
+ * If nothing can be sent at all, every command gets that error.
+ */
+int iwl_trans_send_cmd_batch(struct iwl_trans *trans, struct iwl_host_cmd *cmds,
+			     int n, int *status)
+{
+	int i, ret = 0;
+
+	if (WARN_ON(n <= 0 || n > IWL_HCMD_BATCH_MAX))
+		return -EINVAL;
+
+	for (i = 0; i < n; i++) {
+		if (WARN_ON(cmds[i].flags & (CMD_ASYNC | CMD_WANT_ASYNC_CALLBACK))) {
+			ret = -EINVAL;
+			goto fail;
+		}
+
+		if (trans->wide_cmd_header && !iwl_cmd_groupid(cmds[i].id))
+			cmds[i].id = DEF_ID(cmds[i].id);
+	}
+
+	if (unlikely(test_bit(STATUS_FW_ERROR, &trans->status))) {
+		ret = -EIO;
+		goto fail;
+	}
+
+	if (unlikely(trans->state != IWL_TRANS_FW_ALIVE)) {
+		IWL_ERR(trans, "%s bad state = %d\n", __func__, trans->state);
+		ret = -EIO;
+		goto fail;
+	}
+
+	if (!trans->ops->send_cmd_batch) {
+		for (i = 0; i < n; i++) {
+			status[i] = iwl_trans_send_cmd(trans, &cmds[i]);
+			if (status[i] && !ret)
+				ret = status[i];
+		}
+		return ret;
+	}
+
+	ret = trans->ops->send_cmd_batch(trans, cmds, n, status);
+
+	for (i = 0; i < n; i++) {
+		if (WARN_ON((cmds[i].flags & CMD_WANT_SKB) && !status[i] &&
+			    !cmds[i].resp_pkt)) {
+			status[i] = -EIO;
+			if (!ret)
+				ret = -EIO;
+		}
+	}
+
+	return ret;
+
+fail:
+	for (i = 0; i < n; i++)
+		status[i] = ret;
+	return ret;
+}
+
 /* Comparator for struct iwl_hcmd_names.
  * Used in the binary search over a list of host commands.
  *
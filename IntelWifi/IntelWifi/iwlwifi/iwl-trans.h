@@ -266,6 +266,10 @@ struct iwl_host_cmd {
 static inline void iwl_free_resp(struct iwl_host_cmd *cmd)
 {
 	//free_pages(cmd->_rx_page_addr, cmd->_rx_page_order);
+	if (cmd->_rx_page_addr)
+		iwh_free((void *)cmd->_rx_page_addr);
+	cmd->_rx_page_addr = 0;
+	cmd->resp_pkt = NULL;
 }
 
 struct iwl_rx_cmd_buffer {
@@ -274,6 +278,8 @@ struct iwl_rx_cmd_buffer {
 	bool _page_stolen;
 	u32 _rx_page_order;
 	unsigned int truesize;
+	void *_page_ref;
+	int _queue;
 };
 
 static inline void *rxb_addr(struct iwl_rx_cmd_buffer *r)
@@ -481,6 +487,11 @@ struct iwl_trans_txq_scd_cfg {
  *	If RFkill is asserted in the middle of a SYNC host command, it must
  *	return -ERFKILL straight away.
  *	May sleep only if CMD_ASYNC is not set
+ * @send_cmd_batch: send up to %IWL_HCMD_BATCH_MAX synchronous host commands
+ *	in consecutive command queue slots, with one write pointer update,
+ *	and wait once for them all. Per command results go to the status
+ *	array. Optional, iwl_trans_send_cmd_batch sends them one by one
+ *	without it. May sleep
  * @tx: send an skb. The transport relies on the op_mode to zero the
  *	the ieee80211_tx_info->driver_data. If the MPDU is an A-MSDU, all
  *	the CSUM will be taken care of (TCP CSUM and IP header in case of
@@ -489,6 +500,9 @@ struct iwl_trans_txq_scd_cfg {
  *	Must be atomic
  * @reclaim: free packet until ssn. Returns a list of freed packets.
  *	Must be atomic
+ * @rxb_input: pass @len bytes at @data, which must lie within the RB page
+ *	of @rxb, to the network stack without copying. The page is lent to
+ *	the stack and marked stolen.
  * @txq_enable: setup a queue. To setup an AC queue, use the
  *	iwl_trans_ac_txq_enable wrapper. fw_alive must have been called before
  *	this one. The op_mode must not configure the HCMD queue. The scheduler
@@ -551,11 +565,15 @@ struct iwl_trans_ops {
 			 bool test, bool reset);
 
 	int (*send_cmd)(struct iwl_trans *trans, struct iwl_host_cmd *cmd);
+	int (*send_cmd_batch)(struct iwl_trans *trans, struct iwl_host_cmd *cmds,
+			      int n, int *status);
 
 	int (*tx)(struct iwl_trans *trans, struct sk_buff *skb,
 		  struct iwl_device_cmd *dev_cmd, int queue);
 	void (*reclaim)(struct iwl_trans *trans, int queue, int ssn,
 			struct sk_buff_head *skbs);
+	int (*rxb_input)(struct iwl_trans *trans, struct iwl_rx_cmd_buffer *rxb,
+			 void *data, unsigned int len);
 
 	bool (*txq_enable)(struct iwl_trans *trans, int queue, u16 ssn,
 			   const struct iwl_trans_txq_scd_cfg *cfg,
@@ -935,6 +953,12 @@ iwl_trans_alloc_tx_cmd(struct iwl_trans *trans)
 
 int iwl_trans_send_cmd(struct iwl_trans *trans, struct iwl_host_cmd *cmd);
 
+/* half the command queue, async commands still find room meanwhile */
+#define IWL_HCMD_BATCH_MAX 16
+
+int iwl_trans_send_cmd_batch(struct iwl_trans *trans, struct iwl_host_cmd *cmds,
+			     int n, int *status);
+
 static inline void iwl_trans_free_tx_cmd(struct iwl_trans *trans, struct iwl_device_cmd *dev_cmd)
 {
 	//kmem_cache_free(trans->dev_cmd_pool, dev_cmd);
@@ -965,6 +989,15 @@ static inline void iwl_trans_reclaim(struct iwl_trans *trans, int queue, int ssn
 	trans->ops->reclaim(trans, queue, ssn, skbs);
 }
 
+static inline int iwl_trans_rxb_input(struct iwl_trans *trans, struct iwl_rx_cmd_buffer *rxb,
+				      void *data, unsigned int len)
+{
+	if (WARN_ON_ONCE(!trans->ops->rxb_input))
+		return -EOPNOTSUPP;
+
+	return trans->ops->rxb_input(trans, rxb, data, len);
+}
+
 static inline void iwl_trans_txq_disable(struct iwl_trans *trans, int queue, bool configure_scd)
 {
 	trans->ops->txq_disable(trans, queue, configure_scd);
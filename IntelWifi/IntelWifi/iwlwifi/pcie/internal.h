@@ -48,6 +48,7 @@
 
 #include <sys/kernel_types.h>
 #include <sys/queue.h>
+#include <kern/clock.h>
 
 
 #include "iwl-modparams.h"
@@ -61,6 +62,20 @@
  */
 #define IWL_PCIE_MAX_FRAGS(x) (x->max_tbs - 3)
 
+/*
+ * Segments the TX mbuf cursor may return. An mbuf has no separate head,
+ * so the head TB and the frags are all segments: TB0 and TB1 take the TX
+ * command and the 802.11 header, which leaves max_tbs - 2, that is
+ * IWL_PCIE_MAX_FRAGS + 1, for segments that may each carry data. A
+ * segment holding nothing but the header is skipped; no extra room is
+ * made for it, so a TFD is never overrun when the first segment also
+ * carries payload.
+ */
+#define IWL_PCIE_MAX_DATA_SEGS(x) (IWL_PCIE_MAX_FRAGS(x) + 1)
+
+/* the legacy TFD keeps the TB length in 12 bits */
+#define IWL_TX_MAX_TB_SIZE 0xFFF
+
 /*
  * RX related structures and functions
  */
@@ -68,6 +83,24 @@
 #define RX_POST_REQ_ALLOC 2
 #define RX_CLAIM_REQ_ALLOC 8
 #define RX_PENDING_WATERMARK 16
+#define RX_BUDGET_DEF 64
+#define RX_RESTOCK_BATCH 16
+/* a pass handles at least one restock batch and at most a full queue */
+#define RX_BUDGET_MIN RX_RESTOCK_BATCH
+#define RX_BUDGET_MAX RX_QUEUE_SIZE
+
+/* interrupt moderation: sampling window and thresholds (per second) */
+#define IWL_IRQ_MOD_WINDOW_NS (100 * 1000 * 1000ULL)
+#define IWL_IRQ_MOD_BULK_PKTS 4000
+#define IWL_IRQ_MOD_BULK_IRQS 2000
+#define IWL_IRQ_MOD_IDLE_PKTS 1000
+#define IWL_IRQ_MOD_IDLE_IRQS 500
+/* coalescing timer of the low latency setting, 8 x 32 = 256 usecs */
+#define IWL_IRQ_MOD_LATENCY_TIMEOUT 0x08
+
+/* busy-poll: give the device back to interrupts after 2 ms without work */
+#define IWL_BUSY_POLL_IDLE_NS (2 * 1000 * 1000ULL)
+#define IWL_BUSY_POLL_DELAY_US 5
 
 
 /**
@@ -83,6 +116,73 @@ enum iwl_shared_irq_flags {
 /*This file includes the declaration that are internal to the
  * trans_pcie layer */
 
+#define RX_PAGE_CHUNK_SIZE (64 * 1024)
+/* free RBs the allocator keeps in the pool for atomic callers */
+#define RX_PAGE_POOL_RESERVE 64
+
+/**
+ * struct iwl_rx_page - RB carved out of a page pool chunk
+ * @addr: kernel virtual address of the RB
+ * @dma: bus address of the RB, computed once when the chunk is allocated
+ * @pool: the page returns to its pool once released
+ * @refs: one held by the RX queue while the page is posted, one per mbuf
+ * @list: entry in the pool free list
+ */
+struct iwl_rx_page {
+    void *addr;
+    dma_addr_t dma;
+    struct iwl_rx_page_pool *pool;
+    SInt32 refs;
+    TAILQ_ENTRY(iwl_rx_page) list;
+};
+
+/**
+ * struct iwl_rx_page_chunk - physically contiguous memory split into RBs
+ * @desc: IOBufferMemoryDescriptor backing the chunk
+ * @pages: RB descriptors of the chunk
+ * @size: chunk size in bytes
+ * @n_pages: number of RBs in the chunk
+ * @list: entry in the pool chunks list
+ */
+struct iwl_rx_page_chunk {
+    void *desc;
+    struct iwl_rx_page *pages;
+    u32 size;
+    u32 n_pages;
+    TAILQ_ENTRY(iwl_rx_page_chunk) list;
+};
+
+/**
+ * struct iwl_rx_page_pool - RB page pool
+ * @lock: protects the free list, taken from mbuf free callbacks too
+ * @free: RBs not owned by the HW or the network stack
+ * @chunks: all chunks, released by iwl_pcie_rx_free
+ * @rb_size: RB size, fixed by the first chunk
+ * @n_pages: RBs in all chunks
+ * @n_free: RBs on the free list
+ * @hits: allocations served from the free list
+ * @misses: allocations that needed a new chunk
+ * @high_water: maximum number of RBs in use at once
+ * @lent: RBs held by mbufs in the network stack, decremented under @lock
+ * @detached: the transport is gone, the last lent RB frees the pool
+ *
+ * Allocated apart from &struct iwl_trans_pcie, so it can outlive it while
+ * the network stack still holds RBs.
+ */
+struct iwl_rx_page_pool {
+    IOSimpleLock *lock;
+    TAILQ_HEAD(, iwl_rx_page) free;
+    TAILQ_HEAD(, iwl_rx_page_chunk) chunks;
+    u32 rb_size;
+    u32 n_pages;
+    u32 n_free;
+    u32 hits;
+    u32 misses;
+    u32 high_water;
+    SInt32 lent;
+    bool detached;
+};
+
 /**
  * struct iwl_rx_mem_buffer
  * @page_dma: bus address of rxb page
@@ -92,7 +192,7 @@ enum iwl_shared_irq_flags {
  */
 struct iwl_rx_mem_buffer {
     dma_addr_t page_dma;
-    void *page;
+    struct iwl_rx_page *page;
     u16 vid;
     bool invalid;
     TAILQ_ENTRY(iwl_rx_mem_buffer) list;
@@ -116,6 +216,169 @@ struct isr_statistics {
     u32 unhandled;
 };
 
+/* bucket n counts commands that took [2^(n-1), 2^n) usecs, the last one more */
+#define IWL_PCIE_HCMD_LAT_BUCKETS 20
+
+/**
+ * struct iwl_pcie_hcmd_lat - latency of one host command
+ *
+ * From the command going on the ring to its response, updated without a
+ * lock by iwl_pcie_hcmd_complete.
+ */
+struct iwl_pcie_hcmd_lat {
+    u64 total_ns;
+    u64 max_ns;
+    u32 count;
+    u32 buckets[IWL_PCIE_HCMD_LAT_BUCKETS];
+};
+
+/**
+ * struct iwl_pcie_perf_stats - transport counters
+ *
+ * RX passes are counted per queue in &struct iwl_rxq_stats.
+ * @rx_alloc_runs: background allocator runs
+ * @rx_alloc_reqs: allocation requests served by the background allocator
+ */
+struct iwl_pcie_perf_stats {
+    u32 rx_alloc_runs;
+    u32 rx_alloc_reqs;
+};
+
+/**
+ * enum iwl_irq_mod_mode - interrupt moderation setting
+ * @IWL_IRQ_MOD_LATENCY: short coalescing timer, periodic RX interrupt armed
+ * @IWL_IRQ_MOD_BULK: default coalescing timer, no periodic RX interrupt
+ */
+enum iwl_irq_mod_mode {
+    IWL_IRQ_MOD_LATENCY,
+    IWL_IRQ_MOD_BULK,
+};
+
+/**
+ * struct iwl_pcie_irq_mod - adaptive interrupt moderation
+ *
+ * Interrupts and packets are sampled over IWL_IRQ_MOD_WINDOW_NS and the
+ * coalescing timer is switched between the two settings with hysteresis.
+ * TX completions arrive as RX notifications, so the packet count covers
+ * both directions.
+ * @mode: current setting
+ * @timeout: value written to CSR_INT_COALESCING, 32-usec units
+ * @window_start: start of the current window
+ * @window_irqs: interrupts seen in the current window
+ * @window_pkts: packet count of all RX queues when the window started
+ * @irq_rate: interrupts per second in the last window
+ * @pkt_rate: packets per second in the last window
+ * @switches: number of setting changes
+ * @busy: a sample is being evaluated
+ */
+struct iwl_pcie_irq_mod {
+    enum iwl_irq_mod_mode mode;
+    u8 timeout;
+    u64 window_start;
+    int window_irqs;
+    u32 window_pkts;
+    u32 irq_rate;
+    u32 pkt_rate;
+    u32 switches;
+    UInt32 busy;
+};
+
+/**
+ * struct iwl_pcie_busy_poll - busy-poll RX mode
+ *
+ * While a session runs, interrupts are masked and a thread polls the
+ * default RX queue. A session starts on the next interrupt and ends after
+ * IWL_BUSY_POLL_IDLE_NS without RBs, or as soon as a cause other than RX
+ * is pending, which is then handed to the interrupt handler.
+ * @lock: protects @polling and @stop, the thread sleeps on it
+ * @thread: the poll thread, NULL when it is not running
+ * @enabled: selected from the user client
+ * @polling: a session is running, interrupts are masked
+ * @stop: the thread should exit
+ * @irq_stamp: time the last interrupt was taken
+ * @irq_lat_ns: accumulated interrupt to work loop latency
+ * @irq_lat_cnt: interrupts accounted in @irq_lat_ns
+ * @sessions: sessions started
+ * @polls: poll passes
+ * @hits: poll passes that found RBs
+ * @inta: causes the poll took out of the ICT table for the interrupt
+ *	handler, under the work loop gate
+ */
+struct iwl_pcie_busy_poll {
+    IOLock *lock;
+    void *thread;
+    bool enabled;
+    bool polling;
+    bool stop;
+    u64 irq_stamp;
+    u64 irq_lat_ns;
+    u32 irq_lat_cnt;
+    u32 sessions;
+    u32 polls;
+    u32 hits;
+    u32 inta;
+};
+
+/* stuck queue watchdog wheel: 64 slots of 100ms, then 64 slots of 6.4s */
+#define IWL_TXQ_WD_TICK_MS          100
+#define IWL_TXQ_WD_WHEEL_BITS       6
+#define IWL_TXQ_WD_WHEEL_SIZE       (1 << IWL_TXQ_WD_WHEEL_BITS)
+#define IWL_TXQ_WD_WHEEL_MASK       (IWL_TXQ_WD_WHEEL_SIZE - 1)
+#define IWL_TXQ_WD_WHEEL_LEVELS     2
+
+struct iwl_txq;
+
+/**
+ * struct iwl_txq_wd_wheel - stuck queue watchdog shared by all TX queues
+ *
+ * A queue is filed in the slot of the tick its watchdog expires at, level 0
+ * for the next IWL_TXQ_WD_WHEEL_SIZE ticks and level 1 beyond that; a level
+ * 1 slot is cascaded into level 0 when level 0 wraps. Progress on a queue
+ * only moves its expiry, the queue is refiled when its old slot comes up.
+ * One timer ticks while any queue is filed, whatever the queue count.
+ * @lock: protects the slots and the wd_* fields of the queues
+ * @timer: IOTimerEventSource ticking every IWL_TXQ_WD_TICK_MS
+ * @now: last tick handled
+ * @armed: queues filed
+ * @slots: filed queues, by expiry tick
+ */
+struct iwl_txq_wd_wheel {
+    IOSimpleLock *lock;
+    void *timer;
+    u64 now;
+    int armed;
+    LIST_HEAD(, iwl_txq) slots[IWL_TXQ_WD_WHEEL_LEVELS][IWL_TXQ_WD_WHEEL_SIZE];
+};
+
+/**
+ * struct iwl_rxq_stats - per RX queue statistics
+ *
+ * Only updated by the context handling the queue, so RSS queues served in
+ * parallel do not share counters.
+ * @ns: time spent in iwl_pcie_rx_handle
+ * @passes: calls of iwl_pcie_rx_handle
+ * @rbs: RBs handled
+ * @pkts: packets (notifications and frames) found in the RBs
+ * @frames: frames passed to the network stack
+ * @bytes_copied: bytes copied because the RB page could not be lent
+ * @restocks: restocks done by iwl_pcie_rx_handle
+ * @doorbells: RX write pointer updates
+ * @resched: passes that ran out of budget and were rescheduled
+ * @emergency: RBs allocated inline because the allocator fell behind
+ */
+struct iwl_rxq_stats {
+    u64 ns;
+    u32 passes;
+    u32 rbs;
+    u32 pkts;
+    u32 frames;
+    u64 bytes_copied;
+    u32 restocks;
+    u32 doorbells;
+    u32 resched;
+    u32 emergency;
+};
+
 /**
  * struct iwl_rxq - Rx queue
  * @id: queue index
@@ -132,6 +395,13 @@ struct isr_statistics {
  * @rx_free: list of RBDs with allocated RB ready for use
  * @rx_used: list of RBDs with no RB attached
  * @need_update: flag to indicate we need to update read/write index
+ * @poll_pending: the last pass ran out of budget, the queue is polled again
+ *    from the work loop
+ * @input_head: frames of the current pass, chained with mbuf_setnextpkt and
+ *    handed to the network stack at the end of the pass
+ * @input_tail: last frame of the chain
+ * @input_count: frames in the chain
+ * @stats: per queue statistics
  * @rb_stts: driver's pointer to receive buffer status
  * @rb_stts_dma: bus address of receive buffer status
  * @lock:
@@ -156,6 +426,11 @@ struct iwl_rxq {
     TAILQ_HEAD(, iwl_rx_mem_buffer) rx_free;
     TAILQ_HEAD(, iwl_rx_mem_buffer) rx_used;
     bool need_update;
+    bool poll_pending;
+    void *input_head;
+    void *input_tail;
+    u32 input_count;
+    struct iwl_rxq_stats stats;
     struct iwl_dma_ptr *rb_stts_buf;
     struct iwl_rb_status *rb_stts;
     dma_addr_t rb_stts_dma;
@@ -173,8 +448,8 @@ struct iwl_rxq {
 * @rbd_empty: RBDs with no page attached for allocator use. This is a list
 *    of &struct iwl_rx_mem_buffer
 * @lock: protects the rbd_allocated and rbd_empty lists
-* @alloc_wq: work queue for background calls
-* @rx_alloc: work struct for background calls
+* @alloc_wq: IOWorkLoop the allocator runs on
+* @rx_alloc: IOInterruptEventSource scheduling the allocator
 */
 struct iwl_rb_allocator {
     int req_pending;
@@ -182,8 +457,8 @@ struct iwl_rb_allocator {
     TAILQ_HEAD(, iwl_rx_mem_buffer) rbd_allocated;
     TAILQ_HEAD(, iwl_rx_mem_buffer) rbd_empty;
     IOSimpleLock *lock;
-//    struct workqueue_struct *alloc_wq;
-//    struct work_struct rx_alloc;
+    void *alloc_wq;
+    void *rx_alloc;
 };
 
 struct iwl_dma_ptr {
@@ -195,6 +470,38 @@ struct iwl_dma_ptr {
     void *cmd; // IODMACommand
 };
 
+/*
+ * Host command bodies past the first TB are copied into DMA buffers taken
+ * from three size classes, sized after dvm/commands.h:
+ * 128 bytes: ADD_STA (92), LQ (88), RXON (50), QoS (36) and the like
+ * 512 bytes: anything copied into the command, up to TFD_MAX_PAYLOAD_SIZE
+ * 2048 bytes: scan, iwl_scan_cmd (764) + 50 channels (12 each) + probe
+ * Bigger bodies get a buffer of their own.
+ */
+#define IWL_HCMD_BUF_CLASSES 3
+
+/**
+ * struct iwl_hcmd_buf_class - host command DMA buffers of one size
+ * @size: buffer size
+ * @count: buffers in the class, at most 32
+ * @free: bitmap of the free buffers, taken and given back with atomics
+ * @mem: the DMA allocation the buffers are carved from
+ * @bufs: the buffers, described the way &struct iwl_cmd_meta holds them
+ * @allocs: buffers handed out
+ * @full: times the class was empty and a bigger one had to serve
+ * @high_water: most buffers in use at once
+ */
+struct iwl_hcmd_buf_class {
+    u32 size;
+    u32 count;
+    volatile UInt32 free;
+    struct iwl_dma_ptr *mem;
+    struct iwl_dma_ptr *bufs;
+    UInt32 allocs;
+    UInt32 full;
+    u32 high_water;
+};
+
 
 /**
  * iwl_queue_inc_wrap - increment queue index, wrap back to beginning
@@ -239,12 +546,25 @@ struct iwl_cmd_meta {
 #define IWL_FIRST_TB_SIZE    20
 #define IWL_FIRST_TB_SIZE_ALIGN ALIGN(IWL_FIRST_TB_SIZE, 64)
 
+/**
+ * struct iwl_pcie_hcmd_waiter - sync host command waiting for its response
+ *
+ * Lives on the sender's stack and hangs off the command queue slot until
+ * iwl_pcie_hcmd_complete, or a firmware error or rfkill, sets @done. The
+ * sender sleeps on the waiter's address, so only it is woken.
+ * @done: the slot is finished with, the sender may look at the result
+ */
+struct iwl_pcie_hcmd_waiter {
+    bool done;
+};
+
 struct iwl_pcie_txq_entry {
     struct iwl_device_cmd *cmd;
-    struct sk_buff *skb;
-    /* buffer to free after command completes */
-    const void *free_buf;
-    vm_size_t free_buf_size;
+    mbuf_t skb;
+    /* when the frame or command went on the ring, for the completion latency */
+    u64 tx_ns;
+    /* sync sender of the command in this slot, under wait_command_queue */
+    struct iwl_pcie_hcmd_waiter *waiter;
     struct iwl_cmd_meta meta;
 };
 
@@ -252,6 +572,60 @@ struct iwl_pcie_first_tb_buf {
     u8 buf[IWL_FIRST_TB_SIZE_ALIGN];
 };
 
+/*
+ * TX bounce slots: pre-mapped, cache line aligned DMA memory next to the
+ * first TB of every data queue entry. TB1 (the rest of the TX command and
+ * the 802.11 header) always lives there, payloads up to tx_copybreak bytes
+ * are copied right behind it and go out in the same TB.
+ */
+#define IWL_TX_BOUNCE_TB1_SIZE 128
+#define IWL_TX_BOUNCE_SLOT_SIZE 384
+#define IWL_TX_COPYBREAK_DEF 128
+#define IWL_TX_COPYBREAK_MAX (IWL_TX_BOUNCE_SLOT_SIZE - IWL_TX_BOUNCE_TB1_SIZE)
+
+struct iwl_pcie_bounce_buf {
+    u8 buf[IWL_TX_BOUNCE_SLOT_SIZE];
+};
+
+/**
+ * struct iwl_txq_stats - per TX queue statistics
+ *
+ * Updated under the queue lock.
+ * @frames: frames put on the ring
+ * @bounced: frames whose payload was copied into their bounce slot
+ * @linearized: frames copied into a single mbuf because the cursor could
+ *    not map their chain
+ * @doorbells: write pointer updates sent to HBUS_TARG_WRPTR
+ * @sleep_checks: CSR_UCODE_DRV_GP1 reads done before a doorbell
+ * @stops: times the queue went over its high watermark
+ * @overflowed: frames parked in the overflow ring
+ */
+struct iwl_txq_stats {
+    u32 frames;
+    u32 bounced;
+    u32 linearized;
+    u32 doorbells;
+    u32 sleep_checks;
+    u32 stops;
+    u32 overflowed;
+    u32 completions;
+    u64 completion_ns;
+    u64 completion_max_ns;
+};
+
+/* frames a stopped queue still accepts before the ring has room again */
+#define IWL_TXQ_OVERFLOW_MAX    64
+
+/**
+ * struct iwl_txq_overflow - frame waiting for room on a full TX ring
+ * @skb: the frame
+ * @dev_cmd: its TX command, skbs carry this in skb->cb on Linux
+ */
+struct iwl_txq_overflow {
+    mbuf_t skb;
+    struct iwl_device_cmd *dev_cmd;
+};
+
 /**
  * struct iwl_txq - Tx Queue for DMA
  * @q: generic Rx/Tx queue descriptor
@@ -260,15 +634,25 @@ struct iwl_pcie_first_tb_buf {
  *    the writeback -- this is DMA memory and an array holding one buffer
  *    for each command on the queue
  * @first_tb_dma: DMA address for the first_tb_bufs start
+ * @bounce_bufs: TB1 and small payload slots, one per entry (data queues only)
+ * @bounce_dma: DMA address for the bounce_bufs start
+ * @stats: queue statistics
  * @entries: transmit entries (driver state)
  * @lock: queue lock
- * @stuck_timer: timer that fires if queue gets stuck
+ * @wd_expires: watchdog expiry tick, 0 when not armed
+ * @wd_filed: the queue is in a slot of the watchdog wheel
+ * @wd_list: entry in the watchdog wheel slot
  * @trans_pcie: pointer back to transport (for timer)
  * @need_update: indicates need to update read/write index
  * @ampdu: true if this queue is an ampdu queue for an specific RA/TID
- * @wd_timeout: queue watchdog timeout (jiffies) - per queue
+ * @wd_timeout: queue watchdog timeout (ms) - per queue
+ * @overflow_q: frames that came in after the queue was stopped
+ * @overflow_head: oldest frame in @overflow_q
+ * @overflow_len: number of frames in @overflow_q
+ * @overflow_tx: the resume is moving @overflow_q to the ring without the
+ *	lock, new frames go behind it meanwhile
  * @frozen: tx stuck queue timer is frozen
- * @frozen_expiry_remainder: remember how long until the timer fires
+ * @frozen_expiry_remainder: remember how long until the timer fires (ms)
  * @bc_tbl: byte count table of the queue (relevant only for gen2 transport)
  * @write_ptr: 1-st empty entry (index) host_w
  * @read_ptr: last used entry (index) host_r
@@ -300,10 +684,16 @@ struct iwl_txq {
     struct iwl_pcie_first_tb_buf *first_tb_bufs;
     dma_addr_t first_tb_dma;
     struct iwl_dma_ptr *first_tb_dma_ptr;
+    struct iwl_pcie_bounce_buf *bounce_bufs;
+    dma_addr_t bounce_dma;
+    struct iwl_dma_ptr *bounce_dma_ptr;
+    struct iwl_txq_stats stats;
     struct iwl_pcie_txq_entry *entries;
     IOSimpleLock *lock;
     unsigned long frozen_expiry_remainder;
-    //struct timer_list stuck_timer;
+    u64 wd_expires;
+    bool wd_filed;
+    LIST_ENTRY(iwl_txq) wd_list;
     struct iwl_trans_pcie *trans_pcie;
     bool need_update;
     bool frozen;
@@ -311,7 +701,10 @@ struct iwl_txq {
     int block;
     unsigned long wd_timeout;
     
-    mbuf_t overflow_q;
+    struct iwl_txq_overflow overflow_q[IWL_TXQ_OVERFLOW_MAX];
+    int overflow_head;
+    int overflow_len;
+    bool overflow_tx;
     struct iwl_dma_ptr bc_tbl;
     
     int write_ptr;
@@ -330,6 +723,12 @@ iwl_pcie_get_first_tb_dma(struct iwl_txq *txq, int idx)
     return txq->first_tb_dma + sizeof(struct iwl_pcie_first_tb_buf) * idx;
 }
 
+static inline dma_addr_t
+iwl_pcie_get_bounce_dma(struct iwl_txq *txq, int idx)
+{
+    return txq->bounce_dma + sizeof(struct iwl_pcie_bounce_buf) * idx;
+}
+
 static inline u16 iwl_pcie_tfd_tb_get_len(struct iwl_trans *trans, void *_tfd,
                                           u8 idx)
 {
@@ -357,6 +756,12 @@ struct iwl_trans_pcie {
     struct iwl_rb_allocator rba;
     struct iwl_trans *trans;
     
+    /* RB pages lent to the network stack as external mbufs */
+    struct iwl_rx_page_pool *rx_page_pool;
+    IOLock *rx_input_lock;
+    u32 rx_budget;
+    u32 tx_copybreak;
+    
     /* INT ICT Table */
     __le32 *ict_tbl;
     dma_addr_t ict_tbl_dma;
@@ -366,6 +771,9 @@ struct iwl_trans_pcie {
     bool is_down, opmode_down;
     bool debug_rfkill;
     struct isr_statistics isr_stats;
+    struct iwl_pcie_perf_stats perf_stats;
+    struct iwl_pcie_irq_mod irq_mod;
+    struct iwl_pcie_busy_poll busy_poll;
     
     IOSimpleLock* irq_lock;
     IOLock *mutex;
@@ -376,8 +784,15 @@ struct iwl_trans_pcie {
     
     struct iwl_txq *txq_memory;
     struct iwl_txq *txq[IWL_MAX_TVQM_QUEUES];
+    /* DMA bytes held by TX rings, only enabled queues have theirs */
+    size_t tx_dma_bytes;
     unsigned long queue_used[BITS_TO_LONGS(IWL_MAX_TVQM_QUEUES)];
     unsigned long queue_stopped[BITS_TO_LONGS(IWL_MAX_TVQM_QUEUES)];
+    /* woken queues the op mode has not been told about yet */
+    unsigned long queue_wake[BITS_TO_LONGS(IWL_MAX_TVQM_QUEUES)];
+    /* IOInterruptEventSource passing queue wakes to the op mode */
+    void *tx_wake;
+    struct iwl_txq_wd_wheel txq_wd;
     
     /* PCI bus related data */
     volatile void* hw_base;
@@ -386,6 +801,15 @@ struct iwl_trans_pcie {
     bool ucode_write_complete;
     IOLock* ucode_write_waitq;
     IOLock* wait_command_queue;
+    /* serializes senders filling the command queue */
+    IOLock *hcmd_lock;
+    struct iwl_hcmd_buf_class hcmd_bufs[IWL_HCMD_BUF_CLASSES];
+    /* host command bodies too big for any class */
+    UInt32 hcmd_buf_oversize;
+    /* latency of the group 0 host commands, by opcode */
+    struct iwl_pcie_hcmd_lat hcmd_lat[256];
+    /* log host commands slower than this, 0 for none */
+    u32 hcmd_slow_us;
     IOLock* d0i3_waitq;
 
     u8 page_offs, dev_cmd_offs;
@@ -421,6 +845,8 @@ struct iwl_trans_pcie {
     u8 shared_vec_mask;
     u32 alloc_vecs;
     u32 def_irq;
+    /* uCode load (FH TX) vector, equals def_irq unless one was spare */
+    u32 fh_irq;
     u32 fh_init_mask;
     u32 hw_init_mask;
     u32 fh_mask;
@@ -440,6 +866,17 @@ iwl_trans_pcie_get_trans(struct iwl_trans_pcie *trans_pcie)
                         trans_specific);
 }
 
+static inline u64 iwl_pcie_perf_ns(void)
+{
+    u64 abstime, ns;
+    
+    clock_get_uptime(&abstime);
+    absolutetime_to_nanoseconds(abstime, &ns);
+    return ns;
+}
+
+void iwl_pcie_dump_perf_stats(struct iwl_trans *trans);
+
 /*****************************************************
  * RX
  ******************************************************/
@@ -451,6 +888,11 @@ int iwl_pcie_gen2_rx_init(struct iwl_trans *trans);
 //irqreturn_t iwl_pcie_irq_rx_msix_handler(int irq, void *dev_id);
 int iwl_pcie_rx_stop(struct iwl_trans *trans);
 void iwl_pcie_rx_free(struct iwl_trans *trans);
+struct iwl_rx_page_pool *iwl_pcie_rx_pool_alloc(void);
+void iwl_pcie_irq_mod_init(struct iwl_trans *trans);
+void iwl_pcie_irq_mod_sample(struct iwl_trans *trans);
+int iwl_trans_pcie_rxb_input(struct iwl_trans *trans, struct iwl_rx_cmd_buffer *rxb,
+                             void *data, unsigned int len);
 /*****************************************************
  * ICT - interrupt handling
  ******************************************************/
@@ -476,12 +918,19 @@ void iwl_trans_pcie_txq_disable(struct iwl_trans *trans, int queue,
                                 bool configure_scd);
 void iwl_trans_pcie_txq_set_shared_mode(struct iwl_trans *trans, u32 txq_id,
                                         bool shared_mode);
+void iwl_trans_pcie_freeze_txq_timer(struct iwl_trans *trans, unsigned long txqs, bool freeze);
+void iwl_trans_pcie_log_scd_error(struct iwl_trans *trans, struct iwl_txq *txq);
 //void iwl_trans_pcie_log_scd_error(struct iwl_trans *trans,
 //                                  struct iwl_txq *txq);
 //int iwl_trans_pcie_tx(struct iwl_trans *trans, struct sk_buff *skb,
 //                      struct iwl_device_cmd *dev_cmd, int txq_id);
 void iwl_pcie_txq_check_wrptrs(struct iwl_trans *trans);
 int iwl_trans_pcie_send_hcmd(struct iwl_trans *trans, struct iwl_host_cmd *cmd);
+int iwl_trans_pcie_send_hcmd_batch(struct iwl_trans *trans, struct iwl_host_cmd *cmds,
+                                   int n, int *status);
+int iwl_pcie_hcmd_wake_all(struct iwl_trans *trans);
+int iwl_pcie_hcmd_bufs_alloc(struct iwl_trans *trans);
+void iwl_pcie_hcmd_bufs_free(struct iwl_trans *trans);
 //void iwl_pcie_hcmd_complete(struct iwl_trans *trans,
 //                            struct iwl_rx_cmd_buffer *rxb);
 //void iwl_trans_pcie_reclaim(struct iwl_trans *trans, int txq_id, int ssn,
@@ -699,7 +1148,7 @@ void iwl_trans_pcie_rf_kill(struct iwl_trans *trans, bool state);
 
 void iwl_pcie_enable_rx_wake(struct iwl_trans *trans, bool enable);
 
-//void iwl_pcie_rx_allocator_work(struct work_struct *data);
+void iwl_pcie_rx_allocator_work(struct iwl_trans *trans);
 
 
 /* common functions that are used by gen2 transport */
@@ -715,8 +1164,8 @@ void iwl_pcie_apm_stop_master(struct iwl_trans *trans);
 void iwl_pcie_conf_msix_hw(struct iwl_trans_pcie *trans_pcie);
 //int iwl_pcie_txq_init(struct iwl_trans *trans, struct iwl_txq *txq,
 //                      int slots_num, bool cmd_queue);
-//int iwl_pcie_txq_alloc(struct iwl_trans *trans,
-//                       struct iwl_txq *txq, int slots_num,  bool cmd_queue);
+int iwl_pcie_txq_alloc(struct iwl_trans *trans,
+                       struct iwl_txq *txq, int slots_num,  bool cmd_queue);
 int iwl_pcie_alloc_dma_ptr(struct iwl_trans *trans,
                            struct iwl_dma_ptr *ptr, size_t size);
 void iwl_pcie_free_dma_ptr(struct iwl_trans *trans, struct iwl_dma_ptr *ptr);
@@ -726,6 +1175,11 @@ void iwl_pcie_apply_destination(struct iwl_trans *trans);
 //#ifdef CONFIG_INET
 //struct iwl_tso_hdr_page *get_page_hdr(struct iwl_trans *trans, size_t len);
 //#endif
+void iwl_wake_queue(struct iwl_trans *trans, struct iwl_txq *txq);
+void iwl_pcie_txq_wd_mod(struct iwl_txq *txq, unsigned long timeout);
+void iwl_pcie_txq_wd_del(struct iwl_txq *txq);
+unsigned long iwl_pcie_txq_wd_remaining(struct iwl_txq *txq);
+void iwl_pcie_txq_wd_tick(struct iwl_trans *trans);
 //
 ///* transport gen 2 exported functions */
 //int iwl_trans_pcie_gen2_start_fw(struct iwl_trans *trans,
@@ -257,6 +257,7 @@ static void iwl_trans_pcie_set_pmi(struct iwl_trans *trans, bool state)
         .release_nic_access = iwl_trans_pcie_release_nic_access,    \
         .set_bits_mask = iwl_trans_pcie_set_bits_mask,              \
         .set_pmi = iwl_trans_pcie_set_pmi,                          \
+        .rxb_input = iwl_trans_pcie_rxb_input,                      \
         .configure = iwl_trans_pcie_configure
 //        .op_mode_leave = iwl_trans_pcie_op_mode_leave,              \
 //        .ref = iwl_trans_pcie_ref,                                  \
@@ -277,6 +278,7 @@ const struct iwl_trans_ops trans_ops_pcie = {
     IWL_TRANS_COMMON_OPS,
     IWL_TRANS_PM_OPS
     .send_cmd = iwl_trans_pcie_send_hcmd,
+    .send_cmd_batch = iwl_trans_pcie_send_hcmd_batch,
     .fw_alive = iwl_trans_pcie_fw_alive,
 //    .start_hw = iwl_trans_pcie_start_hw,
 //    .start_fw = iwl_trans_pcie_start_fw,
@@ -291,7 +293,7 @@ const struct iwl_trans_ops trans_ops_pcie = {
     
 //    .wait_tx_queues_empty = iwl_trans_pcie_wait_txqs_empty,
 //
-//    .freeze_txq_timer = iwl_trans_pcie_freeze_txq_timer,
+    .freeze_txq_timer = iwl_trans_pcie_freeze_txq_timer,
 //    .block_txq_ptrs = iwl_trans_pcie_block_txq_ptrs,
 };
 
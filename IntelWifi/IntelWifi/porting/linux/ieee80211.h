@@ -214,6 +214,15 @@ static inline u16 ieee80211_sn_sub(u16 sn1, u16 sn2)
 /* Mesh Control 802.11s */
 #define IEEE80211_QOS_CTL_MESH_CONTROL_PRESENT  0x0100
 
+#define IEEE80211_HT_CTL_LEN        4
+
+#define IEEE80211_CCMP_HDR_LEN        8
+#define IEEE80211_CCMP_MIC_LEN        8
+
+#define IEEE80211_WEP_IV_LEN        4
+#define IEEE80211_WEP_ICV_LEN        4
+#define IEEE80211_TKIP_ICV_LEN        4
+
 /* Mesh Power Save Level */
 #define IEEE80211_QOS_CTL_MESH_PS_LEVEL        0x0200
 /* Mesh Receiver Service Period Initiated */
@@ -652,6 +661,69 @@ static inline bool ieee80211_is_first_frag(__le16 seq_ctrl)
     return (seq_ctrl & cpu_to_le16(IEEE80211_SCTL_FRAG)) == 0;
 }
 
+/**
+ * ieee80211_get_qos_ctl - get pointer to qos control bytes
+ * @hdr: the frame
+ *
+ * The qos ctrl bytes come after the frame_control, duration, seq_num
+ * and 3 or 4 addresses of length ETH_ALEN.
+ * 3 addr: 2 + 2 + 2 + 3*6 = 24
+ * 4 addr: 2 + 2 + 2 + 4*6 = 30
+ */
+static inline u8 *ieee80211_get_qos_ctl(struct ieee80211_hdr *hdr)
+{
+    if (ieee80211_has_a4(hdr->frame_control))
+        return (u8 *)hdr + 30;
+    else
+        return (u8 *)hdr + 24;
+}
+
+/**
+ * ieee80211_hdrlen - get header length in bytes from frame control
+ * @fc: frame control field in little-endian format
+ *
+ * (net/wireless/util.c in Linux)
+ */
+static inline unsigned int ieee80211_hdrlen(__le16 fc)
+{
+    unsigned int hdrlen = 24;
+
+    if (ieee80211_is_data(fc)) {
+        if (ieee80211_has_a4(fc))
+            hdrlen = 30;
+        if (ieee80211_is_data_qos(fc)) {
+            hdrlen += IEEE80211_QOS_CTL_LEN;
+            if (ieee80211_has_order(fc))
+                hdrlen += IEEE80211_HT_CTL_LEN;
+        }
+        return hdrlen;
+    }
+
+    if (ieee80211_is_mgmt(fc)) {
+        if (ieee80211_has_order(fc))
+            hdrlen += IEEE80211_HT_CTL_LEN;
+        return hdrlen;
+    }
+
+    if (ieee80211_is_ctl(fc)) {
+        /*
+         * ACK and CTS are 10 bytes, all others 16. To see how
+         * to get this condition consider
+         *   subtype mask:   0b0000000011110000 (0x00F0)
+         *   ACK subtype:    0b0000000011010000 (0x00D0)
+         *   CTS subtype:    0b0000000011000000 (0x00C0)
+         *   bits that matter:         ^^^      (0x00E0)
+         *   value of those: 0b0000000011000000 (0x00C0)
+         */
+        if ((fc & cpu_to_le16(0x00E0)) == cpu_to_le16(0x00C0))
+            hdrlen = 10;
+        else
+            hdrlen = 16;
+    }
+
+    return hdrlen;
+}
+
 
 
 struct mac_address {
@@ -929,6 +1001,39 @@ struct ieee80211_mgmt {
     } u;
 } __packed __aligned(2);
 
+/* mgmt header + 1 byte category code */
+#define IEEE80211_MIN_ACTION_SIZE offsetof(struct ieee80211_mgmt, u.action.u)
+
+/* Action category code */
+#define WLAN_CATEGORY_BACK 3
+
+/* BACK action code */
+enum ieee80211_back_actioncode {
+    WLAN_ACTION_ADDBA_REQ = 0,
+    WLAN_ACTION_ADDBA_RESP = 1,
+    WLAN_ACTION_DELBA = 2,
+};
+
+/* BACK (block-ack) parties */
+enum ieee80211_back_parties {
+    WLAN_BACK_RECIPIENT = 0,
+    WLAN_BACK_INITIATOR = 1,
+};
+
+/* 802.11n A-MPDU BA parameters */
+#define IEEE80211_ADDBA_PARAM_AMSDU_MASK 0x0001
+#define IEEE80211_ADDBA_PARAM_POLICY_MASK 0x0002
+#define IEEE80211_ADDBA_PARAM_TID_MASK 0x003C
+#define IEEE80211_ADDBA_PARAM_BUF_SIZE_MASK 0xFFC0
+#define IEEE80211_DELBA_PARAM_TID_MASK 0xF000
+#define IEEE80211_DELBA_PARAM_INITIATOR_MASK 0x0800
+
+/* Status codes */
+#define WLAN_STATUS_SUCCESS 0
+
+/* Reason codes */
+#define WLAN_REASON_QSTA_NOT_USE 37
+
 
 
 /**
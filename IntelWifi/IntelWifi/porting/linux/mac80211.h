@@ -12,6 +12,20 @@
 #include <linux/kernel.h>
 #include <net/cfg80211.h>
 
+/** line 104
+ * enum ieee80211_ac_numbers - AC numbers as used in mac80211
+ * @IEEE80211_AC_VO: voice
+ * @IEEE80211_AC_VI: video
+ * @IEEE80211_AC_BE: best effort
+ * @IEEE80211_AC_BK: background
+ */
+enum ieee80211_ac_numbers {
+    IEEE80211_AC_VO        = 0,
+    IEEE80211_AC_VI        = 1,
+    IEEE80211_AC_BE        = 2,
+    IEEE80211_AC_BK        = 3,
+};
+
 // line 135
 #define IEEE80211_INVAL_HW_QUEUE    0xff
 
@@ -1203,6 +1217,8 @@ struct ieee80211_hw {
     u8 n_cipher_schemes;
     const struct ieee80211_cipher_scheme *cipher_schemes;
     u8 max_nan_de_entries;
+    /* there is no ieee80211_local here, so the stopped queues live in hw */
+    unsigned long queue_stopped;
 };
 
 static inline bool _ieee80211_hw_check(struct ieee80211_hw *hw,
@@ -1244,6 +1260,45 @@ ieee80211_vif_type_p2p(struct ieee80211_vif *vif)
     return ieee80211_iftype_p2p(vif->type, vif->p2p);
 }
 
+/**
+ * ieee80211_stop_queue - stop specific queue
+ *
+ * Drivers should use this function instead of netif_stop_queue.
+ *
+ * @hw: pointer as obtained from ieee80211_alloc_hw().
+ * @queue: queue number (counted from zero).
+ */
+static inline void ieee80211_stop_queue(struct ieee80211_hw *hw, int queue)
+{
+    set_bit(queue, &hw->queue_stopped);
+}
+
+/**
+ * ieee80211_wake_queue - wake specific queue
+ *
+ * Drivers should use this function instead of netif_wake_queue.
+ *
+ * @hw: pointer as obtained from ieee80211_alloc_hw().
+ * @queue: queue number (counted from zero).
+ */
+static inline void ieee80211_wake_queue(struct ieee80211_hw *hw, int queue)
+{
+    clear_bit(queue, &hw->queue_stopped);
+}
+
+/**
+ * ieee80211_queue_stopped - test status of the queue
+ *
+ * @hw: pointer as obtained from ieee80211_alloc_hw().
+ * @queue: queue number (counted from zero).
+ *
+ * Return: %true if the queue is stopped. %false otherwise.
+ */
+static inline int ieee80211_queue_stopped(struct ieee80211_hw *hw, int queue)
+{
+    return test_bit(queue, &hw->queue_stopped);
+}
+
 
 
 
@@ -8,12 +8,62 @@
 #ifndef kext_user_shared_h
 #define kext_user_shared_h
 
+#include <stdint.h>
 
 // User client method dispatch selectors.
 enum {
     kIwlClientScan,
+    kIwlClientBusyPoll,
+    kIwlClientHcmdLatency,
+    kIwlClientIrqMod,
     
     kNumberOfMethods // Must be last
 };
 
+/*
+ * Host command latency, from the command going on the ring to its
+ * response. Bucket n counts commands that took [2^(n-1), 2^n) usecs,
+ * bucket 0 the ones under a usec, the last one everything longer.
+ */
+#define IWL_HCMD_LAT_BUCKETS 20
+
+struct iwl_hcmd_lat_hist {
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint32_t count;
+    uint32_t buckets[IWL_HCMD_LAT_BUCKETS];
+};
+
+/* the most sent commands are reported, so the reply fits inline */
+#define IWL_HCMD_LAT_MAX_CMDS 32
+
+// kIwlClientHcmdLatency input: slow command threshold in usecs,
+// 0 to switch slow command logging off, IWL_HCMD_LAT_KEEP to leave it.
+#define IWL_HCMD_LAT_KEEP UINT64_MAX
+
+struct iwl_hcmd_lat_report {
+    uint32_t n_cmds;
+    uint32_t slow_us;
+    struct {
+        uint32_t id;
+        uint32_t reserved;
+        struct iwl_hcmd_lat_hist hist;
+    } cmds[IWL_HCMD_LAT_MAX_CMDS];
+};
+
+// kIwlClientIrqMod output: interrupt moderation setting and rates
+#define IWL_IRQ_MOD_REPORT_LATENCY 0
+#define IWL_IRQ_MOD_REPORT_BULK 1
+
+struct iwl_irq_mod_report {
+    uint32_t mode;
+    uint32_t coalescing_us;
+    uint32_t irq_rate;
+    uint32_t pkt_rate;
+    uint32_t switches;
+    uint32_t isr_rx;
+    uint32_t isr_tx;
+    uint32_t isr_unhandled;
+};
+
 #endif /* kext_user_shared_h */
@@ -98,3 +98,35 @@ void iwmc_scan(struct iwmc_client* client) {
     struct iwmc_priv *priv = IWMC_PRIV(client);
     IOConnectCallScalarMethod(priv->data_port, kIwlClientScan, 0, 0, 0, 0);
 }
+
+/**
+ * Switch busy-poll RX mode on or off
+ */
+int iwmc_busy_poll(struct iwmc_client* client, bool enable) {
+    struct iwmc_priv *priv = IWMC_PRIV(client);
+    uint64_t input = enable;
+    
+    return IOConnectCallScalarMethod(priv->data_port, kIwlClientBusyPoll, &input, 1, 0, 0);
+}
+
+/**
+ * Read the host command latency histograms, setting the slow command
+ * threshold on the way (IWL_HCMD_LAT_KEEP to leave it)
+ */
+int iwmc_hcmd_latency(struct iwmc_client* client, uint64_t slow_us, struct iwl_hcmd_lat_report *report) {
+    struct iwmc_priv *priv = IWMC_PRIV(client);
+    size_t size = sizeof(*report);
+    
+    return IOConnectCallMethod(priv->data_port, kIwlClientHcmdLatency, &slow_us, 1, NULL, 0,
+                               NULL, NULL, report, &size);
+}
+
+/**
+ * Read the interrupt moderation setting and rates
+ */
+int iwmc_irq_mod(struct iwmc_client* client, struct iwl_irq_mod_report *report) {
+    struct iwmc_priv *priv = IWMC_PRIV(client);
+    size_t size = sizeof(*report);
+    
+    return IOConnectCallStructMethod(priv->data_port, kIwlClientIrqMod, NULL, 0, report, &size);
+}
@@ -10,6 +10,10 @@
 #define client_h
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "kext_user_shared.h"
 
 struct iwmc_client {
     void *priv;
@@ -26,6 +30,9 @@ void iwmc_free(struct iwmc_client* client);
  * Commands
  */
 void iwmc_scan(struct iwmc_client* client);
+int iwmc_busy_poll(struct iwmc_client* client, bool enable);
+int iwmc_hcmd_latency(struct iwmc_client* client, uint64_t slow_us, struct iwl_hcmd_lat_report *report);
+int iwmc_irq_mod(struct iwmc_client* client, struct iwl_irq_mod_report *report);
 
 
 #endif /* client_h */
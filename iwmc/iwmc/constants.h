@@ -15,6 +15,9 @@
  * Commands
  */
 #define IWMC_CMD_SCAN "scan"
+#define IWMC_CMD_BUSY_POLL "busypoll"
+#define IWMC_CMD_HCMD_LATENCY "hcmdlat"
+#define IWMC_CMD_IRQ_MOD "irqmod"
 
 
 #endif /* constants_h */
@@ -17,11 +17,42 @@
 #include "constants.h"
 #include "client.h"
 
+/**
+ * Print one line per command: count, average, max and the non-empty
+ * log2 buckets as "<upper bound>:count"
+ */
+static void print_hcmd_latency(const struct iwl_hcmd_lat_report *report) {
+    printf("slow command logging: ");
+    if (report->slow_us) {
+        printf("over %u us\n", report->slow_us);
+    } else {
+        printf("off\n");
+    }
+    
+    for (uint32_t i = 0; i < report->n_cmds; i++) {
+        const struct iwl_hcmd_lat_hist *hist = &report->cmds[i].hist;
+        
+        printf("cmd 0x%02x: %u sent, %llu us avg, %llu us max,", report->cmds[i].id, hist->count,
+               hist->total_ns / hist->count / 1000, hist->max_ns / 1000);
+        for (int b = 0; b < IWL_HCMD_LAT_BUCKETS; b++) {
+            if (!hist->buckets[b]) {
+                continue;
+            }
+            if (b == IWL_HCMD_LAT_BUCKETS - 1) {
+                printf(" >=%uus:%u", 1u << (b - 1), hist->buckets[b]);
+            } else {
+                printf(" <%uus:%u", 1u << b, hist->buckets[b]);
+            }
+        }
+        printf("\n");
+    }
+}
+
 
 int main(int argc, const char * argv[]) {
     
     if (argc < 2) {
-        error("Provide command. Available commands: scan\n");
+        error("Provide command. Available commands: scan, busypoll on|off, hcmdlat [slow usecs], irqmod\n");
         return 1;
     }
     
@@ -36,6 +67,36 @@ int main(int argc, const char * argv[]) {
     if (strcmp(cmd_name, IWMC_CMD_SCAN) == 0) {
         iwmc_scan(client);
         log("Scan command sent to client");
+    } else if (strcmp(cmd_name, IWMC_CMD_BUSY_POLL) == 0) {
+        bool enable = argc > 2 && strcmp(argv[2], "on") == 0;
+        
+        if (iwmc_busy_poll(client, enable) != 0) {
+            error("Failed to switch busy poll\n");
+        } else {
+            log(enable ? "Busy poll switched on\n" : "Busy poll switched off\n");
+        }
+    } else if (strcmp(cmd_name, IWMC_CMD_HCMD_LATENCY) == 0) {
+        uint64_t slow_us = argc > 2 ? strtoull(argv[2], NULL, 10) : IWL_HCMD_LAT_KEEP;
+        struct iwl_hcmd_lat_report report;
+        
+        if (iwmc_hcmd_latency(client, slow_us, &report) != 0) {
+            error("Failed to read host command latency\n");
+        } else {
+            print_hcmd_latency(&report);
+        }
+    } else if (strcmp(cmd_name, IWMC_CMD_IRQ_MOD) == 0) {
+        struct iwl_irq_mod_report report;
+        
+        if (iwmc_irq_mod(client, &report) != 0) {
+            error("Failed to read interrupt moderation\n");
+        } else {
+            printf("mode: %s, coalescing %u us\n",
+                   report.mode == IWL_IRQ_MOD_REPORT_BULK ? "bulk" : "latency", report.coalescing_us);
+            printf("%u interrupts/s, %u packets/s, %u switches\n",
+                   report.irq_rate, report.pkt_rate, report.switches);
+            printf("interrupts: %u rx, %u tx, %u unhandled\n",
+                   report.isr_rx, report.isr_tx, report.isr_unhandled);
+        }
     }
     
     iwmc_free(client);